@@ -0,0 +1,160 @@
+/*
+Copyright 2012 Xixuan (Aaron) Feng and Arun Kumar and Christopher Re
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+ * microbenchmark of the crf forward-backward pass in modules/crf
+ *
+ * runs CRFModel_fwd_bwd over conll-shaped random documents with the
+ * scalar and the host's log domain kernels, against the nested log_sum
+ * recurrences it replaced, and prints tokens per second for each along
+ * with the largest difference of log(z) from the reference.
+ *
+ * usage: ./crf_fwd_bwd [nlabels] [ndocs] [rounds]
+ */
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "utils/numeric.h"
+#include "modules/crf/crf_model.h"
+
+#define NULINES (19)
+#define NBLINES (1)
+#define NDIMS (1 << 20)
+
+static double
+now_ns() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+/* psi[t][yp][y] in full, as the recurrences below used to read it */
+static void
+expand_psi(const int Y, const int T, const struct CRFPsi *psi, double *vfull) {
+	double (*full)[T][Y][Y] = (void *)vfull;
+	int t, yp, y;
+	for (t = 0; t < T; t++) {
+		for (yp = 0; yp < Y; yp++) {
+			for (y = 0; y < Y; y++) {
+				(*full)[t][yp][y] = psi->u[t * Y + y]
+					+ (t > 0 ? psi->b[psi->bix[t] * Y * Y + yp * Y + y] : 0.0);
+			}
+		}
+	}
+}
+
+/* the forward-backward pass before the log domain kernels */
+static double
+fwd_bwd_log_sum(const int Y, const int T, const double *vpsi, double *valpha,
+		double *vbeta) {
+	const double(*psi)[T][Y][Y] = (void *)vpsi;
+	double 		(*alpha)[T][Y] 	= (void *)valpha;
+	double 		(*beta )[T][Y] 	= (void *)vbeta;
+	double z = 0.0;
+	int y, yp, t;
+	for (y = 0; y < Y; y++) {
+		(*alpha)[0][y] = (*psi)[0][0][y];
+	}
+	for (t = 1; t < T; t++) {
+		for (y = 0; y < Y; y++) {
+			double sum = (*alpha)[t - 1][0] + (*psi)[t][0][y];
+			for (yp = 1; yp < Y; yp++)
+				sum = log_sum((*alpha)[t - 1][yp] + (*psi)[t][yp][y], sum);
+			(*alpha)[t][y] = sum;
+		}
+	}
+	for (yp = 0; yp < Y; yp++) {
+		(*beta)[T - 1][yp] = 0;
+	}
+	for (t = T - 1; t > 0; t--) {
+		for (yp = 0; yp < Y; yp++) {
+			double sum = (*beta)[t][0] + (*psi)[t][yp][0];
+			for (y = 1; y < Y; y++)
+				sum = log_sum((*beta)[t][y] + (*psi)[t][yp][y], sum);
+			(*beta)[t - 1][yp] = sum;
+		}
+	}
+	z += (*alpha)[T - 1][0];
+	for (y = 1; y < Y; y++)
+		z = log_sum(z, (*alpha)[T - 1][y]);
+	return z;
+}
+
+int
+main(int argc, char **argv) {
+	const int Y = argc > 1 ? atoi(argv[1]) : 22;
+	const int ndocs = argc > 2 ? atoi(argv[2]) : 2000;
+	const int rounds = argc > 3 ? atoi(argv[3]) : 5;
+	struct CRFModel *ptrModel = malloc(sizeof(struct CRFModel) + sizeof(double) * NDIMS);
+	struct Example *docs = malloc(sizeof(struct Example) * ndocs);
+	struct CRFPsi *psi = malloc(sizeof(struct CRFPsi) * ndocs);
+	double **full = malloc(sizeof(double *) * ndocs);
+	double *ref = malloc(sizeof(double) * ndocs);
+	double *alpha, *beta;
+	struct NumericKernels host = numeric_kernels;
+	long ntokens = 0;
+	int maxT = 0, i, j, r, v;
+
+	CRFModel_init(ptrModel, 1, Y, ndocs, NDIMS, NULINES, NBLINES, 0, 0.1, 1);
+	srand(1);
+	for (i = 0; i < NDIMS; i++) {
+		ptrModel->w[i] = 0.5 * ((double) rand() / RAND_MAX - 0.5);
+	}
+	// sentences of 5 to 45 tokens, observations anywhere in w
+	for (i = 0; i < ndocs; i++) {
+		int T = 5 + rand() % 41;
+		docs[i].len = T;
+		docs[i].labels = malloc(sizeof(int) * T);
+		docs[i].uObs = malloc(sizeof(int) * T * NULINES);
+		docs[i].bObs = malloc(sizeof(int) * T * NBLINES);
+		for (j = 0; j < T * NULINES; j++) { docs[i].uObs[j] = rand() % (NDIMS - Y); }
+		for (j = 0; j < T * NBLINES; j++) { docs[i].bObs[j] = rand() % (NDIMS - Y * Y); }
+		CRFPsi_init(&psi[i], malloc(sizeof(double) * T * Y * (Y + 1) + sizeof(double) * T), T, Y);
+		CRFModel_compute_psi(ptrModel, &docs[i], &psi[i]);
+		full[i] = malloc(sizeof(double) * T * Y * Y);
+		expand_psi(Y, T, &psi[i], full[i]);
+		ntokens += T;
+		if (T > maxT) { maxT = T; }
+	}
+	alpha = malloc(sizeof(double) * maxT * Y);
+	beta = malloc(sizeof(double) * maxT * Y);
+
+	printf("crf forward-backward, %d labels, %d docs, %ld tokens, host log kernels: %s\n",
+			Y, ndocs, ntokens, host.log_name);
+	printf("%-10s %14s %14s\n", "engine", "tokens/s", "max |dz|");
+	for (v = 0; v < 3; v++) {
+		const char *name = v == 0 ? "log_sum" : (v == 1 ? "scalar" : host.log_name);
+		double start, elapsed, maxdiff = 0.0;
+		if (v == 2 && host.log_vm == log_vm_scalar) { break; }
+		numeric_kernels.log_vm = v == 1 ? log_vm_scalar : host.log_vm;
+		numeric_kernels.log_mv = v == 1 ? log_mv_scalar : host.log_mv;
+		start = now_ns();
+		for (r = 0; r < rounds; r++) {
+			for (i = 0; i < ndocs; i++) {
+				double z = v == 0
+					? fwd_bwd_log_sum(Y, docs[i].len, full[i], alpha, beta)
+					: CRFModel_fwd_bwd(ptrModel, &docs[i], &psi[i], alpha, beta);
+				if (v == 0) { ref[i] = z; }
+				if (fabs(z - ref[i]) > maxdiff) { maxdiff = fabs(z - ref[i]); }
+			}
+		}
+		elapsed = now_ns() - start;
+		printf("%-10s %14.0f %14.2e\n", name, ntokens * rounds / (elapsed * 1e-9), maxdiff);
+	}
+	numeric_kernels = host;
+	return 0;
+}
@@ -0,0 +1,147 @@
+/*
+Copyright 2012 Xixuan (Aaron) Feng and Arun Kumar and Christopher Re
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/**
+ * microbenchmark of the sparse kernels in utils/numeric_simd.h
+ *
+ * for each nonzero count, times one sparse_logit_grad-like step
+ * (dot_dss + add_and_scale_dss + l1_shrink_mask) per variant against a
+ * dblife-sized weight vector, and checks each variant against scalar.
+ * "dispatch" is what the models run: the wrappers of numeric.h, scalar
+ * below SPARSE_GATHER_MIN nonzeros and the host's kernels from there.
+ *
+ * usage: ./sparse_kernels [ndims] [rounds]
+ */
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "utils/numeric.h"
+
+struct SparseVariant {
+	const char *name;
+	int usable;
+	double (*dot_dss)(const double *, const int *, const double *, const int);
+	void   (*add_and_scale_dss)(double *, const int *, const double *, const int, const double);
+	void   (*l1_shrink_mask)(double *, const double, const int *, const int);
+};
+
+static double
+dot_dss_dispatch(const double *x, const int *k, const double *v, const int sparseSize) {
+	return dot_dss(x, k, v, sparseSize);
+}
+
+static void
+add_and_scale_dss_dispatch(double *x, const int *k, const double *v, const int sparseSize, const double c) {
+	add_and_scale_dss(x, k, v, sparseSize, c);
+}
+
+static void
+l1_shrink_mask_dispatch(double *x, const double u, const int *k, const int sparseSize) {
+	l1_shrink_mask(x, u, k, sparseSize);
+}
+
+static double
+now_ns() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+/* nnz distinct random indices in [0, ndims), unsorted like real k[] */
+static void
+draw_indices(int *k, const int nnz, const int ndims, char *seen) {
+	int i = 0;
+	memset(seen, 0, ndims);
+	while (i < nnz) {
+		int o = rand() % ndims;
+		if (!seen[o]) { seen[o] = 1; k[i++] = o; }
+	}
+}
+
+int
+main(int argc, char **argv) {
+	const int ndims = argc > 1 ? atoi(argv[1]) : 41270;
+	const int rounds = argc > 2 ? atoi(argv[2]) : 200000;
+	const int nnzs[] = {8, 32, 128, 256, 512, 2048};
+	const int nBatch = 64;	// distinct sparse vectors cycled through
+	struct SparseVariant vs[] = {
+		{"scalar", 1, dot_dss_scalar, add_and_scale_dss_scalar, l1_shrink_mask_scalar},
+#ifdef NUMERIC_X86
+		{"avx2", __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"),
+			dot_dss_avx2, add_and_scale_dss_avx2, l1_shrink_mask_avx2},
+		{"avx512", __builtin_cpu_supports("avx512f"),
+			dot_dss_avx512, add_and_scale_dss_avx512, l1_shrink_mask_avx512},
+#endif
+		{"dispatch", 1, dot_dss_dispatch, add_and_scale_dss_dispatch, l1_shrink_mask_dispatch},
+	};
+	const int nVariants = sizeof(vs) / sizeof(vs[0]);
+	double *w = malloc(sizeof(double) * ndims);
+	double *wref = malloc(sizeof(double) * ndims);
+	char *seen = malloc(ndims);
+	int n, b, r, x, i;
+
+	printf("ndims %d, rounds %d, dispatched sparse kernels: %s\n",
+			ndims, rounds, numeric_kernels.sparse_name);
+	printf("%8s", "nnz");
+	for (x = 0; x < nVariants; x++) { printf("%12s", vs[x].name); }
+	printf("   (ns per step)\n");
+
+	for (n = 0; n < (int) (sizeof(nnzs) / sizeof(nnzs[0])); n++) {
+		const int nnz = nnzs[n] < ndims ? nnzs[n] : ndims;
+		int *k = malloc(sizeof(int) * nnz * nBatch);
+		double *v = malloc(sizeof(double) * nnz * nBatch);
+		for (b = 0; b < nBatch; b++) {
+			draw_indices(k + b * nnz, nnz, ndims, seen);
+			for (i = 0; i < nnz; i++) { v[b * nnz + i] = (double) rand() / RAND_MAX; }
+		}
+		printf("%8d", nnz);
+		for (x = 0; x < nVariants; x++) {
+			double sink = 0.0, start;
+			if (!vs[x].usable) { printf("%12s", "n/a"); continue; }
+			for (i = 0; i < ndims; i++) { w[i] = 0.01 * (i % 7); }
+			start = now_ns();
+			for (r = 0; r < rounds; r++) {
+				const int *kb = k + (r % nBatch) * nnz;
+				const double *vb = v + (r % nBatch) * nnz;
+				double wx = vs[x].dot_dss(w, kb, vb, nnz);
+				vs[x].add_and_scale_dss(w, kb, vb, nnz, 1e-3 * sigma(-wx));
+				vs[x].l1_shrink_mask(w, 1e-6, kb, nnz);
+				sink += wx;
+			}
+			printf("%12.1f", (now_ns() - start) / rounds);
+			// correctness against scalar, on the final weights
+			if (x == 0) {
+				memcpy(wref, w, sizeof(double) * ndims);
+			} else {
+				for (i = 0; i < ndims; i++) {
+					if (fabs(w[i] - wref[i]) > 1e-9 * (1 + fabs(wref[i]))) {
+						fprintf(stderr, "\n%s differs from scalar at w[%d]\n", vs[x].name, i);
+						return 1;
+					}
+				}
+			}
+			if (sink != sink) { fprintf(stderr, "nan\n"); }
+		}
+		printf("\n");
+		free(k);
+		free(v);
+	}
+	free(w);
+	free(wref);
+	free(seen);
+	return 0;
+}
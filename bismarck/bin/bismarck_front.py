@@ -19,6 +19,7 @@ import imp
 import psycopg2
 from cStringIO import StringIO
 import random
+import time
 
 VERBOSE = False
 SHUFFLE_PREFIX = '__bismarck_shuffled_'
@@ -28,6 +29,8 @@ MODELS = (
 		'factor',
 		'crf',
 		)
+# models with a shared-memory build keeping the weights in float4
+FLOAT4_MODELS = ('sparse_logit', 'sparse_svm', 'factor')
 PARAMS = {
 		# required
 		'model' : None,
@@ -51,9 +54,26 @@ PARAMS = {
 		'stepsize' : 0.1,
 		'decay' : 1,
 		'mu' : 1e-2,
+		'batchsize' : 1,
+		'l2' : 0,
 		'B' : 2,
 		'is_shmem' : False,
 		'is_shuffle' : True,
+		'float4' : False,
+		# threads of one backend (crf hogwild, factor dsgd, with is_shmem)
+		'nthreads' : 1,
+		# factor vectors in shared memory: dense, padded or frequency
+		'layout' : 'dense',
+		# snapshot the model in shared memory to this file (of the db server)
+		# every checkpoint_every epochs, or every checkpoint_seconds if set
+		'checkpoint_file' : None,
+		'checkpoint_every' : 1,
+		'checkpoint_seconds' : None,
+		# restore the model from checkpoint_file and go on after its epochs
+		'resume' : False,
+		# the loss of an epoch from the same scan as its gradient, each
+		# tuple against the model before its step
+		'is_fused' : False,
 		# optional
 		'tolerance' : None,
 		'output_file' : None,
@@ -116,12 +136,26 @@ class Model(object) :
 		self.decay = PARAMS['decay']
 		self.is_shmem = PARAMS['is_shmem']
 		self.is_shuffle = PARAMS['is_shuffle']
+		self.float4 = PARAMS['float4']
 		self.tolerance = PARAMS['tolerance']
 		self.output_file = PARAMS['output_file']
+		self.checkpoint_file = PARAMS['checkpoint_file']
+		self.checkpoint_every = PARAMS['checkpoint_every']
+		self.checkpoint_seconds = PARAMS['checkpoint_seconds']
+		self.resume = PARAMS['resume']
+		self.is_fused = PARAMS['is_fused']
+		# epochs done before this run, when resumed
+		self.first_iter = 0
+		self.last_checkpoint = time.time()
 
 	def prep(self) :
 		self.insert_model_tuple()
-		if self.is_shuffle :
+		# in shared memory the table is read in a new random order of its
+		# blocks every epoch, the aggregate takes a shuffled copy of it, and
+		# so does shared memory where block_rows does not work (Greenplum)
+		self.is_block_shuffle = self.is_shuffle and self.is_shmem and \
+				DB.execute_and_fetch('SELECT block_rows_supported()')[0][0]
+		if self.is_shuffle and not self.is_block_shuffle :
 			tmp_table = SHUFFLE_PREFIX + self.data_table + \
 					'_' + str(self.model_id)
 			DB.execute("""
@@ -132,13 +166,27 @@ class Model(object) :
 						self.label_col,	self.data_table))
 			self.data_table = tmp_table
 			print 'A shuffled table %s is created for training' % tmp_table
-		if self.is_shmem :
+		if self.float4 :
+			if self.is_shmem and self.model in FLOAT4_MODELS :
+				self.model += '_f4'
+			else :
+				print >> sys.stderr, 'float4 ignored, only available for shared-memory', \
+						', '.join(FLOAT4_MODELS)
+		if self.is_shmem and self.resume :
+			self.first_iter = self.shmem_restore()
+			print 'Resumed from %s after iteration %d' % \
+					(self.checkpoint_file, self.first_iter)
+		elif self.is_shmem :
 			self.shmem_push()
 
 	def iteration(self) :
-		if self.is_shmem :
+		if self.is_shmem and self.is_fused :
+			return self.shmem_grad_loss()
+		elif self.is_shmem :
 			self.shmem_grad()
 			return self.shmem_loss()
+		elif self.is_fused :
+			return self.agg_grad_loss()
 		else :
 			self.agg_grad()
 			return self.agg_loss()
@@ -153,6 +201,22 @@ class Model(object) :
 		DB.execute('SELECT {0}_shmem_push({1}.*) FROM {1} WHERE mid = {2}'
 				.format(self.model, self.model_table, self.model_id))
 
+	def shmem_restore(self) :
+		return DB.execute_and_fetch("SELECT {0}_shmem_restore({1}, '{2}')"
+				.format(self.model, self.model_id, self.checkpoint_file))[0][0]
+
+	def checkpoint(self, epoch) :
+		if not self.is_shmem or self.checkpoint_file is None :
+			return
+		if self.checkpoint_seconds is not None :
+			if time.time() - self.last_checkpoint < self.checkpoint_seconds :
+				return
+		elif epoch % self.checkpoint_every != 0 :
+			return
+		DB.execute("SELECT {0}_shmem_checkpoint({1}, '{2}', {3})"
+				.format(self.model, self.model_id, self.checkpoint_file, epoch))
+		self.last_checkpoint = time.time()
+
 	def shmem_pop(self) :
 		DB.execute("""
 			UPDATE {1} SET w = (SELECT {0}_shmem_pop({2})) 
@@ -160,12 +224,31 @@ class Model(object) :
 			""".format(self.model, self.model_table, self.model_id))
 
 	def shmem_grad(self) :
-		DB.execute('SELECT count({0}_grad({1}, {2}, {3})) FROM {4}'
-				.format(self.model, self.model_id, self.feature_cols, 
-					self.label_col, self.data_table))
+		grad = 'count({0}_grad({1}, {2}, {3}))'.format(self.model, 
+				self.model_id, self.feature_cols, self.label_col)
+		if self.is_block_shuffle :
+			DB.execute("SELECT shuffled_scan('{0}', '{1}', {2})"
+					.format(grad.replace("'", "''"), self.data_table,
+						random.randint(0, 2 ** 31 - 1)))
+		else :
+			DB.execute('SELECT {0} FROM {1}'.format(grad, self.data_table))
 		DB.execute('SELECT {0}_shmem_step({1})'
 				.format(self.model, self.model_id))
 
+	def shmem_grad_loss(self) :
+		grad_loss = 'sum({0}_grad_loss({1}, {2}, {3}))'.format(self.model,
+				self.model_id, self.feature_cols, self.label_col)
+		if self.is_block_shuffle :
+			loss = DB.execute_and_fetch("SELECT shuffled_scan('{0}', '{1}', {2})"
+					.format(grad_loss.replace("'", "''"), self.data_table,
+						random.randint(0, 2 ** 31 - 1)))[0][0]
+		else :
+			loss = DB.execute_and_fetch('SELECT {0} FROM {1}'
+					.format(grad_loss, self.data_table))[0][0]
+		DB.execute('SELECT {0}_shmem_step({1})'
+				.format(self.model, self.model_id))
+		return loss
+
 	def shmem_loss(self) :
 		return DB.execute_and_fetch("""
 			SELECT {0}({1}_loss({2}, {3}, {4})) FROM {5}
@@ -190,6 +273,28 @@ class Model(object) :
 			WHERE mid = {1}
 			""".format(self.model_table, self.model_id))
 
+	def agg_grad_loss(self) :
+		# the fused aggregate returns {loss, w}
+		loss = DB.execute_and_fetch("""
+			UPDATE {0} SET w = wl[2:array_upper(wl, 1)]
+			FROM (
+				SELECT {1}_fused_agg(
+					{2}, {3},
+					(SELECT {1}_serialize({0}.*) FROM {0} WHERE mid = {4})
+					) AS wl
+				FROM {5}
+				) fused
+			WHERE mid = {4}
+			RETURNING wl[1]
+			""".format(self.model_table, self.model, self.feature_cols, 
+					self.label_col, self.model_id, self.data_table))[0][0]
+		DB.execute("""
+			UPDATE {0} SET stepsize = 
+					(SELECT stepsize * decay FROM {0} WHERE mid = {1})
+			WHERE mid = {1}
+			""".format(self.model_table, self.model_id))
+		return loss
+
 	def agg_loss(self) :
 		return DB.execute_and_fetch("""
 			SELECT {0}({1}_loss(
@@ -213,13 +318,16 @@ class LinearModel(Model) :
 		self.ndims = PARAMS['ndims']
 		self.w = [0.0 for _ in range(self.ndims)]
 		self.mu = PARAMS['mu']
+		self.batchsize = PARAMS['batchsize']
+		self.l2 = PARAMS['l2']
 		self.model_table = 'linear_model'
 		self.agg = 'sum'
 
 	def insert_model_tuple(self) :
 		DB.insert_model(self.model_table, self.model_id, self.w,
 				ntuples=self.ntuples, ndims=self.ndims, mu=self.mu,
-				stepsize=self.stepsize, decay=self.decay)
+				stepsize=self.stepsize, decay=self.decay,
+				batchsize=self.batchsize, l2=self.l2)
 
 class dense_logit(LinearModel) :
 	def __init__(self) :
@@ -254,6 +362,41 @@ class factor(Model) :
 		self.B = PARAMS['B']
 		self.model_table = 'factor_model'
 		self.agg = 'rmse'
+		self.nthreads = PARAMS['nthreads']
+		self.layout = PARAMS['layout']
+
+	def shmem_push(self) :
+		if self.layout == 'dense' :
+			return super(factor, self).shmem_push()
+		if self.layout == 'padded' :
+			orders = "'{}', '{}'"
+		elif self.layout == 'frequency' :
+			orders = "factor_frequency_order('{0}', 'row'), factor_frequency_order('{0}', 'col')" \
+					.format(self.data_table)
+		else :
+			sys.exit('unknown layout %s, use dense, padded or frequency' % self.layout)
+		DB.execute('SELECT {0}_shmem_push({1}.*, true, {2}) FROM {1} WHERE mid = {3}'
+				.format(self.model, self.model_table, orders, self.model_id))
+
+	def shmem_grad(self) :
+		if self.nthreads <= 1 :
+			return super(factor, self).shmem_grad()
+		DB.execute("SELECT {0}_shmem_dsgd({1}, '{2}', {3})"
+				.format(self.model, self.model_id, self.data_table, self.nthreads))
+		DB.execute('SELECT {0}_shmem_step({1})'
+				.format(self.model, self.model_id))
+
+	def shmem_grad_loss(self) :
+		# dsgd has its loss scan after the epoch
+		if self.nthreads > 1 :
+			self.shmem_grad()
+			return self.shmem_loss()
+		# the squared errors summed, as rmse
+		return (super(factor, self).shmem_grad_loss() / self.ntuples) ** 0.5
+
+	def agg_grad_loss(self) :
+		# the squared errors summed, as rmse
+		return (super(factor, self).agg_grad_loss() / self.ntuples) ** 0.5
 
 	def insert_model_tuple(self) :
 		DB.insert_model(self.model_table, self.model_id, self.w,
@@ -273,6 +416,27 @@ class crf(Model) :
 		self.mu = PARAMS['mu']
 		self.model_table = 'crf_model'
 		self.agg = 'sum'
+		self.nthreads = PARAMS['nthreads']
+
+	def shmem_grad(self) :
+		if self.nthreads <= 1 :
+			return super(crf, self).shmem_grad()
+		DB.execute("SELECT crf_shmem_train({0}, '{1}', {2})"
+				.format(self.model_id, self.data_table, self.nthreads))
+		DB.execute('SELECT {0}_shmem_step({1})'
+				.format(self.model, self.model_id))
+
+	def shmem_grad_loss(self) :
+		# the threads have their loss scan after the epoch
+		if self.nthreads > 1 :
+			self.shmem_grad()
+			return self.shmem_loss()
+		return super(crf, self).shmem_grad_loss()
+
+	def agg_grad_loss(self) :
+		# the crf aggregate has no fused version, its loss scan follows
+		self.agg_grad()
+		return self.agg_loss()
 
 	def insert_model_tuple(self) :
 		DB.insert_model(self.model_table, self.model_id, self.w,
@@ -308,11 +472,12 @@ def main() :
 	# main control block
 	model.prep()
 	previous_loss = 0.0
-	for i in range(model.num_iters) :
+	for i in range(model.first_iter, model.num_iters) :
 		current_loss = model.iteration()
+		model.checkpoint(i + 1)
 		# info
 		improvement = None
-		if i > 0 and previous_loss != 0.0:
+		if i > model.first_iter and previous_loss != 0.0:
 			improvement = (previous_loss - current_loss) / previous_loss
 		print 'iteration', i + 1, '\tloss:', current_loss,\
 				'\timprovement: ', improvement
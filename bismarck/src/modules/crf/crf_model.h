@@ -18,6 +18,13 @@ limitations under the License.
 #define crf_model_h
 
 #define META_LEN (11)
+// wscale is folded into w once it got this small
+#define CRF_WSCALE_MIN (1e-9)
+
+// the crf weights are always kept in double, see weight_t in numeric.h
+#ifdef W_FLOAT4
+#error "W_FLOAT4 is not supported by crf"
+#endif
 
 struct Example {
 	int  len;
@@ -26,10 +33,24 @@ struct Example {
     int *bObs;
 };
 
+/**
+ * transition scores of one document in factored form,
+ * psi[t][yp][y] = u[t][y] + b[bix[t]][yp][y].
+ * u holds the unigram scores (T x Y), b one Y x Y block of bigram scores
+ * per distinct run of bigram observations, so a document whose positions
+ * share their bigram observations (the conll templates) has a single
+ * block. bix[0] is unused, position 0 has no bigram part
+ */
+struct CRFPsi {
+	double *u;
+	double *b;
+	int    *bix;
+};
+
 /** a structure for model parameters and meta data */
 struct CRFModel {
     int mid;
-    int token;
+    struct SpinLock lock;
 	// meta data
 	int nLabels;
 	int nTuples;
@@ -57,7 +78,7 @@ CRFModel_init(struct CRFModel *ptrModel, int mid,
 		int nLabels, int nTuples, int nDims, int nULines, int nBLines,
 		double mu, double step, double decay) {
     ptrModel->mid = mid;
-    ptrModel->token = 0;
+    spin_lock_init(&(ptrModel->lock));
 	// meta data
     ptrModel->nLabels = nLabels;
     ptrModel->nTuples = nTuples;
@@ -101,16 +122,101 @@ inline void
 CRFModel_regularize(struct CRFModel *ptrModel) {
 	// regularization
 	ptrModel->wscale *= 1 - ptrModel->mu * ptrModel->stepsize;
-	if (ptrModel->wscale < 1e-9) {
-		scale_i(ptrModel->w, ptrModel->nDims, ptrModel->wscale);
-		ptrModel->wscale = 1;
+	// folding rewrites all of w, so it is only done here when w is ours
+	// (aggregate state) or the model lock is held; the lock-free builds
+	// fold with CRFModel_scale_shared after the step
+#if defined(VAGG) || defined(VLOCK)
+	if (ptrModel->wscale < CRF_WSCALE_MIN) {
+		CRFModel_scale(ptrModel);
+	}
+#endif
+}
+
+/**
+ * fold wscale of a shared model back into w once it got too small, under
+ * the model lock. lock-free steps publish their decay multiplicatively,
+ * so dividing out what was folded keeps those that race the fold
+ */
+inline void
+CRFModel_scale_shared(struct CRFModel *ptrSharedModel) {
+	spin_lock(&(ptrSharedModel->lock));
+	// another backend may have folded it while we waited
+	double wscale = ptrSharedModel->wscale;
+	if (wscale < CRF_WSCALE_MIN) {
+		scale_i((double *)(&(ptrSharedModel->w) + 1), ptrSharedModel->nDims, wscale);
+		atomic_scale_double(&(ptrSharedModel->wscale), 1 / wscale);
+	}
+	spin_unlock(&(ptrSharedModel->lock));
+}
+
+/**
+ * scratch space for the trellis buffers of one document (psi, alpha, beta
+ * and the viterbi paths), shared by all entry points of a backend. it grows
+ * geometrically to the largest document seen and is kept by the backend,
+ * so after the first few documents no heap call is made per document.
+ * every thread has its own, threads other than the backend's give it back
+ * with CRFScratch_release before they exit
+ */
+struct CRFScratch {
+	size_t  cap;	// in doubles
+	double *buf;
+	int     failed;	// a document was skipped for want of it
+};
+
+__thread struct CRFScratch crf_scratch = {0, NULL, 0};
+
+/**
+ * space for n doubles, the content is not kept across calls. NULL when
+ * malloc fails, and the document is then skipped; worker threads must not
+ * elog, so callers learn of it from CRFScratch_failed after the call
+ */
+inline double *
+CRFScratch_get(size_t n) {
+	if (n > crf_scratch.cap) {
+		size_t cap = crf_scratch.cap < 4096 ? 4096 : crf_scratch.cap;
+		while (cap < n) { cap *= 2; }
+		free(crf_scratch.buf);
+		crf_scratch.buf = malloc(sizeof(double) * cap);
+		crf_scratch.cap = crf_scratch.buf == NULL ? 0 : cap;
+		if (crf_scratch.buf == NULL) { crf_scratch.failed = 1; }
 	}
+	return crf_scratch.buf;
+}
+
+/**
+ * whether a document was skipped since the last call, for want of scratch
+ */
+inline int
+CRFScratch_failed(void) {
+	int failed = crf_scratch.failed;
+	crf_scratch.failed = 0;
+	return failed;
+}
+
+inline void
+CRFScratch_release(void) {
+	free(crf_scratch.buf);
+	crf_scratch.buf = NULL;
+	crf_scratch.cap = 0;
+}
+
+/**
+ * carve the arrays of a CRFPsi for T positions out of buf,
+ * returns the first double after them
+ */
+inline double *
+CRFPsi_init(struct CRFPsi *psi, double *buf, const int T, const int Y) {
+	psi->u = buf;
+	psi->b = buf + T * Y;
+	psi->bix = (int *)(psi->b + T * Y * Y);
+	// T ints take at most T doubles
+	return psi->b + T * Y * Y + T;
 }
 
 static void
 CRFModel_compute_psi(	const struct CRFModel   *ptrModel,	// model
 						const struct Example 	*ptrDoc,	// document
-						double 					*vpsi) {	// output
+						struct CRFPsi 			*psi) {		// output
 	// fixed number of unigram and bigram observations of each position
 	// bounds
 	const int 	  U 			= ptrModel->nULines;
@@ -122,10 +228,12 @@ CRFModel_compute_psi(	const struct CRFModel   *ptrModel,	// model
 	const double wscale			= ptrModel->wscale;
 	const int 	(*uObs)[T][U] 	= (void *)ptrDoc->uObs;
 	const int 	(*bObs)[T][B] 	= (void *)ptrDoc->bObs;
-	// array (out)
-	double 		(*psi)[T][Y][Y] = (void *)vpsi;
-	// unigram features
-	int t, y, yp, n, d;
+	// arrays (out)
+	double 		(*u)[T][Y] 		= (void *)psi->u;
+	double 		(*b)[T][Y * Y] 	= (void *)psi->b;
+	int 		 *bix 			= psi->bix;
+	// unigram features, scaled as they are summed
+	int t, y, n, d, k = -1;
 	for (t = 0; t < T; t++) {
 		for (y = 0; y < Y; y++) {
 			double sum = 0.0;
@@ -133,86 +241,72 @@ CRFModel_compute_psi(	const struct CRFModel   *ptrModel,	// model
 				const int o = (*uObs)[t][n];
 				sum += w[o + y];
 			}
-			for (yp = 0; yp < Y; yp++)
-				(*psi)[t][yp][y] = sum;
+			(*u)[t][y] = sum * wscale;
 		}
 	}
-	// bigram features, starting from 1 instead of 0
+	// bigram features, starting from 1 instead of 0, a new block only
+	// when the observations differ from those of the previous position
 	for (t = 1; t < T; t++) {
-		for (yp = 0, d = 0; yp < Y; yp++) {
-			for (y = 0; y < Y; y++, d++) {
+		if (k < 0 || memcmp((*bObs)[t], (*bObs)[t - 1], sizeof(int) * B) != 0) {
+			k++;
+			for (d = 0; d < Y * Y; d++) {
 				double sum = 0.0;
 				for (n = 0; n < B; n++) {
 					const int o = (*bObs)[t][n];
 					sum += w[o + d];
 				}
-				(*psi)[t][yp][y] += sum;
+				(*b)[k][d] = sum * wscale;
 			}
 		}
+		bix[t] = k;
 	}
-	// scaling
-	for (t = 0; t < T; t++) {
-		for (yp = 0; yp < Y; yp++) {
-			for (y = 0; y < Y; y++) {
-				(*psi)[t][yp][y] *= wscale;
-			}
-		}
-	}
-//	// map to exponential and done
-//	for (t = 0; t < T; t++) {
-//		for (yp = 0; yp < Y; yp++) {
-//			for (y = 0; y < Y; y++) {
-//				(*psi)[t][yp][y] = exp((*psi)[t][yp][y]);
-//			}
-//		}
-//	}
 }
 
 static double
 CRFModel_fwd_bwd(	const struct CRFModel   *ptrModel,	// model
 					const struct Example 	*ptrDoc,	// document
-					const double			*vpsi,		// transition scores, trellis
+					const struct CRFPsi		*psi,		// transition scores, factored
 					double 					*valpha,	// output 1
 					double 					*vbeta) {	// output 2
 	// bounds
 	const int 	  Y 			= ptrModel->nLabels;
 	const int 	  T 			= ptrDoc->len;
 	// arrays (in)
-	const double(*psi)[T][Y][Y] = (void *)vpsi;
+	const double(*u)[T][Y] 		= (void *)psi->u;
+	const double(*b)[T][Y * Y] 	= (void *)psi->b;
+	const int 	 *bix 			= psi->bix;
 	// array and z(out)
 	double 		(*alpha)[T][Y] 	= (void *)valpha;
 	double 		(*beta )[T][Y] 	= (void *)vbeta;
 	double  	  z				= 0.0;
+	// unigram and beta of one position
+	double 		  v[Y];
 	// iters
 	int y, yp, t;
-	// forward
+	// forward, alpha[t][y] = log sum_yp exp(alpha[t - 1][yp] + psi[t][yp][y]),
+	// a log-sum-exp down each column of the bigram block, plus u[t][y]
 	for (y = 0; y < Y; y++) {
-		(*alpha)[0][y] = (*psi)[0][0][y];
+		(*alpha)[0][y] = (*u)[0][y];
 	}
 	for (t = 1; t < T; t++) {
+		log_vm((*alpha)[t - 1], (*b)[bix[t]], Y, (*alpha)[t]);
 		for (y = 0; y < Y; y++) {
-			double sum = (*alpha)[t - 1][0] + (*psi)[t][0][y];
-			for (yp = 1; yp < Y; yp++)
-				sum = log_sum((*alpha)[t - 1][yp] + (*psi)[t][yp][y], sum);
-			(*alpha)[t][y] = sum;
+			(*alpha)[t][y] += (*u)[t][y];
 		}
 	}
-	// backward
+	// backward, beta[t - 1][yp] = log sum_y exp(psi[t][yp][y] + beta[t][y]),
+	// along each row of the block
 	for (yp = 0; yp < Y; yp++) {
 		(*beta)[T - 1][yp] = 0;
 	}
 	for (t = T - 1; t > 0; t--) {
-		for (yp = 0; yp < Y; yp++) {
-			double sum = (*beta)[t][0] + (*psi)[t][yp][0];
-			for (y = 1; y < Y; y++)
-				sum = log_sum((*beta)[t][y] + (*psi)[t][yp][y], sum);
-			(*beta)[t - 1][yp] = sum;
+		for (y = 0; y < Y; y++) {
+			v[y] = (*u)[t][y] + (*beta)[t][y];
 		}
+		log_mv((*b)[bix[t]], v, Y, (*beta)[t - 1]);
 	}
 	// log(z)
-	z += (*alpha)[T - 1][0];
-	for (y = 1; y < Y; y++)
-		z = log_sum(z, (*alpha)[T - 1][y]);
+	z = log_sum_exp((*alpha)[T - 1], Y);
 	// assert consistency between alpha and beta
 //	double checkz = (*beta)[0][0];
 //	 for (y = 1; y < Y; y++)
@@ -227,22 +321,24 @@ CRFModel_fwd_bwd(	const struct CRFModel   *ptrModel,	// model
 static double
 CRFModel_log_score(	const struct CRFModel   *ptrModel,	// model
 					const struct Example 	*ptrDoc,	// document
-					const double			*vpsi) {	// transition scores, trellis
+					const struct CRFPsi		*psi) {		// transition scores, factored
 	// fixed number of unigram and bigram observations of each position
 	// bounds
 	const int 	  Y 			= ptrModel->nLabels;
 	const int 	  T 			= ptrDoc->len;
 	// arrays (in)
 	const int 	 *labels		= (void *)ptrDoc->labels;
-	const double(*psi)[T][Y][Y] = (void *)vpsi;
+	const double(*u)[T][Y] 		= (void *)psi->u;
+	const double(*b)[T][Y * Y] 	= (void *)psi->b;
+	const int 	 *bix 			= psi->bix;
 	// score (out)
 	double 		  score			= 0.0;
 	// iter
 	int t;
 	// sum up transitions
-	score = (*psi)[0][0][labels[0]];
+	score = (*u)[0][labels[0]];
 	for (t = 1; t < T; t++) {
-		score += (*psi)[t][labels[t-1]][labels[t]];
+		score += (*u)[t][labels[t]] + (*b)[bix[t]][labels[t-1] * Y + labels[t]];
 	}
 	return score;
 }
@@ -250,7 +346,7 @@ CRFModel_log_score(	const struct CRFModel   *ptrModel,	// model
 static void
 CRFModel_do_grad(	struct CRFModel   		*ptrModel,	// model
 					const struct Example 	*ptrDoc,	// document
-					const double			*vpsi,		// transition scores, trellis
+					const struct CRFPsi		*psi,		// transition scores, factored
 					const double			*valpha,	// forward scores
 					const double			*vbeta,		// backward scores
 					const double			 z) {		// normalization factor
@@ -264,7 +360,9 @@ CRFModel_do_grad(	struct CRFModel   		*ptrModel,	// model
 	const int 	 *labels		= (void *)ptrDoc->labels;
 	const int 	(*uObs)[T][U] 	= (void *)ptrDoc->uObs;
 	const int 	(*bObs)[T][B] 	= (void *)ptrDoc->bObs;
-	const double(*psi)[T][Y][Y] = (void *)vpsi;
+	const double(*u)[T][Y] 		= (void *)psi->u;
+	const double(*b)[T][Y * Y] 	= (void *)psi->b;
+	const int 	 *bix 			= psi->bix;
 	const double(*alpha)[T][Y] 	= (void *)valpha;
 	const double(*beta )[T][Y] 	= (void *)vbeta;
 	const double  stepsize		= ptrModel->stepsize;
@@ -272,6 +370,8 @@ CRFModel_do_grad(	struct CRFModel   		*ptrModel,	// model
 	   	1.0 / ptrModel->wscale / (1 - ptrModel->mu * ptrModel->stepsize);
 	// array (out)
 	double *w 					= ptrModel->w;
+	// marginals of one position, exponentiated a block at a time
+	double 		  e[Y * Y];
 	// iters
 	int t, yp, y, n, d;
 
@@ -281,24 +381,31 @@ CRFModel_do_grad(	struct CRFModel   		*ptrModel,	// model
 	// unigram
 	for (t = 0; t < T; t ++) {
 		for (y = 0; y < Y; y ++) {
-			double e = exp((*alpha)[t][y] + (*beta)[t][y] - z);
+			e[y] = (*alpha)[t][y] + (*beta)[t][y] - z;
+		}
+		exp_i(e, Y);
+		for (y = 0; y < Y; y ++) {
 			for (n = 0; n < U; n++) {
 				int o = (*uObs)[t][n];
-				w[o + y] -= stepsize * e * gain;
+				w[o + y] -= stepsize * e[y] * gain;
 			}
 		}
 	}
 	// bigram
 	for (t = 1; t < T; t++) {
+		// expectation is equal to probability,
+		// because only one is nonzero
 		for (yp = 0, d = 0; yp < Y; yp++) {
 			for (y = 0; y < Y; y++, d++) {
-				// expectation is equal to probability,
-				// because only one is nonzero
-				double e = exp((*alpha)[t - 1][yp] + (*beta)[t][y] + (*psi)[t][yp][y] - z);
-				for (n = 0; n < B; n++) {
-					int o = (*bObs)[t][n];
-					w[o + d] -= stepsize * e * gain;
-				}
+				e[d] = (*alpha)[t - 1][yp] + (*beta)[t][y] + (*u)[t][y]
+					+ (*b)[bix[t]][d] - z;
+			}
+		}
+		exp_i(e, Y * Y);
+		for (d = 0; d < Y * Y; d++) {
+			for (n = 0; n < B; n++) {
+				int o = (*bObs)[t][n];
+				w[o + d] -= stepsize * e[d] * gain;
 			}
 		}
 	}
@@ -325,23 +432,25 @@ CRFModel_do_grad(	struct CRFModel   		*ptrModel,	// model
 
 /**
  * everything is in the log domain, but no log_sum is needed,
- * as in log_score
+ * as in log_score. work holds T * Y + 2 * Y doubles
  */
 static void
 CRFModel_viterbi(	const struct CRFModel   *ptrModel,	// model
 					const struct Example 	*ptrDoc,	// document
-					const double			*vpsi,		// transition scores, trellis
+					const struct CRFPsi		*psi,		// transition scores, factored
+					double					*work,		// scratch
 					int						*labels) {	// output best label path
 	// bounds
 	const int 	  Y 				  = ptrModel->nLabels;
 	const int 	  T 				  = ptrDoc->len;
 	// arrays (in)
-	const double(*psi)[T][Y][Y] 	  = (void *)vpsi;
+	const double(*u)[T][Y] 			  = (void *)psi->u;
+	const double(*b)[T][Y * Y] 		  = (void *)psi->b;
+	const int 	 *bix 				  = psi->bix;
 	// arrays (interm)
-	int 		 *vbackpointers 	  = malloc(sizeof(int) * T * Y);
-	int 		(*backpointers)[T][Y] = (void *)vbackpointers;
-	double 		 *pathscores 		  = malloc(sizeof(double) * Y);
-	double 		 *prepathscores		  = malloc(sizeof(double) * Y);
+	int 		(*backpointers)[T][Y] = (void *)work;
+	double 		 *pathscores 		  = work + T * Y;
+	double 		 *prepathscores		  = work + T * Y + Y;
 	double		 *swap;
 	// final best score
 	double 		  finalscore;
@@ -349,21 +458,23 @@ CRFModel_viterbi(	const struct CRFModel   *ptrModel,	// model
 	int y, yp, t;
 	// forward
 	for (y = 0; y < Y; y++) {
-		prepathscores[y] = (*psi)[0][0][y];
+		prepathscores[y] = (*u)[0][y];
 		(*backpointers)[0][y] = -1;
 	}
 	for (t = 1; t < T; t++) {
+		// u[t][y] is the same for every yp, it is added after the max
+		const double *blk = (*b)[bix[t]];
 		for (y = 0; y < Y; y ++) {
-			double maxscore = prepathscores[0] + (*psi)[t][0][y];
+			double maxscore = prepathscores[0] + blk[y];
 			(*backpointers)[t][y] = 0;
 			for (yp = 1; yp < Y; yp ++) {
-				double tmpscore = prepathscores[yp] + (*psi)[t][yp][y];
+				double tmpscore = prepathscores[yp] + blk[yp * Y + y];
 				if (maxscore < tmpscore) {
 					maxscore = tmpscore;
 					(*backpointers)[t][y] = yp;
 				}
 			}
-			pathscores[y] = maxscore;
+			pathscores[y] = maxscore + (*u)[t][y];
 		}
 		// swap
 		swap = prepathscores;
@@ -382,66 +493,81 @@ CRFModel_viterbi(	const struct CRFModel   *ptrModel,	// model
 	for (t = T - 2; t >= 0; t --) {
 		labels[t] = (*backpointers)[t + 1][labels[t + 1]];
 	}
-	// free
-	free(backpointers);
-	free(pathscores);
-	free(prepathscores);
 }
 
-inline void
+static inline void
 CRFModel_grad(	struct CRFModel   		*ptrModel,	// model
 				const struct Example 	*ptrDoc) {	// document
 	int T = ptrDoc->len;
 	int Y = ptrModel->nLabels;
-	// alloc shared space
-	double *psi, *alpha, *beta;
-	psi = malloc(sizeof(double) * T * Y * Y);
-	alpha = malloc(sizeof(double) * T * Y);
-	beta = malloc(sizeof(double) * T * Y);
+	// shared space
+	struct CRFPsi psi;
+	double *buf = CRFScratch_get((size_t) T * Y * (Y + 3) + T);
+	if (buf == NULL) { return; }
+	double *alpha = CRFPsi_init(&psi, buf, T, Y);
+	double *beta = alpha + T * Y;
 	// some dynamic programming
-	CRFModel_compute_psi(ptrModel, ptrDoc, psi);
-	double z = CRFModel_fwd_bwd(ptrModel, ptrDoc, psi, alpha, beta);
-	CRFModel_do_grad(ptrModel, ptrDoc, psi, alpha, beta, z);
-	// free
-	free(psi);
-	free(alpha);
-	free(beta);
+	CRFModel_compute_psi(ptrModel, ptrDoc, &psi);
+	double z = CRFModel_fwd_bwd(ptrModel, ptrDoc, &psi, alpha, beta);
+	CRFModel_do_grad(ptrModel, ptrDoc, &psi, alpha, beta, z);
 }
 
-inline double
+/**
+ * CRFModel_grad that also returns the loss of the document against the
+ * model before the step, which only adds its O(T) score to the pass
+ */
+static inline double
+CRFModel_grad_loss(	struct CRFModel   		*ptrModel,	// model
+					const struct Example 	*ptrDoc) {	// document
+	const int T = ptrDoc->len;
+	const int Y = ptrModel->nLabels;
+	// shared space
+	struct CRFPsi psi;
+	double *buf = CRFScratch_get((size_t) T * Y * (Y + 3) + T);
+	if (buf == NULL) { return 0; }
+	double *alpha = CRFPsi_init(&psi, buf, T, Y);
+	double *beta = alpha + T * Y;
+	// some dynamic programming
+	CRFModel_compute_psi(ptrModel, ptrDoc, &psi);
+	double z = CRFModel_fwd_bwd(ptrModel, ptrDoc, &psi, alpha, beta);
+	double logscore = CRFModel_log_score(ptrModel, ptrDoc, &psi);
+	CRFModel_do_grad(ptrModel, ptrDoc, &psi, alpha, beta, z);
+	return z - logscore;
+}
+
+static inline double
 CRFModel_loss(	const struct CRFModel	*ptrModel,	// model
 				const struct Example 	*ptrDoc) {	// document
 	const int T = ptrDoc->len;
 	const int Y = ptrModel->nLabels;
-	// alloc shared space
-	double *psi = malloc(sizeof(double) * T * Y * Y);
-	double *alpha = malloc(sizeof(double) * T * Y);
-	double *beta = malloc(sizeof(double) * T * Y);
+	// shared space
+	struct CRFPsi psi;
+	double *buf = CRFScratch_get((size_t) T * Y * (Y + 3) + T);
+	if (buf == NULL) { return 0; }
+	double *alpha = CRFPsi_init(&psi, buf, T, Y);
+	double *beta = alpha + T * Y;
 	// some dynamic programming
-	CRFModel_compute_psi(ptrModel, ptrDoc, psi);
-	double z = CRFModel_fwd_bwd(ptrModel, ptrDoc, psi, alpha, beta);
-	double logscore = CRFModel_log_score(ptrModel, ptrDoc, psi);
+	CRFModel_compute_psi(ptrModel, ptrDoc, &psi);
+	double z = CRFModel_fwd_bwd(ptrModel, ptrDoc, &psi, alpha, beta);
+	double logscore = CRFModel_log_score(ptrModel, ptrDoc, &psi);
 	double L = logscore - z;
-	// free
-	free(psi);
-	free(alpha);
-	free(beta);
 	return -L;
 }
 
-inline void
+static inline void
 CRFModel_pred(	const struct CRFModel	*ptrModel,	// model
 				const struct Example 	*ptrDoc,
 				int						*labels) {	// document
 	const int T = ptrDoc->len;
 	const int Y = ptrModel->nLabels;
-	// alloc shared space
-	double *psi = malloc(sizeof(double) * T * Y * Y);
+	// shared space, psi followed by the viterbi paths
+	struct CRFPsi psi;
+	double *buf = CRFScratch_get((size_t) T * Y * (Y + 2) + T + 2 * Y);
+	if (buf == NULL) { return; }
+	double *work = CRFPsi_init(&psi, buf, T, Y);
 	// some dynamic programming
-	CRFModel_compute_psi(ptrModel, ptrDoc, psi);
-	CRFModel_viterbi(ptrModel, ptrDoc, psi, labels);
-	// free
-	free(psi);
+	CRFModel_compute_psi(ptrModel, ptrDoc, &psi);
+	CRFModel_viterbi(ptrModel, ptrDoc, &psi, work, labels);
 }
 
 #endif
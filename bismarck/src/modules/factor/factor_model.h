@@ -17,18 +17,28 @@ limitations under the License.
 #ifndef Factor_MODEL_H
 #define Factor_MODEL_H
 
-#define META_LEN (10)
+#define META_LEN (11)
+
+// the aggregate state w+ is a float8 array, see weight_t in numeric.h
+#if defined(W_FLOAT4) && defined(VAGG)
+#error "W_FLOAT4 is for the shared-memory builds only"
+#endif
 
 /** a structure for model parameters and meta data */
 struct FactorModel {
     int mid;
-    int token;
+    struct SpinLock lock;
 	// meta data
 	int nRows;
 	int nCols;
 	int maxRank;
 	int nDims;
 	int nTuples;
+	// layout: weights from one vector to the next (maxRank unless padded),
+	// and whether rows and cols are placed by the slot maps
+	int stride;
+	int padded;
+	int reordered;
 	// regularization hyper-parameters
 	double B;
 	double B2;
@@ -37,11 +47,17 @@ struct FactorModel {
 	double initStepSize;
 	double stepsize;
 	double decay;
+	// slot of each row and col when reordered, NULL otherwise
+	int *rowSlot;
+	int *colSlot;
 	// weight vectors
-	double *R;
-	double *L;
+	weight_t *R;
+	weight_t *L;
 };
 
+// bytes of a cache line, the unit of padded vectors
+#define FACTOR_LINE (64)
+
 /**
  * assign initial values to the model,
  * should go in a constructor if written in C++
@@ -50,7 +66,7 @@ inline void
 FactorModel_init(struct FactorModel *ptrModel, int mid, int nRows, int nCols, int r, int nTuples, 
 		double B, double step, double decay) {
     ptrModel->mid = mid;
-    ptrModel->token = 0;
+    spin_lock_init(&(ptrModel->lock));
 
 	// meta data
     ptrModel->maxRank = r;
@@ -58,6 +74,9 @@ FactorModel_init(struct FactorModel *ptrModel, int mid, int nRows, int nCols, in
     ptrModel->nCols = nCols;
     ptrModel->nDims = (nRows + nCols) * r;
 	ptrModel->nTuples = nTuples;
+	ptrModel->stride = r;
+	ptrModel->padded = 0;
+	ptrModel->reordered = 0;
 	
 	// regularization hyper-parameters
     ptrModel->B = B;
@@ -70,7 +89,9 @@ FactorModel_init(struct FactorModel *ptrModel, int mid, int nRows, int nCols, in
 	ptrModel->decay = decay;
 	
 	// weight vectors
-	ptrModel->L = (double *)(&(ptrModel->L) + 1);
+	ptrModel->rowSlot = NULL;
+	ptrModel->colSlot = NULL;
+	ptrModel->L = (weight_t *)(&(ptrModel->L) + 1);
     ptrModel->R = ptrModel->L + nRows * r;	//R is serialized immed after L
 	/*
     int nElems = (nCols + nRows) * r;	//sum of sizes of L and R
@@ -89,6 +110,110 @@ FactorModel_init(struct FactorModel *ptrModel, int mid, int nRows, int nCols, in
 	*/
 }
 
+/**
+ * the stride of vectors padded to whole cache lines
+ */
+inline int
+FactorModel_padded_stride(const int r) {
+	const int lanes = FACTOR_LINE / sizeof(weight_t);
+	return (r + lanes - 1) / lanes * lanes;
+}
+
+/**
+ * bytes of a model in shared memory: the structure, the weights (from a
+ * cache line when padded) and the slot maps when reordered
+ */
+inline size_t
+FactorModel_size(const int nRows, const int nCols, const int stride, const int reordered) {
+	return sizeof(struct FactorModel) + FACTOR_LINE
+		+ sizeof(weight_t) * (size_t) (nRows + nCols) * stride
+		+ (reordered ? sizeof(int) * (size_t) (nRows + nCols) : 0);
+}
+
+/**
+ * copy the meta data of a shared model and point L, R and the slot maps
+ * of the copy at its weights, which follow the structure in the order
+ * L, R, rowSlot, colSlot. padded weights start on the next cache line,
+ * which is the same for every process as shmat maps whole pages
+ */
+inline void
+FactorModel_attach(struct FactorModel *ptrModel, struct FactorModel *ptrSharedModel) {
+	uintptr_t base = (uintptr_t) (&(ptrSharedModel->L) + 1);
+	if (ptrModel != ptrSharedModel) { *ptrModel = *ptrSharedModel; }
+	if (ptrModel->padded) {
+		base = (base + FACTOR_LINE - 1) & ~((uintptr_t) FACTOR_LINE - 1);
+	}
+	ptrModel->L = (weight_t *) base;
+	ptrModel->R = ptrModel->L + (size_t) ptrModel->nRows * ptrModel->stride;
+	if (ptrModel->reordered) {
+		ptrModel->rowSlot = (int *) (ptrModel->R + (size_t) ptrModel->nCols * ptrModel->stride);
+		ptrModel->colSlot = ptrModel->rowSlot + ptrModel->nRows;
+	} else {
+		ptrModel->rowSlot = NULL;
+		ptrModel->colSlot = NULL;
+	}
+}
+
+/**
+ * fill a slot map from an order of 1-based ids: the k-th id goes to slot
+ * k, ids missing from it (or repeated, or out of range) follow in order
+ */
+inline void
+FactorModel_order_slots(int *slot, const int n, const int *order, const int nOrder) {
+	int k, next = 0;
+	for (k = 0; k < n; k++) { slot[k] = -1; }
+	for (k = 0; k < nOrder; k++) {
+		const int id = order[k] - 1;
+		if (id >= 0 && id < n && slot[id] < 0) { slot[id] = next++; }
+	}
+	for (k = 0; k < n; k++) {
+		if (slot[k] < 0) { slot[k] = next++; }
+	}
+}
+
+/**
+ * the vector of row i (of L) and of col j (of R)
+ */
+inline weight_t *
+FactorModel_row(const struct FactorModel *ptrModel, const int i) {
+	return ptrModel->L + (size_t) (ptrModel->rowSlot ? ptrModel->rowSlot[i] : i) * ptrModel->stride;
+}
+
+inline weight_t *
+FactorModel_col(const struct FactorModel *ptrModel, const int j) {
+	return ptrModel->R + (size_t) (ptrModel->colSlot ? ptrModel->colSlot[j] : j) * ptrModel->stride;
+}
+
+/**
+ * copy weights in and out of the layout; w is always L then R, one
+ * vector per row or col in id order, as in the model table
+ */
+inline void
+FactorModel_store(struct FactorModel *ptrModel, const double *w) {
+	const int r = ptrModel->maxRank;
+	int i;
+	for (i = 0; i < ptrModel->nRows; i++) {
+		store_w(FactorModel_row(ptrModel, i), w + (size_t) i * r, r);
+	}
+	w += (size_t) ptrModel->nRows * r;
+	for (i = 0; i < ptrModel->nCols; i++) {
+		store_w(FactorModel_col(ptrModel, i), w + (size_t) i * r, r);
+	}
+}
+
+inline void
+FactorModel_load(const struct FactorModel *ptrModel, double *w) {
+	const int r = ptrModel->maxRank;
+	int i;
+	for (i = 0; i < ptrModel->nRows; i++) {
+		load_w(w + (size_t) i * r, FactorModel_row(ptrModel, i), r);
+	}
+	w += (size_t) ptrModel->nRows * r;
+	for (i = 0; i < ptrModel->nCols; i++) {
+		load_w(w + (size_t) i * r, FactorModel_col(ptrModel, i), r);
+	}
+}
+
 /**
  * take step
  */
@@ -97,31 +222,105 @@ FactorModel_take_step(struct FactorModel *ptrModel) {
 	ptrModel->stepsize *= ptrModel->decay;
 }
 
-inline void
-FactorModel_grad(struct FactorModel *ptrModel, const int i, const int j, const double rating) {
-	//L is row-major, so get ith row directly; R is col-major, so get jth col directly
-	//L is nrowsx20, R is 20xncols
-	double *Li = ptrModel->L + i * ptrModel->maxRank;	//offset the dbl ptr of L
-	double *Rj = ptrModel->L + ptrModel->nRows * ptrModel->maxRank + j * ptrModel->maxRank;
-	double err = dot(Li, Rj, ptrModel->maxRank) - rating;
+/**
+ * prediction error of rating (i, j), always inlined so that with a
+ * constant r the loop is unrolled; the sum is split over 4 accumulators,
+ * which breaks its dependency chain
+ */
+__attribute__((always_inline)) inline double
+FactorModel_loss_rank(const weight_t *Li, const weight_t *Rj, const double rating, const int r) {
+	double d0 = 0.0, d1 = 0.0, d2 = 0.0, d3 = 0.0;
+	int k;
+	if (sizeof(weight_t) == sizeof(double) && r > 32) {
+		// long rows of doubles go faster through the host's dot kernel
+		return dot_ww(Li, Rj, r) - rating;
+	}
+	for (k = 0; k + 4 <= r; k += 4) {
+		d0 += (double) Li[k] * Rj[k];
+		d1 += (double) Li[k + 1] * Rj[k + 1];
+		d2 += (double) Li[k + 2] * Rj[k + 2];
+		d3 += (double) Li[k + 3] * Rj[k + 3];
+	}
+	for (; k < r; k++) {
+		d0 += (double) Li[k] * Rj[k];
+	}
+	return (d0 + d1) + (d2 + d3) - rating;
+}
+
+/**
+ * one sgd step on rating (i, j), allocation free: after the dot product,
+ * one pass updates Li and Rj from each other's old values and sums their
+ * norms for the ball projection, which then only rescales when needed.
+ * inlined like FactorModel_loss_rank, returns the prediction error before
+ * the step
+ */
+__attribute__((always_inline)) inline double
+FactorModel_grad_rank(const struct FactorModel *ptrModel, weight_t *Li, weight_t *Rj,
+		const double rating, const int r) {
+	const double err = FactorModel_loss_rank(Li, Rj, rating, r);
 	double e = -(ptrModel->stepsize * err);
-	double *tempLi = malloc(sizeof(double) * ptrModel->maxRank);
+	double normLi = 0.0, normRj = 0.0;
+	int k;
 	//no need for set_L etc., since we update model in place!
-	memcpy(tempLi, Li, ptrModel->maxRank * sizeof(double));
-	add_and_scale(tempLi, ptrModel->maxRank, Rj, e);
-	add_and_scale(Rj, ptrModel->maxRank, Li, e);
-	memcpy(Li, tempLi, ptrModel->maxRank * sizeof(double));
-	free(tempLi);
+	for (k = 0; k < r; k++) {
+		const double li = Li[k];
+		const double rj = Rj[k];
+		Li[k] = li + e * rj;
+		Rj[k] = rj + e * li;
+		// norms of the values as stored
+		normLi += (double) Li[k] * Li[k];
+		normRj += (double) Rj[k] * Rj[k];
+	}
 	// regularization
-	ball_project(Li, ptrModel->maxRank, ptrModel->B, ptrModel->B2);
-	ball_project(Rj, ptrModel->maxRank, ptrModel->B, ptrModel->B2);
+	if (normLi > ptrModel->B2) { scale_i_w(Li, r, ptrModel->B / sqrt(normLi)); }
+	if (normRj > ptrModel->B2) { scale_i_w(Rj, r, ptrModel->B / sqrt(normRj)); }
+	return err;
 }
 
-inline double
+/**
+ * the ranks with their own compiled copy of the kernels, FACTOR_RANK(r)
+ * is expanded for each, other ranks take the generic loops. with doubles,
+ * unrolling 64 and 128 was slower than the vectorized generic loops
+ */
+#ifdef W_FLOAT4
+#define FACTOR_RANKS(FACTOR_RANK) \
+	FACTOR_RANK(8) FACTOR_RANK(10) FACTOR_RANK(16) FACTOR_RANK(20) \
+	FACTOR_RANK(32) FACTOR_RANK(64) FACTOR_RANK(128)
+#else
+#define FACTOR_RANKS(FACTOR_RANK) \
+	FACTOR_RANK(8) FACTOR_RANK(10) FACTOR_RANK(16) FACTOR_RANK(20) \
+	FACTOR_RANK(32)
+#endif
+
+/**
+ * the dispatchers hold a copy of the kernels per rank, too big to be
+ * inlined, so they are static like the larger crf functions
+ */
+static double
+FactorModel_grad(struct FactorModel *ptrModel, const int i, const int j, const double rating) {
+	//L is row-major, so get ith row directly; R is col-major, so get jth col directly
+	weight_t *Li = FactorModel_row(ptrModel, i);
+	weight_t *Rj = FactorModel_col(ptrModel, j);
+#define FACTOR_GRAD_CASE(r) \
+	case r: return FactorModel_grad_rank(ptrModel, Li, Rj, rating, r);
+	switch (ptrModel->maxRank) {
+	FACTOR_RANKS(FACTOR_GRAD_CASE)
+	default: return FactorModel_grad_rank(ptrModel, Li, Rj, rating, ptrModel->maxRank);
+	}
+#undef FACTOR_GRAD_CASE
+}
+
+static double
 FactorModel_loss(struct FactorModel *ptrModel, const int i, const int j, const double rating) {
-	double *Li = ptrModel->L + i * ptrModel->maxRank;
-	double *Rj = ptrModel->L + ptrModel->nRows * ptrModel->maxRank + j * ptrModel->maxRank;
-	return dot(Li, Rj, ptrModel->maxRank) - rating;
+	const weight_t *Li = FactorModel_row(ptrModel, i);
+	const weight_t *Rj = FactorModel_col(ptrModel, j);
+#define FACTOR_LOSS_CASE(r) \
+	case r: return FactorModel_loss_rank(Li, Rj, rating, r);
+	switch (ptrModel->maxRank) {
+	FACTOR_RANKS(FACTOR_LOSS_CASE)
+	default: return FactorModel_loss_rank(Li, Rj, rating, ptrModel->maxRank);
+	}
+#undef FACTOR_LOSS_CASE
 }
 
 #endif
@@ -17,36 +17,91 @@ limitations under the License.
 #ifndef LINEAR_MODEL_H
 #define LINEAR_MODEL_H
 
-#define META_LEN (9)
+#define META_LEN (13)
+
+// wscale is folded back into w below this
+#define WSCALE_MIN (1e-9)
+
+#define CACHE_LINE (64)
+#define CACHE_ALIGN(n) (((n) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+
+/**
+ * striped locking (-DVSTRIPE): the shared w is cut into stripes of 
+ * STRIPE_DIMS weights, each guarded by its own lock word on its own
+ * cache line, so backends only serialize on the stripes they touch
+ */
+#if defined(VSTRIPE) && defined(VLOCK)
+#error "VSTRIPE and VLOCK are exclusive"
+#endif
+#define STRIPE_DIMS (64)
+
+// the aggregate state w+ is a float8 array, see weight_t in numeric.h
+#if defined(W_FLOAT4) && defined(VAGG)
+#error "W_FLOAT4 is for the shared-memory builds only"
+#endif
+
+struct StripeLock {
+	struct SpinLock lock;
+	char pad[CACHE_LINE - sizeof(struct SpinLock)];
+};
 
 /** a structure for model parameters and meta data */
 struct LinearModel {
     int mid;
-    int token;
+    struct SpinLock lock;
 	// meta data
 	int nDims;
 	int nTuples;
 	// regularization hyper-parameters
-	double mu;
+	double mu;			// L1
+	double l2;			// L2, weight decay
 	// step size hyper-parameters
 	int nSteps;
 	double initStepSize;
 	double stepsize;
 	double decay;
-	// weight vector
-	double *w;
-	double *temp_v;  
+	// mini-batch, dense rows are buffered until batchSize of them are seen
+	int batchSize;
+	int nBuffered;
+	double *batchX;		// batchSize x nDims, row-major
+	double *batchY;		// batchSize labels
+	double *batchC;		// batchSize per-row scale factors (scratch)
+	// lazy L1, total shrinkage handed out so far
+	double l1Clock;
+	// weight vector, the true weights are wscale * w
+	double wscale;
+	weight_t *w;
+	weight_t *temp_v;  
+	double *l1Stamp;	// l1Clock at which each w[j] was last shrunk
+	// striped locks, shared memory only
+	int nStripes;
+	struct StripeLock *locks;
 };
 
+/**
+ * lay out the vectors of a model in the shared memory region behind
+ * the structure: w, temp_v and the L1 stamps, then the stripe locks,
+ * each part starting on a cache line
+ */
+inline void
+LinearModel_layout(struct LinearModel *ptrModel, struct LinearModel *ptrSharedModel) {
+	char *p = (char *) ptrSharedModel + CACHE_ALIGN(sizeof(struct LinearModel));
+	ptrModel->w = (weight_t *) p;
+	ptrModel->temp_v = ptrModel->w + ptrModel->nDims;
+	ptrModel->l1Stamp = (double *) (ptrModel->temp_v + ptrModel->nDims);
+	p += CACHE_ALIGN((sizeof(weight_t) * 2 + sizeof(double)) * ptrModel->nDims);
+	ptrModel->locks = (ptrModel->nStripes > 0) ? (struct StripeLock *) p : NULL;
+}
+
 /**
  * assign initial values to the model,
  * should go in a constructor if written in C++
  */
 inline void 
 LinearModel_init(struct LinearModel *ptrModel, int mid, int nDims, int nTuples, 
-		double mu, double stepsize, double decay) {
+		double mu, double l2, double stepsize, double decay) {
     ptrModel->mid = mid;
-    ptrModel->token = 0;
+    spin_lock_init(&(ptrModel->lock));
 
 	// meta data
     ptrModel->nDims = nDims;
@@ -54,6 +109,7 @@ LinearModel_init(struct LinearModel *ptrModel, int mid, int nDims, int nTuples,
 	
 	// regularization hyper-parameters
     ptrModel->mu = mu;
+    ptrModel->l2 = l2;
 	
 	// step size hyper-parameters
 	ptrModel->nSteps = 0;
@@ -61,10 +117,281 @@ LinearModel_init(struct LinearModel *ptrModel, int mid, int nDims, int nTuples,
     ptrModel->stepsize = stepsize;
     ptrModel->decay = decay;
 
-	// weight vector
-	ptrModel->w = (double *)(&(ptrModel->w) + 1);  // ?????
-	// ? temp_v value
-	ptrModel->temp_v = (double *)(&(ptrModel->temp_v) + 1);
+	// mini-batch, off unless a buffer is attached
+	ptrModel->batchSize = 1;
+	ptrModel->nBuffered = 0;
+	ptrModel->batchX = NULL;
+	ptrModel->batchY = NULL;
+	ptrModel->batchC = NULL;
+
+	// lazy L1
+	ptrModel->l1Clock = 0.0;
+
+	// weight vector, momentum and L1 stamps follow the structure
+	ptrModel->wscale = 1;
+	ptrModel->nStripes = 0;
+	LinearModel_layout(ptrModel, ptrModel);
+}
+
+/**
+ * point a local copy at the model living in shared memory
+ */
+inline void
+LinearModel_attach(struct LinearModel *ptrModel, struct LinearModel *ptrSharedModel) {
+	*ptrModel = *ptrSharedModel;
+	LinearModel_layout(ptrModel, ptrSharedModel);
+}
+
+/**
+ * size of the shared memory region of a model with nDims weights
+ */
+inline size_t
+LinearModel_size(int nDims) {
+	int nStripes = (nDims + STRIPE_DIMS - 1) / STRIPE_DIMS;
+	return CACHE_ALIGN(sizeof(struct LinearModel)) 
+		+ CACHE_ALIGN((sizeof(weight_t) * 2 + sizeof(double)) * nDims)
+		+ sizeof(struct StripeLock) * nStripes;
+}
+
+/**
+ * turn on striped locking of a model in shared memory
+ */
+inline void
+LinearModel_init_stripes(struct LinearModel *ptrModel) {
+	ptrModel->nStripes = (ptrModel->nDims + STRIPE_DIMS - 1) / STRIPE_DIMS;
+	LinearModel_layout(ptrModel, ptrModel);
+	int s;
+	for (s = 0; s < ptrModel->nStripes; s++) {
+		spin_lock_init(&(ptrModel->locks[s].lock));
+	}
+}
+
+inline void
+LinearModel_lock_stripe(struct LinearModel *ptrModel, const int s) {
+	spin_lock(&(ptrModel->locks[s].lock));
+}
+
+inline void
+LinearModel_unlock_stripe(struct LinearModel *ptrModel, const int s) {
+	spin_unlock(&(ptrModel->locks[s].lock));
+}
+
+/**
+ * contention counters of the model lock and of every stripe
+ */
+inline struct LockStats
+LinearModel_lock_stats(struct LinearModel *ptrModel) {
+	struct LockStats stats = {0, 0, 0};
+	int s;
+	spin_lock_stats_add(&stats, &(ptrModel->lock));
+	for (s = 0; s < ptrModel->nStripes; s++) {
+		spin_lock_stats_add(&stats, &(ptrModel->locks[s].lock));
+	}
+	return stats;
+}
+
+inline void
+LinearModel_lock_all(struct LinearModel *ptrModel) {
+	int s;
+	for (s = 0; s < ptrModel->nStripes; s++) {
+		LinearModel_lock_stripe(ptrModel, s);
+	}
+}
+
+inline void
+LinearModel_unlock_all(struct LinearModel *ptrModel) {
+	int s;
+	for (s = 0; s < ptrModel->nStripes; s++) {
+		LinearModel_unlock_stripe(ptrModel, s);
+	}
+}
+
+/**
+ * release the stripes taken for the sorted indices k, or all of them
+ */
+inline void
+LinearModel_unlock_stripes(struct LinearModel *ptrModel, const int *k, 
+		const int len, const int all) {
+	int i, s, last = -1;
+	if (all) {
+		LinearModel_unlock_all(ptrModel);
+		return;
+	}
+	for (i = 0; i < len; i++) {
+		s = k[i] / STRIPE_DIMS;
+		if (s == last) { continue; }
+		LinearModel_unlock_stripe(ptrModel, s);
+		last = s;
+	}
+}
+
+/**
+ * lock the stripes the indices k touch, in increasing order so that two
+ * backends never wait on each other. k of a sparse vector is normally
+ * sorted, when it is not every stripe is taken instead.
+ * returns 1 if all stripes were taken
+ */
+inline int
+LinearModel_lock_stripes(struct LinearModel *ptrModel, const int *k, const int len) {
+	int i, s, last = -1;
+	for (i = 0; i < len; i++) {
+		s = k[i] / STRIPE_DIMS;
+		if (s == last) { continue; }
+		if (s < last) {
+			LinearModel_unlock_stripes(ptrModel, k, i, 0);
+			LinearModel_lock_all(ptrModel);
+			return 1;
+		}
+		LinearModel_lock_stripe(ptrModel, s);
+		last = s;
+	}
+	return 0;
+}
+
+/**
+ * number of doubles needed to buffer a mini-batch of dense rows
+ */
+inline int
+LinearModel_batch_len(int nDims, int batchSize) {
+	return batchSize * (nDims + 2);
+}
+
+/**
+ * use buf (LinearModel_batch_len doubles) as the mini-batch buffer
+ */
+inline void
+LinearModel_set_batch(struct LinearModel *ptrModel, int batchSize, int nBuffered, 
+		double *buf) {
+	ptrModel->batchSize = batchSize;
+	ptrModel->nBuffered = nBuffered;
+	ptrModel->batchX = buf;
+	ptrModel->batchY = buf + batchSize * ptrModel->nDims;
+	ptrModel->batchC = ptrModel->batchY + batchSize;
+}
+
+/**
+ * buffer one dense row, return 1 when the batch is full
+ */
+inline int
+LinearModel_buffer_row(struct LinearModel *ptrModel, const double *v, const int y) {
+	memcpy(ptrModel->batchX + ptrModel->nBuffered * ptrModel->nDims, v, 
+			sizeof(double) * ptrModel->nDims);
+	ptrModel->batchY[ptrModel->nBuffered] = y;
+	ptrModel->nBuffered ++;
+	return ptrModel->nBuffered == ptrModel->batchSize;
+}
+
+/**
+ * lazy L1 regularization
+ *
+ * instead of soft thresholding every weight by u = mu * stepsize on every
+ * tuple, u is added to l1Clock and a weight is only shrunk, by everything
+ * accumulated since its l1Stamp, right before it is read again. soft
+ * thresholds compose, S_a(S_b(x)) = S_{a+b}(x), so this gives exactly the
+ * weights of the eager version while costing O(nonzeros) per tuple.
+ * LinearModel_l1_flush brings every weight up to date, and has to run
+ * before w is averaged, returned or used for loss/pred.
+ * the clock counts in units of the stored w, i.e. u / wscale per step.
+ */
+inline void
+LinearModel_l1_catch_up(struct LinearModel *ptrModel, const int *k, const int len) {
+	if (ptrModel->l1Clock == 0.0) { return; }
+	l1_shrink_lazy_w(ptrModel->w, ptrModel->l1Stamp, ptrModel->l1Clock, k, len);
+}
+
+inline void
+LinearModel_l1_catch_up_d(struct LinearModel *ptrModel, const double *v) {
+	if (ptrModel->l1Clock == 0.0) { return; }
+	l1_shrink_lazy_nz_w(ptrModel->w, ptrModel->l1Stamp, ptrModel->l1Clock, v, 
+			ptrModel->nDims);
+}
+
+inline void
+LinearModel_l1_advance(struct LinearModel *ptrModel, const double u) {
+	ptrModel->l1Clock += u;
+}
+
+inline void
+LinearModel_l1_flush(struct LinearModel *ptrModel) {
+	if (ptrModel->l1Clock == 0.0) { return; }
+	l1_shrink_lazy_d_w(ptrModel->w, ptrModel->l1Stamp, ptrModel->l1Clock, 
+			ptrModel->nDims);
+	// restart the clock
+	ptrModel->l1Clock = 0.0;
+	memset(ptrModel->l1Stamp, 0, sizeof(double) * ptrModel->nDims);
+}
+
+/**
+ * force scaling factor of w to be 1
+ */
+inline void
+LinearModel_scale(struct LinearModel *ptrModel) {
+	// pending shrinkage is in units of the scaled w
+	LinearModel_l1_flush(ptrModel);
+	if (ptrModel->wscale == 1.0) { return; }
+	scale_i_w(ptrModel->w, ptrModel->nDims, ptrModel->wscale);
+	ptrModel->wscale = 1;
+}
+
+/**
+ * L2 regularization of n steps by scaling w
+ */
+inline void
+LinearModel_regularize(struct LinearModel *ptrModel, const int n) {
+	if (ptrModel->l2 == 0.0) { return; }
+	ptrModel->wscale *= pow(1 - ptrModel->l2 * ptrModel->stepsize, n);
+	// folding rewrites all of w, so it is only done here when w is ours
+	// (aggregate state) or the model lock is held; the other shared-memory
+	// builds fold with LinearModel_scale_shared after the step
+#if defined(VAGG) || defined(VLOCK)
+	if (ptrModel->wscale < WSCALE_MIN) {
+		LinearModel_scale(ptrModel);
+	}
+#endif
+}
+
+/**
+ * fold wscale of a shared model back into w once it got too small,
+ * holding every stripe, or the model lock without stripes. lock-free
+ * backends keep publishing their decay and shrinkage meanwhile, so what
+ * was folded is divided out of wscale and subtracted from l1Clock rather
+ * than stored over them, and the stamps are rebased by the flushed clock
+ * (a stamp ahead of it, from a racing step, keeps its lead). a step racing
+ * the fold itself can still be off, as hogwild steps racing each other are
+ */
+inline void
+LinearModel_scale_shared(struct LinearModel *ptrSharedModel) {
+	struct LinearModel modelBuffer;
+	struct LinearModel *ptrModel = &modelBuffer;
+	LinearModel_attach(ptrModel, ptrSharedModel);
+	if (ptrModel->nStripes > 0) {
+		LinearModel_lock_all(ptrModel);
+	} else {
+		spin_lock(&(ptrSharedModel->lock));
+	}
+	// another backend may have folded it while we waited
+	double wscale = ptrSharedModel->wscale;
+	if (wscale < WSCALE_MIN) {
+		// pending shrinkage is in units of the scaled w
+		double clock = ptrSharedModel->l1Clock;
+		if (clock != 0.0) {
+			l1_shrink_lazy_d_w(ptrModel->w, ptrModel->l1Stamp, clock, 
+					ptrModel->nDims);
+			int j;
+			for (j = 0; j < ptrModel->nDims; j++) {
+				double stamp = ptrModel->l1Stamp[j] - clock;
+				ptrModel->l1Stamp[j] = stamp > 0 ? stamp : 0;
+			}
+			atomic_add_double(&(ptrSharedModel->l1Clock), -clock);
+		}
+		scale_i_w(ptrModel->w, ptrModel->nDims, wscale);
+		atomic_scale_double(&(ptrSharedModel->wscale), 1 / wscale);
+	}
+	if (ptrModel->nStripes > 0) {
+		LinearModel_unlock_all(ptrModel);
+	} else {
+		spin_unlock(&(ptrSharedModel->lock));
+	}
 }
 
 /**
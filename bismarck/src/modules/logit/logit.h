@@ -17,67 +17,112 @@ limitations under the License.
 #ifndef LOGIT_H
 #define LOGIT_H
 
-inline void
+/** loss of a row with margin wx = w.x */
+inline double
+logit_margin_loss(const double wx, const int y) {
+    return log(1 + exp(-y * wx));
+}
+
+/**
+ * the gradient steps return the margin wx of the row against the model
+ * before the step, from which its loss comes for free
+ */
+inline double
 sparse_logit_grad(struct LinearModel *ptrModel, const int len, const int *k, const double *v, const int y) {
+    int i;
+    // pending regularization of the weights we are about to read
+    LinearModel_l1_catch_up(ptrModel, k, len);
     // grad
-    double wx = dot_dss(ptrModel->w, k, v, len);
-    scale_dot_dss(ptrModel->temp_v, k, 0.9, len);
+    double wx = ptrModel->wscale * dot_dss_w(ptrModel->w, k, v, len);
     double sig = sigma(-wx * y);
-    double *temp;
-    memcpy(temp, v, ptrModel->nDims * sizeof(float8)); 
-    scale_dot_dss(temp, k, y*sig, len);
-    scale_dot_dss(temp, k, -0.1, len);
-    add_vector_dss(ptrModel->temp_v, k, temp, len);
-    add_and_scale_dss(ptrModel->w, k, ptrModel->temp_v, len, -1*ptrModel->stepsize);
 
     //double c = ptrModel->stepsize * y * sig; // scale factor
     //add_and_scale_dss(ptrModel->w, k, v, len, c);
+
+    // momentum on the touched coordinates: v_dw = beta * v_dw + (1 - beta) * dw
+    scale_dot_dss_w(ptrModel->temp_v, k, 0.9, len);
+    add_and_scale_dss_w(ptrModel->temp_v, k, v, len, -0.1 * y * sig);
+    double c = ptrModel->stepsize / ptrModel->wscale;
+    for (i = 0; i < len; i++) {
+        ptrModel->w[k[i]] -= c * ptrModel->temp_v[k[i]];
+    }
     
-    // regularization
-    double u = ptrModel->mu * ptrModel->stepsize;
-    l1_shrink_mask(ptrModel->w, u, k, len);
+    // regularization, L2 by scaling and L1 applied lazily
+    LinearModel_regularize(ptrModel, 1);
+    LinearModel_l1_advance(ptrModel, 
+            ptrModel->mu * ptrModel->stepsize / ptrModel->wscale);
+    return wx;
 }
 
-inline void
+inline double
 dense_logit_grad(struct LinearModel *ptrModel, const double *v, const int y) {
     // read and prepare
-    double wx = dot(ptrModel->w, v, ptrModel->nDims);
-    scale_dot(ptrModel->temp_v, 0.9, ptrModel->nDims); // beta * v_dw
+    double wx = ptrModel->wscale * dot_w(ptrModel->w, v, ptrModel->nDims);
     double sig = sigma(-wx * y);
     //double c = ptrModel->stepsize * y * sig; // scale factor
     //add_and_scale(ptrModel->w, ptrModel->nDims, v, c);
-    double *temp;
-    memcpy(temp, v, ptrModel->nDims * sizeof(float8));   // v is feature value, not v_dw
-    scale_dot(temp, y*sig, ptrModel->nDims); 
-    scale_dot(temp, -0.1, ptrModel->nDims);
-    add_vectors(ptrModel->temp_v, temp, ptrModel->nDims);
-    add_and_scale(ptrModel->w, ptrModel->nDims, ptrModel->temp_v, -1*ptrModel->stepsize);
-    // regularization
-    double u = ptrModel->mu * ptrModel->stepsize;
-    l1_shrink_mask_d(ptrModel->w, u, ptrModel->nDims);
+    // momentum: v_dw = beta * v_dw + (1 - beta) * dw, with dw = -y * sig * v
+    scale_i_w(ptrModel->temp_v, ptrModel->nDims, 0.9);
+    add_and_scale_w(ptrModel->temp_v, ptrModel->nDims, v, -0.1 * y * sig);
+    add_and_scale_ww(ptrModel->w, ptrModel->nDims, ptrModel->temp_v, 
+            -1*ptrModel->stepsize / ptrModel->wscale);
+    // regularization, L2 by scaling
+    LinearModel_regularize(ptrModel, 1);
+    double u = ptrModel->mu * ptrModel->stepsize / ptrModel->wscale;
+    l1_shrink_mask_d_w(ptrModel->w, u, ptrModel->nDims);
+    return wx;
+}
+
+/**
+ * one step over the buffered mini-batch: all rows see the same w,
+ * and w and temp_v are each streamed once for the whole batch
+ */
+inline void
+dense_logit_grad_batch(struct LinearModel *ptrModel) {
+    const int n = ptrModel->nBuffered;
+    const int d = ptrModel->nDims;
+    double *c = ptrModel->batchC;
+    int b;
+    if (n == 0) { return; }
+    // wx for every row
+    dot_batch_w(ptrModel->w, ptrModel->batchX, n, d, c);
+    for (b = 0; b < n; b++) {
+        double y = ptrModel->batchY[b];
+        c[b] = -0.1 * y * sigma(-ptrModel->wscale * c[b] * y);
+    }
+    // momentum over the summed batch gradient
+    scale_i_w(ptrModel->temp_v, d, 0.9);
+    add_and_scale_batch_w(ptrModel->temp_v, ptrModel->batchX, n, d, c);
+    add_and_scale_ww(ptrModel->w, d, ptrModel->temp_v, 
+            -1*ptrModel->stepsize / ptrModel->wscale);
+    // regularization, n steps worth, L2 by scaling
+    LinearModel_regularize(ptrModel, n);
+    double u = ptrModel->mu * ptrModel->stepsize * n / ptrModel->wscale;
+    l1_shrink_mask_d_w(ptrModel->w, u, d);
+    ptrModel->nBuffered = 0;
 }
 
 inline double
 sparse_logit_loss(struct LinearModel *ptrModel, const int len, const int *k, const double *v, const int y) {
-    double wx = dot_dss(ptrModel->w, k, v, len);
-    return log(1 + exp(-y * wx));
+    double wx = ptrModel->wscale * dot_dss_w(ptrModel->w, k, v, len);
+    return logit_margin_loss(wx, y);
 }
 
 inline double
 dense_logit_loss(struct LinearModel *ptrModel, const double *v, const int y) {
-    double wx = dot(ptrModel->w, v, ptrModel->nDims);
-    return log(1 + exp(-y * wx));
+    double wx = ptrModel->wscale * dot_w(ptrModel->w, v, ptrModel->nDims);
+    return logit_margin_loss(wx, y);
 }
 
 inline double
 sparse_logit_pred(struct LinearModel *ptrModel, const int len, const int *k, const double *v) {
-    double wx = dot_dss(ptrModel->w, k, v, len);
+    double wx = ptrModel->wscale * dot_dss_w(ptrModel->w, k, v, len);
     return 1. / (1. + exp(-1 * wx));
 }
 
 inline double
 dense_logit_pred(struct LinearModel *ptrModel, const double *v) {
-    double wx = dot(ptrModel->w, v, ptrModel->nDims);
+    double wx = ptrModel->wscale * dot_w(ptrModel->w, v, ptrModel->nDims);
     return 1. / (1. + exp(-1 * wx));
 }
 
@@ -17,58 +17,106 @@ limitations under the License.
 #ifndef SVM_H
 #define SVM_H
 
-void
+/** hinge loss of a row with margin wx = w.x */
+double
+svm_margin_loss(const double wx, const int y) {
+    double loss = 1 - y * wx;
+    return (loss > 0) ? loss : 0;
+}
+
+/**
+ * the gradient steps return the margin wx of the row against the model
+ * before the step, from which its loss comes for free
+ */
+double
 sparse_svm_grad(struct LinearModel *ptrModel, int len, int *k, double *v, int y) {
+    // pending regularization of the weights we are about to read
+    LinearModel_l1_catch_up(ptrModel, k, len);
     // read and prepare
-    double wx = dot_dss(ptrModel->w, k, v, len);
-    double c = ptrModel->stepsize * y;
+    double wx = ptrModel->wscale * dot_dss_w(ptrModel->w, k, v, len);
+    double c = ptrModel->stepsize * y / ptrModel->wscale;
     // writes
     if(1 - y * wx > 0) {
-        add_and_scale_dss(ptrModel->w, k, v, len, c);
+        add_and_scale_dss_w(ptrModel->w, k, v, len, c);
     }
-    // regularization
-    double u = ptrModel->mu * ptrModel->stepsize;
-    l1_shrink_mask(ptrModel->w, u, k, len);
+    // regularization, L2 by scaling and L1 applied lazily
+    LinearModel_regularize(ptrModel, 1);
+    LinearModel_l1_advance(ptrModel, 
+            ptrModel->mu * ptrModel->stepsize / ptrModel->wscale);
+    return wx;
 }
 
-void
+double
 dense_svm_grad(struct LinearModel *ptrModel, double *v, int y) {
+    // pending regularization of the weights v does not zero out
+    LinearModel_l1_catch_up_d(ptrModel, v);
     // read and prepare
-    double wx = dot(ptrModel->w, v, ptrModel->nDims);
-    double c = ptrModel->stepsize * y;
-    // writes
+    double wx = ptrModel->wscale * dot_w(ptrModel->w, v, ptrModel->nDims);
+    double c = ptrModel->stepsize * y / ptrModel->wscale;
+    // writes, stale weights only ever get c * 0 added
     if(1 - y * wx > 0) {
-        add_and_scale(ptrModel->w, ptrModel->nDims, v, c);
+        add_and_scale_w(ptrModel->w, ptrModel->nDims, v, c);
     }
-    // regularization
-    double u = ptrModel->mu * ptrModel->stepsize;
-    l1_shrink_mask_d(ptrModel->w, u, ptrModel->nDims);
+    // regularization, L2 by scaling and L1 applied lazily
+    LinearModel_regularize(ptrModel, 1);
+    LinearModel_l1_advance(ptrModel, 
+            ptrModel->mu * ptrModel->stepsize / ptrModel->wscale);
+    return wx;
+}
+
+/**
+ * one step over the buffered mini-batch: all rows see the same w,
+ * which is streamed once for the whole batch
+ */
+void
+dense_svm_grad_batch(struct LinearModel *ptrModel) {
+    const int n = ptrModel->nBuffered;
+    const int d = ptrModel->nDims;
+    double *c = ptrModel->batchC;
+    int b;
+    if (n == 0) { return; }
+    // pending regularization of the weights any row reads
+    for (b = 0; b < n; b++) {
+        LinearModel_l1_catch_up_d(ptrModel, ptrModel->batchX + (size_t) b * d);
+    }
+    // wx for every row
+    dot_batch_w(ptrModel->w, ptrModel->batchX, n, d, c);
+    for (b = 0; b < n; b++) {
+        double y = ptrModel->batchY[b];
+        double wx = ptrModel->wscale * c[b];
+        c[b] = (1 - y * wx > 0) ? ptrModel->stepsize * y / ptrModel->wscale : 0.0;
+    }
+    // writes
+    add_and_scale_batch_w(ptrModel->w, ptrModel->batchX, n, d, c);
+    // regularization, n steps worth, L2 by scaling and L1 applied lazily
+    LinearModel_regularize(ptrModel, n);
+    LinearModel_l1_advance(ptrModel, 
+            ptrModel->mu * ptrModel->stepsize * n / ptrModel->wscale);
+    ptrModel->nBuffered = 0;
 }
 
 double
 sparse_svm_loss(struct LinearModel *ptrModel, int len, int *k, double *v, int y) {
-    double wx = dot_dss(ptrModel->w, k, v, len);
-    double loss = 1 - y * wx;
-    return (loss > 0) ? loss : 0;
+    double wx = ptrModel->wscale * dot_dss_w(ptrModel->w, k, v, len);
+    return svm_margin_loss(wx, y);
 }
 
 double
 dense_svm_loss(struct LinearModel *ptrModel, double *v, int y) {
-    double wx = dot(ptrModel->w, v, ptrModel->nDims);
-    double loss = 1 - y * wx;
-    return (loss > 0) ? loss : 0;
+    double wx = ptrModel->wscale * dot_w(ptrModel->w, v, ptrModel->nDims);
+    return svm_margin_loss(wx, y);
 }
 
 double
 sparse_svm_pred(struct LinearModel *ptrModel, int len, int *k, double *v) {
-    double wx = dot_dss(ptrModel->w, k, v, len);
+    double wx = ptrModel->wscale * dot_dss_w(ptrModel->w, k, v, len);
     double loss = 1 - wx;
     return (loss > 0) ? 1 : -1;
 }
 
 double
 dense_svm_pred(struct LinearModel *ptrModel, double *v) {
-    double wx = dot(ptrModel->w, v, ptrModel->nDims);
+    double wx = ptrModel->wscale * dot_w(ptrModel->w, v, ptrModel->nDims);
     double loss = 1 - wx;
     return (loss > 0) ? 1 : -1;
 }
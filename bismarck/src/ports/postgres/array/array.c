@@ -16,10 +16,36 @@ limitations under the License.
 
 #include "utils/numeric.h"
 #include "../c_udf_helper.h"
+#include "storage/itemptr.h"
+#include "access/htup.h"
+#if PG_VERSION_NUM >= 90300
+#include "access/htup_details.h"
+#endif
+#if PG_VERSION_NUM >= 90000
+#include "miscadmin.h"
+#include "access/heapam.h"
+#include "catalog/pg_class.h"
+#include "nodes/execnodes.h"
+#include "storage/bufmgr.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/tuplestore.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/relation.h"
+#include "catalog/pg_am.h"
+#else
+#include "utils/tqual.h"
+#endif
+#endif
 
 /* the proof of postgresql version 1 C UDF */
 PG_FUNCTION_INFO_V1(alloc_float8_array);
 PG_FUNCTION_INFO_V1(alloc_float8_array_random);
+PG_FUNCTION_INFO_V1(model_shmem_info);
+PG_FUNCTION_INFO_V1(block_permutation);
+PG_FUNCTION_INFO_V1(block_rows);
+PG_FUNCTION_INFO_V1(block_rows_supported);
 
 /**
  * alloc and return a huge float8 array
@@ -68,3 +94,150 @@ alloc_float8_array_random(PG_FUNCTION_ARGS) {
     PG_RETURN_ARRAYTYPE_P(retarray);
 }
 
+/**
+ * shared memory of the model of mid in any of the shared-memory builds,
+ * {bytes, bytes per page}, which tells if it got huge pages
+ */
+Datum
+model_shmem_info(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    double info[2];
+    get_model_shmem_info(mid, info);
+
+    PG_RETURN_ARRAYTYPE_P(my_float8_array(info, 2));
+}
+
+/**
+ * a random permutation of the blocks 0 .. nblocks - 1 of a table, the
+ * same for the same seed; one drawn for every epoch reshuffles the table
+ * without writing it
+ */
+Datum
+block_permutation(PG_FUNCTION_ARGS) {
+    int nblocks = PG_GETARG_INT32(0);
+    uint64_t state = (uint32) PG_GETARG_INT32(1);
+    if (nblocks < 0) { nblocks = 0; }
+	ArrayType *retarray = my_construct_array(nblocks, sizeof(int32), INT4OID);
+    int32 *blocks = (int32 *) ARR_DATA_PTR(retarray);
+    int b;
+    for (b = 0; b < nblocks; b++) { blocks[b] = b; }
+    SHUFFLE(blocks, nblocks, int32, &state);
+
+    PG_RETURN_ARRAYTYPE_P(retarray);
+}
+
+/**
+ * the rows of a table in the blocks of blocks[], those the snapshot of the
+ * query sees, in a random order drawn from seed and the first block. the
+ * table is the one of the row type of the first argument, e.g.
+ *     SELECT * FROM block_rows(NULL::dblife, '{7, 3}', 42);
+ * each block is read once, in the order of blocks[], and its rows are
+ * shuffled with those of the other blocks of the call before any is
+ * returned, so a call over the next slice of block_permutation() reads the
+ * table in chunks of that many blocks, each in an order of its own.
+ */
+Datum
+block_rows(PG_FUNCTION_ARGS) {
+#if PG_VERSION_NUM >= 90000
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+            !(rsinfo->allowedModes & SFRM_Materialize)) {
+        elog(ERROR, "In block_rows, it can only be called in FROM");
+    }
+    Oid relid = get_typ_typrelid(get_fn_expr_argtype(fcinfo->flinfo, 0));
+    if (!OidIsValid(relid)) {
+        elog(ERROR, "In block_rows, the first argument must be of the row type of a table");
+    }
+    Relation rel = relation_open(relid, AccessShareLock);
+    if (rel->rd_rel->relkind != RELKIND_RELATION
+#if PG_VERSION_NUM >= 120000
+            || rel->rd_rel->relam != HEAP_TABLE_AM_OID
+#endif
+            ) {
+        elog(ERROR, "In block_rows, %s is not a heap table", RelationGetRelationName(rel));
+    }
+
+    // -------------------------------------------------------------------
+    // 1. copy the visible rows of the blocks
+    // -------------------------------------------------------------------
+    int32 *blocks = NULL;
+    int nblocks = 0;
+    if (!PG_ARGISNULL(1)) {
+        ArrayType *blockArray = PG_GETARG_ARRAYTYPE_P(1);
+        if (ARR_HASNULL(blockArray)) { elog(ERROR, "In block_rows, blocks must not contain nulls"); }
+        blocks = (int32 *) ARR_DATA_PTR(blockArray);
+        nblocks = ArrayGetNItems(ARR_NDIM(blockArray), ARR_DIMS(blockArray));
+    }
+    BlockNumber relBlocks = RelationGetNumberOfBlocks(rel);
+    Snapshot snapshot = GetActiveSnapshot();
+    int nrows = 0, maxRows = nblocks > 0 ? nblocks * 64 : 1;
+    HeapTuple *rows = (HeapTuple *) palloc(maxRows * sizeof(HeapTuple));
+    int b;
+    for (b = 0; b < nblocks; b++) {
+        CHECK_FOR_INTERRUPTS();
+        // the table may have been truncated since the blocks were drawn
+        if (blocks[b] < 0 || (BlockNumber) blocks[b] >= relBlocks) { continue; }
+        Buffer buffer = ReadBuffer(rel, (BlockNumber) blocks[b]);
+        LockBuffer(buffer, BUFFER_LOCK_SHARE);
+#if PG_VERSION_NUM >= 90600 && PG_VERSION_NUM < 100000
+        Page page = BufferGetPage(buffer, NULL, NULL, BGP_NO_SNAPSHOT_TEST);
+#else
+        Page page = BufferGetPage(buffer);
+#endif
+        OffsetNumber off, maxOff = PageGetMaxOffsetNumber(page);
+        for (off = FirstOffsetNumber; off <= maxOff; off++) {
+            ItemId itemId = PageGetItemId(page, off);
+            if (!ItemIdIsNormal(itemId)) { continue; }
+            HeapTupleData tuple;
+            tuple.t_data = (HeapTupleHeader) PageGetItem(page, itemId);
+            tuple.t_len = ItemIdGetLength(itemId);
+            tuple.t_tableOid = relid;
+            ItemPointerSet(&tuple.t_self, blocks[b], off);
+            if (!HeapTupleSatisfiesVisibility(&tuple, snapshot, buffer)) { continue; }
+            if (nrows == maxRows) {
+                maxRows *= 2;
+                rows = (HeapTuple *) repalloc(rows, maxRows * sizeof(HeapTuple));
+            }
+            rows[nrows++] = heap_copytuple(&tuple);
+        }
+        UnlockReleaseBuffer(buffer);
+    }
+
+    // -------------------------------------------------------------------
+    // 2. return them shuffled
+    // -------------------------------------------------------------------
+    uint64_t state = ((uint64_t) (uint32) PG_GETARG_INT32(2) << 32) |
+            (uint32) (nblocks > 0 ? blocks[0] : 0);
+    SHUFFLE(rows, nrows, HeapTuple, &state);
+
+    MemoryContext oldContext = MemoryContextSwitchTo(
+            rsinfo->econtext->ecxt_per_query_memory);
+    TupleDesc tupdesc = CreateTupleDescCopy(RelationGetDescr(rel));
+    Tuplestorestate *store = tuplestore_begin_heap(false, false, work_mem);
+    MemoryContextSwitchTo(oldContext);
+    int r;
+    for (r = 0; r < nrows; r++) {
+        tuplestore_puttuple(store, rows[r]);
+        heap_freetuple(rows[r]);
+    }
+    pfree(rows);
+    relation_close(rel, NoLock);
+
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = store;
+    rsinfo->setDesc = tupdesc;
+    return (Datum) 0;
+#else
+    elog(ERROR, "In block_rows, it needs PostgreSQL 9.0 or later");
+    PG_RETURN_NULL();
+#endif
+}
+
+/**
+ * whether block_rows works in this build; without it (before PostgreSQL
+ * 9.0, e.g. Greenplum) a shuffle takes an ORDER BY random() copy instead
+ */
+Datum
+block_rows_supported(PG_FUNCTION_ARGS) {
+    PG_RETURN_BOOL(PG_VERSION_NUM >= 90000);
+}
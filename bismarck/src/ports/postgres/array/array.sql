@@ -26,3 +26,65 @@ RETURNS double precision[]
 AS 'bismarck-array', 'alloc_float8_array_random'
 LANGUAGE C IMMUTABLE STRICT;
 
+-- shared memory of the model of a mid: {bytes, bytes per page}
+DROP FUNCTION IF EXISTS model_shmem_info(integer) CASCADE;
+CREATE FUNCTION model_shmem_info(integer)
+RETURNS double precision[]
+AS 'bismarck-array', 'model_shmem_info'
+LANGUAGE C STRICT;
+
+-- a random permutation of the blocks 0 .. nblocks - 1 of a table, by seed
+DROP FUNCTION IF EXISTS block_permutation(integer, integer) CASCADE;
+CREATE FUNCTION block_permutation(integer, integer)
+RETURNS integer[]
+AS 'bismarck-array', 'block_permutation'
+LANGUAGE C IMMUTABLE STRICT;
+
+-- the visible rows of the blocks of a table, shuffled, for a scan of them
+DROP FUNCTION IF EXISTS block_rows(anyelement, integer[], integer) CASCADE;
+CREATE FUNCTION block_rows(anyelement, integer[], integer)
+RETURNS SETOF anyelement
+AS 'bismarck-array', 'block_rows'
+LANGUAGE C VOLATILE;
+
+-- whether block_rows, and so shuffled_scan, works on this server
+DROP FUNCTION IF EXISTS block_rows_supported() CASCADE;
+CREATE FUNCTION block_rows_supported()
+RETURNS boolean
+AS 'bismarck-array', 'block_rows_supported'
+LANGUAGE C IMMUTABLE;
+
+-- run SELECT select_list FROM relation over all of the table, nblocks of
+-- its blocks at a time in a random order drawn from seed, without a copy
+-- of it; a new seed every epoch reshuffles it. the rows of each chunk of
+-- nblocks blocks are shuffled among themselves, so the order is random
+-- across chunks and within them, while every block is read just once.
+-- relation is a table name, quoted if needed. select_list is one number
+-- per query, e.g. a count or a sum of losses, and the sum of them over the
+-- whole table is returned
+DROP FUNCTION IF EXISTS shuffled_scan(select_list text, relation text, seed integer, nblocks integer) CASCADE;
+CREATE FUNCTION shuffled_scan(select_list text, relation text, seed integer, nblocks integer)
+RETURNS double precision AS $$
+DECLARE
+	blocks integer[];
+	n integer;
+	part double precision;
+	total double precision := 0;
+BEGIN
+	n := pg_relation_size(relation::regclass) / current_setting('block_size')::integer;
+	blocks := block_permutation(n, seed);
+	FOR first IN 1..n BY nblocks LOOP
+		EXECUTE 'SELECT ' || select_list || ' FROM block_rows(NULL::' || relation || ', $1, $2)'
+			INTO part
+			USING blocks[first:first + nblocks - 1], seed;
+		total := total + coalesce(part, 0);
+	END LOOP;
+	RETURN total;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+DROP FUNCTION IF EXISTS shuffled_scan(select_list text, relation text, seed integer) CASCADE;
+CREATE FUNCTION shuffled_scan(select_list text, relation text, seed integer)
+RETURNS double precision AS $$
+	SELECT shuffled_scan($1, $2, $3, 64);
+$$ LANGUAGE sql VOLATILE;
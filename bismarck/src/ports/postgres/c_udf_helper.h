@@ -20,6 +20,9 @@ limitations under the License.
 #include <sys/shm.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "postgres.h"
 #include "fmgr.h"
@@ -30,52 +33,582 @@ limitations under the License.
 #include "executor/spi.h"
 #include "access/tuptoaster.h"
 
+#include "utils/spinlock.h"
+
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 
 #ifdef PG_MODULE_MAGIC
 PG_MODULE_MAGIC;
 #endif
 
 /* macros that are subject to change due to system environment */
-#define SHARED_MEM_SIZE (1 << 30)
 #define ARRAY_HEAD_SIZE (20)
+// huge page size when /proc/meminfo does not tell, that of x86-64 linux
+#define DEFAULT_HUGE_PAGE_SIZE (2L << 20)
+// models one user can have in shared memory at once
+#define MODEL_REGISTRY_SIZE (1024)
+// models one backend keeps attached at once
+#define MODEL_CACHE_SIZE (16)
+// longest path of a model checkpoint file
+#define MODEL_CHECKPOINT_PATH (1024)
+
+/** a model in the registry: its segment, and when it was created */
+struct ModelEntry {
+	int mid;
+	int used;
+	int shmid;
+	uint32_t generation;
+};
+
+/**
+ * the registry of the models in shared memory, a POSIX shared memory
+ * object of the user running the database. every model segment is a
+ * private (IPC_PRIVATE) SysV segment found through its entry here by the
+ * full mid, so no two models share a key as with ftok, which keeps only
+ * the low 8 bits of the mid. every push of a model gets a new generation,
+ * and every push or pop bumps the generation of the registry.
+ */
+struct ModelRegistry {
+	struct SpinLock lock;
+	uint32_t generation;
+	// entries ever used, the rest are all zeros
+	int nEntries;
+	struct ModelEntry entries[MODEL_REGISTRY_SIZE];
+};
+
+/**
+ * map the registry, creating it (all zeros) if this is the first model;
+ * this and the functions below are static, they are too big to be inlined
+ */
+static inline struct ModelRegistry *
+get_model_registry() {
+	static struct ModelRegistry *registry = NULL;
+	if (registry == NULL) {
+		char name[64];
+		int fd;
+		void *ptr;
+		snprintf(name, sizeof(name), "/bismarck_models.%d", (int) getuid());
+		fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+		if (fd == -1) { elog(ERROR, "could not open the model registry %s: %m", name); }
+		if (ftruncate(fd, sizeof(struct ModelRegistry)) == -1) {
+			close(fd);
+			elog(ERROR, "could not size the model registry %s: %m", name);
+		}
+		ptr = mmap(NULL, sizeof(struct ModelRegistry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (ptr == MAP_FAILED) { elog(ERROR, "could not map the model registry %s: %m", name); }
+		registry = (struct ModelRegistry *) ptr;
+	}
+	return registry;
+}
+
+/**
+ * the entry of mid, or NULL; with the registry locked
+ */
+static inline struct ModelEntry *
+find_model_entry(struct ModelRegistry *registry, int mid) {
+	int k;
+	for (k = 0; k < registry->nEntries; k++) {
+		if (registry->entries[k].used && registry->entries[k].mid == mid) {
+			return &(registry->entries[k]);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * the segment of the model of mid and its generation, or -1
+ */
+static inline int
+lookup_model_shmem(int mid, uint32_t *generation) {
+	struct ModelRegistry *registry = get_model_registry();
+	struct ModelEntry *entry;
+	int shmid = -1;
+	spin_lock(&(registry->lock));
+	entry = find_model_entry(registry, mid);
+	if (entry != NULL) {
+		shmid = entry->shmid;
+		if (generation != NULL) { *generation = entry->generation; }
+	}
+	spin_unlock(&(registry->lock));
+	return shmid;
+}
+
+/** a model segment this backend has attached */
+struct ModelAttachment {
+	int mid;
+	uint32_t generation;
+	char *ptr;
+};
 
 /**
- * string functions def
+ * the models this backend has attached, kept across calls. they are
+ * valid as long as the generation of the registry is the one seen when
+ * they were last checked, so a call costs one read of the registry and
+ * no syscall; the segments of models pushed again or popped since are
+ * detached when the generation has moved.
  */
-inline char* 
-pack_shmem_name(int mid, char* buf, int size) {
-	memset(buf, '\0', size);
-	sprintf(buf, "/mid%d", mid);
-    return buf;
+static struct ModelCache {
+	uint32_t generation;
+	int nAttached;
+	// the last one returned, tried first
+	int last;
+	struct ModelAttachment attached[MODEL_CACHE_SIZE];
+} modelCache;
+
+/**
+ * detach the k-th cached model, the last one takes its place
+ */
+static inline void
+model_cache_drop(int k) {
+	shmdt(modelCache.attached[k].ptr);
+	modelCache.attached[k] = modelCache.attached[-- modelCache.nAttached];
+	modelCache.last = 0;
 }
 
 /**
- * create or get a shared memory region of mid
+ * drop the cached models that are not in the registry any more, or are
+ * of an older generation; with the registry locked
+ */
+static inline void
+model_cache_check(struct ModelRegistry *registry) {
+	int k = 0;
+	while (k < modelCache.nAttached) {
+		struct ModelEntry *entry = find_model_entry(registry, modelCache.attached[k].mid);
+		if (entry == NULL || entry->generation != modelCache.attached[k].generation) {
+			model_cache_drop(k);
+		} else {
+			k ++;
+		}
+	}
+	modelCache.generation = registry->generation;
+}
+
+/**
+ * the shared memory region of mid, attached on first use and cached
  *
  * args:
  *   mid int, model id
  * return:
  *   pointer char*, start pointer
  */
-inline char *
+static inline char *
 get_model_by_mid(int mid) {
+	struct ModelRegistry *registry = get_model_registry();
+	struct ModelAttachment *attachment;
+	uint32_t generation;
 	char* ptrModel;
-	char buf[20];
-	// open the shared memory
-	int shmid = shmget(ftok("/", mid), 0, SHM_R | SHM_W);
-	if (shmid == -1) {	elog(ERROR, "In get model by id, shmget failed!\n"); }
-	// elog(WARNING, "init: after shmget\n");
-	// attach the memory region
+	int shmid;
+	int k;
+	if (__atomic_load_n(&(registry->generation), __ATOMIC_ACQUIRE) == modelCache.generation) {
+		attachment = &(modelCache.attached[modelCache.last]);
+		if (modelCache.last < modelCache.nAttached && attachment->mid == mid) {
+			return attachment->ptr;
+		}
+		for (k = 0; k < modelCache.nAttached; k++) {
+			if (modelCache.attached[k].mid == mid) {
+				modelCache.last = k;
+				return modelCache.attached[k].ptr;
+			}
+		}
+	}
+	// not attached, or some model was pushed or popped since the check
+	spin_lock(&(registry->lock));
+	model_cache_check(registry);
+	struct ModelEntry *entry = find_model_entry(registry, mid);
+	shmid = entry != NULL ? entry->shmid : -1;
+	generation = entry != NULL ? entry->generation : 0;
+	spin_unlock(&(registry->lock));
+	for (k = 0; k < modelCache.nAttached; k++) {
+		if (modelCache.attached[k].mid == mid) {
+			modelCache.last = k;
+			return modelCache.attached[k].ptr;
+		}
+	}
+	if (shmid == -1) { elog(ERROR, "no model with mid %d in shared memory", mid); }
+	// attach the memory region, making room in the cache
 	ptrModel = (char *)shmat(shmid, NULL, 0);
-	// elog(WARNING, "init: after shmat, model: %x\n", ptrModel);
+	if (ptrModel == (char *) -1) { elog(ERROR, "could not attach the model with mid %d: %m", mid); }
+	if (modelCache.nAttached == MODEL_CACHE_SIZE) { model_cache_drop(0); }
+	k = modelCache.nAttached ++;
+	modelCache.attached[k].mid = mid;
+	modelCache.attached[k].generation = generation;
+	modelCache.attached[k].ptr = ptrModel;
+	modelCache.last = k;
 	return ptrModel;
 }
 
+/**
+ * a number of /proc/meminfo, e.g. "Hugepagesize: %ld kB", or dflt
+ */
+static inline long
+meminfo_value(const char *format, long dflt) {
+	char line[128];
+	long value;
+	FILE *meminfo = fopen("/proc/meminfo", "r");
+	if (meminfo != NULL) {
+		while (fgets(line, sizeof(line), meminfo) != NULL) {
+			if (sscanf(line, format, &value) == 1) {
+				dflt = value;
+				break;
+			}
+		}
+		fclose(meminfo);
+	}
+	return dflt;
+}
+
+/**
+ * a new private segment of size bytes, in huge pages (SHM_HUGETLB) when
+ * the kernel has enough of them reserved, see vm.nr_hugepages, and in
+ * normal pages otherwise. size is rounded up to whole pages of the kind
+ * obtained.
+ */
+static inline int
+create_shmem(int mid, size_t size) {
+	long page = sysconf(_SC_PAGESIZE);
+	int shmid;
+#ifdef SHM_HUGETLB
+	long hugePage = meminfo_value("Hugepagesize: %ld kB", DEFAULT_HUGE_PAGE_SIZE >> 10) << 10;
+	shmid = shmget(IPC_PRIVATE, (size + hugePage - 1) / hugePage * hugePage,
+			SHM_R | SHM_W | IPC_CREAT | SHM_HUGETLB);
+	if (shmid != -1) { return shmid; }
+	// only worth a notice if huge pages were meant to be used
+	int hugeErrno = errno;
+	int level = meminfo_value("HugePages_Total: %ld", 0) > 0 ? NOTICE : DEBUG1;
+	errno = hugeErrno;
+	elog(level, "model %d: no huge pages for %ld kB of shared memory (%m), using %ld kB pages",
+			mid, (long) (size >> 10), page >> 10);
+#endif
+	shmid = shmget(IPC_PRIVATE, (size + page - 1) / page * page, SHM_R | SHM_W | IPC_CREAT);
+	if (shmid == -1) { elog(ERROR, "In init, shmget failed: %m"); }
+	return shmid;
+}
+
+/**
+ * create the shared memory region of a new model of mid and register it.
+ * a region left by an earlier model of mid is removed; it goes away once
+ * the backends still attached to it detach.
+ *
+ * args:
+ *   mid int, model id
+ *   size size_t, bytes needed
+ * return:
+ *   shmid int, the region; errors out if none could be created
+ */
+static inline int
+create_model_shmem(int mid, size_t size) {
+	struct ModelRegistry *registry = get_model_registry();
+	struct ModelEntry *entry;
+	int shmid = create_shmem(mid, size);
+	int oldShmid = -1;
+	spin_lock(&(registry->lock));
+	entry = find_model_entry(registry, mid);
+	if (entry != NULL) {
+		oldShmid = entry->shmid;
+	} else {
+		int k;
+		for (k = 0; k < registry->nEntries && registry->entries[k].used; k++) { }
+		if (k < MODEL_REGISTRY_SIZE) {
+			entry = &(registry->entries[k]);
+			if (k == registry->nEntries) { registry->nEntries ++; }
+		}
+	}
+	if (entry != NULL) {
+		entry->mid = mid;
+		entry->shmid = shmid;
+		entry->generation = __atomic_add_fetch(&(registry->generation), 1, __ATOMIC_RELEASE);
+		entry->used = 1;
+	}
+	spin_unlock(&(registry->lock));
+	if (entry == NULL) {
+		shmctl(shmid, IPC_RMID, NULL);
+		elog(ERROR, "model %d: the registry is full, %d models are in shared memory",
+				mid, MODEL_REGISTRY_SIZE);
+	}
+	if (oldShmid != -1) { shmctl(oldShmid, IPC_RMID, NULL); }
+	return shmid;
+}
+
+/** the head of a model checkpoint file, the model region follows */
+struct ModelCheckpoint {
+	char magic[8];
+	int mid;
+	// epochs done when it was taken
+	int epoch;
+	uint64_t bytes;
+};
+
+#define MODEL_CHECKPOINT_MAGIC "BISMARCK"
+
+/**
+ * the checkpoint a thread of this backend is writing, one at a time. the
+ * thread only writes the copy of the model it is given, it never calls
+ * into PG.
+ */
+static struct CheckpointWriter {
+	pthread_t thread;
+	int running;
+	// errno of the write, 0 if it went fine
+	int error;
+	char path[MODEL_CHECKPOINT_PATH];
+	struct ModelCheckpoint head;
+	// malloc'ed copy of the model region
+	char *data;
+} checkpointWriter;
+
+/**
+ * write all of len bytes of buf to fd
+ */
+static inline int
+write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR) { continue; }
+			return 0;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+/**
+ * write the checkpoint to path.tmp, sync it and rename it over path, so
+ * path always holds a whole checkpoint
+ */
+static inline void *
+checkpoint_thread(void *arg) {
+	struct CheckpointWriter *writer = (struct CheckpointWriter *) arg;
+	char tmpPath[MODEL_CHECKPOINT_PATH + 4];
+	int fd;
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", writer->path);
+	writer->error = 0;
+	fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1
+			|| !write_all(fd, (char *) &(writer->head), sizeof(struct ModelCheckpoint))
+			|| !write_all(fd, writer->data, writer->head.bytes)
+			|| fsync(fd) != 0) {
+		writer->error = errno;
+	}
+	if (fd != -1) { close(fd); }
+	if (writer->error == 0 && rename(tmpPath, writer->path) != 0) {
+		writer->error = errno;
+	}
+	free(writer->data);
+	writer->data = NULL;
+	return NULL;
+}
+
+/**
+ * wait for the checkpoint being written, if any; a failed write is only
+ * a warning, training goes on with the checkpoint before
+ */
+static inline void
+wait_model_checkpoint() {
+	if (!checkpointWriter.running) { return; }
+	pthread_join(checkpointWriter.thread, NULL);
+	checkpointWriter.running = 0;
+	if (checkpointWriter.error != 0) {
+		errno = checkpointWriter.error;
+		elog(WARNING, "could not write the checkpoint %s of model %d: %m",
+				checkpointWriter.path, checkpointWriter.head.mid);
+	}
+}
+
+/**
+ * unregister the model of mid and remove its region, which goes away
+ * once the backends attached to it detach; this backend detaches now,
+ * the others on their next call
+ */
+static inline void
+remove_model_shmem(int mid) {
+	struct ModelRegistry *registry = get_model_registry();
+	struct ModelEntry *entry;
+	int shmid = -1;
+	wait_model_checkpoint();
+	spin_lock(&(registry->lock));
+	entry = find_model_entry(registry, mid);
+	if (entry != NULL) {
+		shmid = entry->shmid;
+		entry->used = 0;
+		__atomic_add_fetch(&(registry->generation), 1, __ATOMIC_RELEASE);
+	}
+	model_cache_check(registry);
+	spin_unlock(&(registry->lock));
+	if (shmid == -1) { elog(ERROR, "In final, no model with mid %d in shared memory", mid); }
+	if (shmctl(shmid, IPC_RMID, NULL) == -1) {
+		elog(ERROR, "shmctl failed in final(): %m");
+	}
+}
+
+/**
+ * size and page size of the shared memory region of mid, as a
+ * double precision[] {bytes, bytes per page}; the page size is that of
+ * the mapping in /proc/self/smaps, or 0 where that cannot be read
+ */
+static inline void
+get_model_shmem_info(int mid, double *info) {
+	char line[256];
+	unsigned long lo, hi;
+	long kb;
+	int inRegion = 0;
+	struct shmid_ds shmBuf;
+	char *ptrModel = get_model_by_mid(mid);
+	int shmid = lookup_model_shmem(mid, NULL);
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+	info[0] = shmctl(shmid, IPC_STAT, &shmBuf) == 0 ? (double) shmBuf.shm_segsz : 0;
+	info[1] = 0;
+	if (smaps != NULL) {
+		while (fgets(line, sizeof(line), smaps) != NULL) {
+			if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+				inRegion = (unsigned long) ptrModel >= lo && (unsigned long) ptrModel < hi;
+			} else if (inRegion && sscanf(line, "KernelPageSize: %ld kB", &kb) == 1) {
+				info[1] = kb * 1024.0;
+				break;
+			}
+		}
+		fclose(smaps);
+	}
+}
+
 
 
+/**
+ * snapshot the first bytes of the region of mid, taken after epoch
+ * epochs, to the file path. the region is copied without taking any lock,
+ * so the backends running grad are not held up, and the copy is as
+ * consistent as lock-free training leaves the model. a thread writes it
+ * out while this backend goes on; the next checkpoint, restore or pop
+ * waits for it.
+ */
+static inline void
+checkpoint_model_shmem(int mid, const char *path, int epoch, size_t bytes) {
+	char *ptrModel = get_model_by_mid(mid);
+	sigset_t allSignals, oldSignals;
+	int started;
+	wait_model_checkpoint();
+	if (strlen(path) >= MODEL_CHECKPOINT_PATH) {
+		elog(ERROR, "checkpoint path too long: %s", path);
+	}
+	checkpointWriter.data = (char *) malloc(bytes);
+	if (checkpointWriter.data == NULL) {
+		elog(ERROR, "out of memory for a checkpoint of %ld MB", (long) (bytes >> 20));
+	}
+	memcpy(checkpointWriter.data, ptrModel, bytes);
+	memcpy(checkpointWriter.head.magic, MODEL_CHECKPOINT_MAGIC, sizeof(checkpointWriter.head.magic));
+	checkpointWriter.head.mid = mid;
+	checkpointWriter.head.epoch = epoch;
+	checkpointWriter.head.bytes = bytes;
+	strcpy(checkpointWriter.path, path);
+	// the thread must not take the signals of the backend
+	sigfillset(&allSignals);
+	pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+	started = pthread_create(&(checkpointWriter.thread), NULL,
+			checkpoint_thread, &checkpointWriter) == 0;
+	pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+	if (started) {
+		checkpointWriter.running = 1;
+	} else {
+		// no thread to spare, write it here
+		checkpoint_thread(&checkpointWriter);
+		if (checkpointWriter.error != 0) {
+			errno = checkpointWriter.error;
+			elog(WARNING, "could not write the checkpoint %s of model %d: %m", path, mid);
+		}
+	}
+}
+
+/**
+ * the bytes a module expects of a model region, from the region itself
+ * (at least minBytes of it), for restore_model_shmem
+ */
+typedef size_t (*ModelSizeFn)(const char *ptrModel);
+
+/**
+ * push the model of mid again from the checkpoint file path, whose head
+ * is returned in head. the region is read aside and only replaces the
+ * model in shared memory once it is whole and of minBytes or more, and
+ * modelSize of it is its size; the module then sets up its locks again
+ */
+static inline char *
+restore_model_shmem(int mid, const char *path, struct ModelCheckpoint *head,
+		size_t minBytes, ModelSizeFn modelSize) {
+	char *buffer, *ptrModel;
+	FILE *file;
+	int truncated;
+	wait_model_checkpoint();
+	file = fopen(path, "r");
+	if (file == NULL) { elog(ERROR, "could not open the checkpoint %s: %m", path); }
+	if (fread(head, sizeof(struct ModelCheckpoint), 1, file) != 1
+			|| memcmp(head->magic, MODEL_CHECKPOINT_MAGIC, sizeof(head->magic)) != 0) {
+		fclose(file);
+		elog(ERROR, "%s is not a model checkpoint", path);
+	}
+	if (head->mid != mid) {
+		fclose(file);
+		elog(ERROR, "the checkpoint %s is of model %d, not %d", path, head->mid, mid);
+	}
+	if (head->bytes < minBytes) {
+		fclose(file);
+		elog(ERROR, "the checkpoint %s is not of this kind of model", path);
+	}
+	// malloc, not palloc, models can be over 1GB
+	buffer = malloc(head->bytes);
+	if (buffer == NULL) {
+		fclose(file);
+		elog(ERROR, "out of memory reading the checkpoint %s", path);
+	}
+	truncated = fread(buffer, 1, head->bytes, file) != head->bytes;
+	fclose(file);
+	if (truncated) {
+		free(buffer);
+		elog(ERROR, "the checkpoint %s is truncated", path);
+	}
+	if (modelSize(buffer) != head->bytes) {
+		free(buffer);
+		elog(ERROR, "the checkpoint %s is not of this kind of model", path);
+	}
+	create_model_shmem(mid, head->bytes);
+	ptrModel = get_model_by_mid(mid);
+	memcpy(ptrModel, buffer, head->bytes);
+	free(buffer);
+	return ptrModel;
+}
+
+/**
+ * the next number of a generator for shuffles (splitmix64); it is seeded
+ * once, e.g. from random(), so a shuffle does not use up random()
+ */
+static inline uint64_t
+shuffle_next(uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/** a number in [0, n) */
+static inline uint64_t
+shuffle_below(uint64_t *state, uint64_t n) {
+	return (uint64_t) (((unsigned __int128) shuffle_next(state) * n) >> 64);
+}
+
+/** shuffle the n items of type of an array in place (Fisher-Yates) */
+#define SHUFFLE(items, n, type, state) do { \
+	int64_t k_; \
+	for (k_ = (int64_t) (n) - 1; k_ > 0; k_--) { \
+		int64_t other_ = (int64_t) shuffle_below((state), k_ + 1); \
+		type swap_ = (items)[k_]; \
+		(items)[k_] = (items)[other_]; \
+		(items)[other_] = swap_; \
+	} \
+} while (0)
+
  /* ----------------
   *      Variable-length datatypes all share the 'struct varlena' header.
   *
@@ -98,6 +631,38 @@ get_model_by_mid(int mid) {
  */
 
 
+/**
+ * tracing of my_parse_array_no_copy, which runs a few times per tuple,
+ * so production builds must not log anything there
+ *   ARRAY_TRACE_LEVEL 0  nothing (default)
+ *   ARRAY_TRACE_LEVEL 1  count the arrays by storage form, see array_parse_stats
+ *   ARRAY_TRACE_LEVEL 2  also ereport(INFO) every call
+ * e.g. make CFLAGS="-O3 -I../../.. -fpic -DARRAY_TRACE_LEVEL=1"
+ */
+#ifndef ARRAY_TRACE_LEVEL
+#define ARRAY_TRACE_LEVEL (0)
+#endif
+
+#if ARRAY_TRACE_LEVEL >= 2
+#define ARRAY_TRACE(...) \
+	ereport(INFO, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg(__VA_ARGS__)))
+#else
+#define ARRAY_TRACE(...) ((void) 0)
+#endif
+
+#if ARRAY_TRACE_LEVEL >= 1
+/* arrays parsed by this backend, by storage form */
+struct {
+	int64 nShort;		// 1-byte header
+	int64 nInline;		// 4-byte header, uncompressed
+	int64 nCompressed;	// compressed in line
+	int64 nExternal;	// toasted out of line
+} array_parse_counts;
+#define ARRAY_COUNT(field) (array_parse_counts.field ++)
+#else
+#define ARRAY_COUNT(field) ((void) 0)
+#endif
+
 /**
  * parse the array by NO PALLOC?
  *
@@ -111,44 +676,127 @@ get_model_by_mid(int mid) {
 
 inline int 
 my_parse_array_no_copy(struct varlena* input, int typesize, char** output) {
-    ereport( INFO,
-            ( errcode( ERRCODE_SUCCESSFUL_COMPLETION ),
-              errmsg( "call my parse array no copy: typesize %d, VARHDRSZ %d ARRAY_HEAD_SIZE %d\n", typesize, VARHDRSZ, ARRAY_HEAD_SIZE)));
-    
-    ereport( INFO,
-            ( errcode( ERRCODE_SUCCESSFUL_COMPLETION ),
-              errmsg( "VARATT_IS_EXTERNAL: %d\n", VARATT_IS_EXTERNAL(input))));
-    ereport( INFO,
-            ( errcode( ERRCODE_SUCCESSFUL_COMPLETION ),
-              errmsg( "VARATT_IS_COMPRESSED: %d\n", VARATT_IS_COMPRESSED(input))));
-    ereport( INFO,
-            ( errcode( ERRCODE_SUCCESSFUL_COMPLETION ),
-              errmsg( "VARSIZE_SHORT: %d\n", VARSIZE_SHORT(input))));
-	//elog(WARNING, "Inside loss(), for v, ISEXTERNAL %d, ISCOMPR %d, ISHORT %d, varsize_short %d", VARATT_IS_EXTERNAL(v2) ? 1 : 0, VARATT_IS_COMPRESSED(v2)  ? 1 : 0, VARATT_IS_SHORT(v2)  ? 1 : 0, VARSIZE_SHORT(v2));
+	ARRAY_TRACE("my_parse_array_no_copy: typesize %d, external %d, compressed %d, short %d",
+			typesize, VARATT_IS_EXTERNAL(input) ? 1 : 0, 
+			VARATT_IS_COMPRESSED(input) ? 1 : 0, VARATT_IS_SHORT(input) ? 1 : 0);
 	if (VARATT_IS_EXTERNAL(input) || VARATT_IS_COMPRESSED(input)) {
-    ereport( INFO,
-            ( errcode( ERRCODE_SUCCESSFUL_COMPLETION ),
-              errmsg( "here 1")));
-         
+		if (VARATT_IS_EXTERNAL(input)) { ARRAY_COUNT(nExternal); }
+		else { ARRAY_COUNT(nCompressed); }
 		// if compressed, palloc is necessary
 		input = heap_tuple_untoast_attr(input);
         *output = VARDATA(input) + ARRAY_HEAD_SIZE;
         return (VARSIZE(input) - VARHDRSZ - ARRAY_HEAD_SIZE) / typesize;
 	} else if (VARATT_IS_SHORT(input)) {
-    ereport( INFO,
-            ( errcode( ERRCODE_SUCCESSFUL_COMPLETION ),
-              errmsg( "here 2")));
+		ARRAY_COUNT(nShort);
         *output = VARDATA_SHORT(input) + ARRAY_HEAD_SIZE;
         return (VARSIZE_SHORT(input) - VARHDRSZ_SHORT - ARRAY_HEAD_SIZE) / typesize;
     } else {
-    ereport( INFO,
-            ( errcode( ERRCODE_SUCCESSFUL_COMPLETION ),
-              errmsg( "here 3")));
+		ARRAY_COUNT(nInline);
         *output = VARDATA(input) + ARRAY_HEAD_SIZE;
         return (VARSIZE(input) - VARHDRSZ - ARRAY_HEAD_SIZE) / typesize;
     }
 }
 
+/**
+ * a detoasted array argument kept across the calls of one query
+ */
+struct ArrayArgCache {
+	struct varlena *raw;	// a copy of the argument as it was passed
+	struct varlena *copy;	// detoasted, in fn_mcxt
+	int len;
+	char *data;
+};
+
+/**
+ * parse array argument argno, detoasting it only once per query
+ *
+ * the serialized model passed to loss/pred is the same value for every
+ * row, but when it is toasted my_parse_array_no_copy would decompress and
+ * copy all of it on every call. the detoasted copy is kept in fn_mcxt and
+ * hung off fn_extra, keyed by the whole toasted value as it was passed: the
+ * toast pointer of an out-of-line value (its value id), or all of the
+ * compressed bytes of an in-line one, which fit in a page. the key is
+ * compared in full, so another model never matches. arrays that are not
+ * toasted, as a *_serialize result is, are parsed in place without a copy
+ * and need no cache. the array must not be written to, and the caller
+ * must not use fn_extra for anything else.
+ *
+ * args:
+ *   fcinfo FunctionCallInfo, the calling UDF's call info
+ *   argno int, argument number
+ *   typesize int, size of element type
+ *   output (void*)*, start pointer of the array elements
+ * return:
+ *   int, length of the array, # of elements
+ */
+inline int
+my_parse_array_cached(FunctionCallInfo fcinfo, int argno, int typesize, char** output) {
+	struct varlena *input = (struct varlena *) PG_GETARG_RAW_VARLENA_P(argno);
+	struct ArrayArgCache *cache = (struct ArrayArgCache *) fcinfo->flinfo->fn_extra;
+	Size rawSize;
+	if (!VARATT_IS_EXTERNAL(input) && !VARATT_IS_COMPRESSED(input)) {
+		return my_parse_array_no_copy(input, typesize, output);
+	}
+	rawSize = VARSIZE_ANY(input);
+	if (cache == NULL) {
+		cache = (struct ArrayArgCache *) MemoryContextAllocZero(
+				fcinfo->flinfo->fn_mcxt, sizeof(struct ArrayArgCache));
+		fcinfo->flinfo->fn_extra = cache;
+	}
+	if (cache->raw == NULL || VARSIZE_ANY(cache->raw) != rawSize
+			|| memcmp(cache->raw, input, rawSize) != 0) {
+		MemoryContext oldContext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+		struct varlena *copy = heap_tuple_untoast_attr(input);
+		struct varlena *raw = (struct varlena *) palloc(rawSize);
+		memcpy(raw, input, rawSize);
+		MemoryContextSwitchTo(oldContext);
+		if (cache->copy != NULL) { pfree(cache->copy); }
+		if (cache->raw != NULL) { pfree(cache->raw); }
+		cache->copy = copy;
+		cache->raw = raw;
+		// detoasted values have a 4-byte header, parsed without a copy
+		cache->len = my_parse_array_no_copy(copy, typesize, &(cache->data));
+	}
+	*output = cache->data;
+	return cache->len;
+}
+
+/**
+ * an aggregate state of type internal, a float8 buffer living in the
+ * aggregate memory context for the whole scan
+ */
+struct AggBuffer {
+	int len;
+	double data[];
+};
+
+/**
+ * allocate a zeroed AggBuffer of len elements in the aggregate memory
+ * context of the calling transition function
+ *
+ * args:
+ *   fcinfo FunctionCallInfo, the calling UDF's call info
+ *   len int, number of elements
+ * return:
+ *   struct AggBuffer *, to be returned with PG_RETURN_POINTER
+ */
+inline struct AggBuffer *
+my_agg_buffer(FunctionCallInfo fcinfo, int len) {
+	MemoryContext aggContext = NULL;
+	struct AggBuffer *buffer;
+#if PG_VERSION_NUM >= 90000
+	if (!AggCheckCallContext(fcinfo, &aggContext)) {
+		elog(ERROR, "my_agg_buffer called in non-aggregate context");
+	}
+#else
+	elog(ERROR, "internal aggregate states need PostgreSQL 9.0 or later");
+#endif
+	buffer = (struct AggBuffer *) MemoryContextAllocZero(aggContext,
+			sizeof(struct AggBuffer) + len * sizeof(double));
+	buffer->len = len;
+	return buffer;
+}
+
 /**
  * construct Postgres array, not null elements assumed
  *
@@ -171,3 +819,38 @@ my_construct_array(int nelems, int typesize, Oid elemtype) {
 	*(int *) ARR_LBOUND(result) = 1;
 	return result;
 }
+
+/**
+ * construct Postgres float8 array holding a copy of x
+ *
+ * args:
+ *   x double *, elements
+ *   n int, number of elements
+ * return:
+ *   ArrayType *, resulting Postgres array
+ */
+inline ArrayType *
+my_float8_array(const double *x, int n) {
+	ArrayType *result = my_construct_array(n, sizeof(float8), FLOAT8OID);
+	memcpy(ARR_DATA_PTR(result), x, n * sizeof(float8));
+	return result;
+}
+
+#if ARRAY_TRACE_LEVEL >= 1
+/**
+ * arrays parsed by this backend so far,
+ * {short header, inline, compressed, toasted}, declared by hand, e.g.
+ *   CREATE FUNCTION array_parse_stats() RETURNS double precision[]
+ *   AS 'sparse-svm-shmem', 'array_parse_stats' LANGUAGE C STRICT;
+ */
+PG_FUNCTION_INFO_V1(array_parse_stats);
+Datum
+array_parse_stats(PG_FUNCTION_ARGS) {
+	double counts[4];
+	counts[0] = array_parse_counts.nShort;
+	counts[1] = array_parse_counts.nInline;
+	counts[2] = array_parse_counts.nCompressed;
+	counts[3] = array_parse_counts.nExternal;
+	PG_RETURN_ARRAYTYPE_P(my_float8_array(counts, 4));
+}
+#endif
@@ -160,6 +160,14 @@ RETURNS VOID
 AS 'crf-shmem', 'grad'
 LANGUAGE C STRICT;
 
+-- a gradient step that also returns the loss of the document against the
+-- model before the step
+DROP FUNCTION IF EXISTS crf_grad_loss(integer, integer[], integer[], integer[]) CASCADE;
+CREATE FUNCTION crf_grad_loss(integer, integer[], integer[], integer[])
+RETURNS double precision
+AS 'crf-shmem', 'grad_loss'
+LANGUAGE C STRICT;
+
 DROP FUNCTION IF EXISTS crf_loss(integer, integer[], integer[], integer[]) CASCADE;
 CREATE FUNCTION crf_loss(integer, integer[], integer[], integer[])
 RETURNS double precision
@@ -184,15 +192,51 @@ RETURNS VOID
 AS 'crf-shmem', 'pre'
 LANGUAGE C STRICT;
 
-DROP FUNCTION IF EXISTS crf_shmem_iteration(data_table text, model_id integer) CASCADE;
-CREATE FUNCTION crf_shmem_iteration(data_table text, model_id integer)
+-- lock contention so far: {acquisitions, spin iterations, wait ns}
+DROP FUNCTION IF EXISTS crf_shmem_lock_stats(integer) CASCADE;
+CREATE FUNCTION crf_shmem_lock_stats(integer)
+RETURNS double precision[]
+AS 'crf-shmem', 'lock_stats'
+LANGUAGE C STRICT;
+
+-- snapshot the model to a file, (model_id, path, epochs done), written
+-- by a thread of the backend while training goes on
+DROP FUNCTION IF EXISTS crf_shmem_checkpoint(integer, text, integer) CASCADE;
+CREATE FUNCTION crf_shmem_checkpoint(integer, text, integer)
+RETURNS VOID
+AS 'crf-shmem', 'checkpoint'
+LANGUAGE C STRICT;
+
+-- push the model again from a checkpoint file, returns the epochs done
+DROP FUNCTION IF EXISTS crf_shmem_restore(integer, text) CASCADE;
+CREATE FUNCTION crf_shmem_restore(integer, text)
+RETURNS integer
+AS 'crf-shmem', 'restore'
+LANGUAGE C STRICT;
+
+-- one epoch of hogwild steps by nthreads threads in this backend
+DROP FUNCTION IF EXISTS crf_shmem_train(integer, text, integer) CASCADE;
+CREATE FUNCTION crf_shmem_train(integer, text, integer)
+RETURNS bigint
+AS 'crf-shmem', 'train'
+LANGUAGE C STRICT;
+
+-- an epoch over data_table, in a random order of its blocks drawn from
+-- seed, or in the order of the table if seed is null
+DROP FUNCTION IF EXISTS crf_shmem_iteration(data_table text, model_id integer, seed integer) CASCADE;
+CREATE FUNCTION crf_shmem_iteration(data_table text, model_id integer, seed integer)
 RETURNS double precision AS $$
 DECLARE
 	loss double precision;
 BEGIN
 	-- grad
-	EXECUTE 'SELECT count(crf_grad(' || model_id || ', uobs, bobs, labels)) '
-			|| 'FROM ' || quote_ident(data_table);
+	IF seed IS NULL THEN
+		EXECUTE 'SELECT count(crf_grad(' || model_id || ', uobs, bobs, labels)) '
+				|| 'FROM ' || quote_ident(data_table);
+	ELSE
+		PERFORM shuffled_scan('count(crf_grad(' || model_id || ', uobs, bobs, labels))',
+				quote_ident(data_table), seed);
+	END IF;
 	-- update
 	PERFORM crf_shmem_step(model_id);
 	UPDATE crf_model SET stepsize = (
@@ -206,21 +250,140 @@ BEGIN
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
-DROP FUNCTION IF EXISTS crf_train_shmem(data_table text, model_id integer, iteration integer) CASCADE;
-CREATE FUNCTION crf_train_shmem(data_table text, model_id integer, iteration integer)
+DROP FUNCTION IF EXISTS crf_shmem_iteration(data_table text, model_id integer) CASCADE;
+CREATE FUNCTION crf_shmem_iteration(data_table text, model_id integer)
+RETURNS double precision AS $$
+	SELECT crf_shmem_iteration($1, $2, NULL);
+$$ LANGUAGE sql VOLATILE;
+
+-- an epoch as crf_shmem_iteration, but returning the loss of every document
+-- against the model before its step (progressive validation) summed in the
+-- same scan as the gradient, instead of a second scan for the loss after
+-- the epoch
+DROP FUNCTION IF EXISTS crf_shmem_fused_iteration(data_table text, model_id integer, seed integer) CASCADE;
+CREATE FUNCTION crf_shmem_fused_iteration(data_table text, model_id integer, seed integer)
+RETURNS double precision AS $$
+DECLARE
+	loss double precision;
+BEGIN
+	-- grad and loss
+	IF seed IS NULL THEN
+		EXECUTE 'SELECT sum(crf_grad_loss(' || model_id || ', uobs, bobs, labels)) '
+				|| 'FROM ' || quote_ident(data_table)
+			INTO loss;
+	ELSE
+		SELECT shuffled_scan('sum(crf_grad_loss(' || model_id || ', uobs, bobs, labels))',
+				quote_ident(data_table), seed) INTO loss;
+	END IF;
+	-- update
+	PERFORM crf_shmem_step(model_id);
+	UPDATE crf_model SET stepsize = (
+			SELECT stepsize * decay FROM crf_model WHERE mid = model_id)
+		WHERE mid = model_id;
+	RETURN loss;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+-- with is_shuffle, every epoch reads the table in a new random order of
+-- its blocks; with is_fused, the loss of an epoch comes from the same scan
+-- (crf_shmem_fused_iteration)
+DROP FUNCTION IF EXISTS crf_train_shmem(data_table text, model_id integer, iteration integer, is_shuffle boolean, is_fused boolean) CASCADE;
+CREATE FUNCTION crf_train_shmem(data_table text, model_id integer, iteration integer, is_shuffle boolean, is_fused boolean)
 RETURNS VOID AS $$
 DECLARE
 	loss double precision;
+	seed integer;
 BEGIN
 	PERFORM crf_shmem_push(crf_model.*) FROM crf_model WHERE mid = model_id;
 	FOR i IN 1..iteration LOOP
-		SELECT crf_shmem_iteration(data_table, model_id) INTO loss;
+		seed := CASE WHEN is_shuffle THEN (random() * 2147483647)::integer END;
+		IF is_fused THEN
+			SELECT crf_shmem_fused_iteration(data_table, model_id, seed) INTO loss;
+		ELSE
+			SELECT crf_shmem_iteration(data_table, model_id, seed) INTO loss;
+		END IF;
+		RAISE NOTICE '#iter: %, loss value: %', i, loss;
+	END LOOP;
+	UPDATE crf_model SET w = (SELECT crf_shmem_pop(model_id)) WHERE mid = model_id;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+DROP FUNCTION IF EXISTS crf_train_shmem(data_table text, model_id integer, iteration integer, is_shuffle boolean) CASCADE;
+CREATE FUNCTION crf_train_shmem(data_table text, model_id integer, iteration integer, is_shuffle boolean)
+RETURNS VOID AS $$
+	SELECT crf_train_shmem($1, $2, $3, $4, 'f');
+$$ LANGUAGE sql VOLATILE;
+
+DROP FUNCTION IF EXISTS crf_train_shmem(data_table text, model_id integer, iteration integer) CASCADE;
+CREATE FUNCTION crf_train_shmem(data_table text, model_id integer, iteration integer)
+RETURNS VOID AS $$
+	SELECT crf_train_shmem($1, $2, $3, 'f');
+$$ LANGUAGE sql VOLATILE;
+
+DROP FUNCTION IF EXISTS crf_threads_iteration(data_table text, model_id integer, nthreads integer) CASCADE;
+CREATE FUNCTION crf_threads_iteration(data_table text, model_id integer, nthreads integer)
+RETURNS double precision AS $$
+DECLARE
+	loss double precision;
+BEGIN
+	-- grad
+	PERFORM crf_shmem_train(model_id, quote_ident(data_table), nthreads);
+	-- update
+	PERFORM crf_shmem_step(model_id);
+	UPDATE crf_model SET stepsize = (
+			SELECT stepsize * decay FROM crf_model WHERE mid = model_id)
+		WHERE mid = model_id;
+	-- loss
+	EXECUTE 'SELECT sum(crf_loss(' || model_id || ', uobs, bobs, labels)) '
+			|| 'FROM ' || quote_ident(data_table)
+		INTO loss;
+	RETURN loss;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+-- with the model checkpointed to checkpoint_file every checkpoint_every epochs, or
+-- none if it is null; with resume, the model is restored from that file
+-- instead of pushed and training goes on after the epochs it had done
+DROP FUNCTION IF EXISTS crf_train_threads(data_table text, model_id integer, iteration integer, nthreads integer,
+	checkpoint_file text, checkpoint_every integer, resume boolean) CASCADE;
+CREATE FUNCTION crf_train_threads(data_table text, model_id integer, iteration integer, nthreads integer,
+	checkpoint_file text, checkpoint_every integer, resume boolean)
+RETURNS VOID AS $$
+DECLARE
+	loss double precision;
+	start_iter integer := 1;
+BEGIN
+	IF resume THEN
+		start_iter := crf_shmem_restore(model_id, checkpoint_file) + 1;
+		RAISE NOTICE 'Resumed from %, after % epochs', checkpoint_file, start_iter - 1;
+	ELSE
+		PERFORM crf_shmem_push(crf_model.*) FROM crf_model WHERE mid = model_id;
+	END IF;
+	FOR i IN start_iter..iteration LOOP
+		SELECT crf_threads_iteration(data_table, model_id, nthreads) INTO loss;
 		RAISE NOTICE '#iter: %, loss value: %', i, loss;
+		IF checkpoint_file IS NOT NULL AND checkpoint_every > 0 AND i % checkpoint_every = 0 THEN
+			PERFORM crf_shmem_checkpoint(model_id, checkpoint_file, i);
+		END IF;
 	END LOOP;
 	UPDATE crf_model SET w = (SELECT crf_shmem_pop(model_id)) WHERE mid = model_id;
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
+DROP FUNCTION IF EXISTS crf_train_threads(data_table text, model_id integer, iteration integer, nthreads integer) CASCADE;
+CREATE FUNCTION crf_train_threads(data_table text, model_id integer, iteration integer, nthreads integer)
+RETURNS VOID AS $$
+	SELECT crf_train_threads($1, $2, $3, $4, NULL, 0, 'f');
+$$ LANGUAGE sql VOLATILE;
+
+DROP FUNCTION IF EXISTS crf_resume_threads(data_table text, model_id integer, iteration integer, nthreads integer,
+	checkpoint_file text, checkpoint_every integer) CASCADE;
+CREATE FUNCTION crf_resume_threads(data_table text, model_id integer, iteration integer, nthreads integer,
+	checkpoint_file text, checkpoint_every integer)
+RETURNS VOID AS $$
+	SELECT crf_train_threads($1, $2, $3, $4, $5, $6, 't');
+$$ LANGUAGE sql VOLATILE;
+
 --------------------------------------------------------------------------
 -- wrappers
 --------------------------------------------------------------------------
@@ -253,7 +416,10 @@ BEGIN
 	INSERT INTO crf_model VALUES (model_id, nlabels, ntuples, ndims, nulines, nblines,
 	   	mu, stepsize, decay, initw); 
 	-- execute iterations
-	IF is_shuffle THEN
+	-- in shared memory the table is read in a new random order of its
+	-- blocks every epoch, the aggregate takes a shuffled copy of it, and
+	-- so does shared memory where block_rows does not work (Greenplum)
+	IF is_shuffle AND NOT (is_shmem AND block_rows_supported()) THEN
 		tmp_table := '__bismarck_shuffled_' || data_table || '_' || model_id;
 		EXECUTE 'DROP TABLE IF EXISTS ' || tmp_table || ' CASCADE';
 		EXECUTE 'CREATE TABLE ' || tmp_table || ' AS 
@@ -263,7 +429,8 @@ BEGIN
 		tmp_table := data_table;
 	END IF;
 	IF is_shmem THEN
-		PERFORM crf_train_shmem(tmp_table, model_id, iteration);
+		PERFORM crf_train_shmem(tmp_table, model_id, iteration,
+			is_shuffle AND block_rows_supported());
 	ELSE
 		PERFORM crf_train_agg(tmp_table, model_id, iteration);
 	END IF;
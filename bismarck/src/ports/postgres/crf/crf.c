@@ -18,6 +18,11 @@ limitations under the License.
 #include "utils/numeric.h"
 #include "modules/crf/crf_model.h"
 
+#ifndef VAGG
+#include <pthread.h>
+#include <signal.h>
+#endif
+
 /* the proof of postgresql version 1 C UDF */
 PG_FUNCTION_INFO_V1(init);
 PG_FUNCTION_INFO_V1(grad);
@@ -25,6 +30,33 @@ PG_FUNCTION_INFO_V1(pre);
 PG_FUNCTION_INFO_V1(final);
 PG_FUNCTION_INFO_V1(loss);
 PG_FUNCTION_INFO_V1(pred);
+#ifndef VAGG
+PG_FUNCTION_INFO_V1(grad_loss);
+PG_FUNCTION_INFO_V1(train);
+PG_FUNCTION_INFO_V1(lock_stats);
+PG_FUNCTION_INFO_V1(checkpoint);
+PG_FUNCTION_INFO_V1(restore);
+#endif
+
+#ifndef VAGG
+/**
+ * publish the regularization of a step on the local copy ptrModel to the
+ * shared model. under the model lock its wscale is ours; otherwise the
+ * decay of the step is multiplied in, as other backends do with theirs,
+ * and w is folded under the lock once wscale got too small
+ */
+static void
+publish_wscale(struct CRFModel *ptrSharedModel, const struct CRFModel *ptrModel) {
+#ifdef VLOCK
+	ptrSharedModel->wscale = ptrModel->wscale;
+#else
+	atomic_scale_double(&(ptrSharedModel->wscale), 1 - ptrModel->mu * ptrModel->stepsize);
+	if (ptrSharedModel->wscale < CRF_WSCALE_MIN) {
+		CRFModel_scale_shared(ptrSharedModel);
+	}
+#endif
+}
+#endif
 
 /**
  * init for a new model instance
@@ -92,13 +124,11 @@ init(PG_FUNCTION_ARGS) {
     //    using mid as key
     //--------------------------------------------------------------------
     struct CRFModel* ptrModel;
-    int size = sizeof(struct CRFModel) + sizeof(double) * (ndims) * 2;
-    // open the shared memory
-    int shmid = shmget(ftok("/", mid), size, SHM_R | SHM_W | IPC_CREAT);
-    if (shmid == -1) { elog(ERROR, "In init, shmget failed!\n"); }
-    // elog(WARNING, "init: after shmget\n");
+    size_t size = sizeof(struct CRFModel) + sizeof(double) * (ndims) * 2;
+    // open the shared memory, in huge pages if there are
+    create_model_shmem(mid, size);
     // attach the memory region
-    ptrModel = (struct CRFModel*) shmat(shmid, NULL, 0);
+    ptrModel = (struct CRFModel*) get_model_by_mid(mid);
     // elog(WARNING, "init: after shmat, model: %x\n", ptrModel);
 
     //--------------------------------------------------------------------
@@ -165,11 +195,7 @@ grad(PG_FUNCTION_ARGS) {
     // model
     struct CRFModel modelBuffer;
     struct CRFModel* ptrModel = &modelBuffer;
-    static struct CRFModel* ptrSharedModel = NULL;
-    if (ptrSharedModel == NULL || ptrSharedModel->mid != mid) {
-        ptrSharedModel = (struct CRFModel*)get_model_by_mid(mid);
-        // elog(WARNING, "grad: NO");
-    }
+    struct CRFModel* ptrSharedModel = (struct CRFModel*) get_model_by_mid(mid);
     modelBuffer = (*ptrSharedModel);
     modelBuffer.w = (double *)(&(ptrSharedModel->w) + 1);
 #endif
@@ -195,7 +221,9 @@ grad(PG_FUNCTION_ARGS) {
     // 3. performing the gradient 
     //--------------------------------------------------------------------
 #if !defined(VAGG) && defined(VLOCK)
-    while (compare_and_swap(&(ptrSharedModel->token), 0, 1) == 0) {}
+    spin_lock(&(ptrSharedModel->lock));
+    // it may have been changed since the copy, and is ours now
+    ptrModel->wscale = ptrSharedModel->wscale;
 #endif
 
     CRFModel_grad(ptrModel, &d);
@@ -205,12 +233,15 @@ grad(PG_FUNCTION_ARGS) {
 #ifdef VAGG
     wp[9] = ptrModel->wscale;
 #else
-	ptrSharedModel->wscale = ptrModel->wscale;
+    publish_wscale(ptrSharedModel, ptrModel);
 #endif
 
 #if !defined(VAGG) && defined(VLOCK)
-    ptrSharedModel->token = 0;
+    spin_unlock(&(ptrSharedModel->lock));
 #endif
+    if (CRFScratch_failed()) {
+        elog(ERROR, "In grad, out of memory for a document of %d tokens", len);
+    }
 
 #ifdef VAGG
     // return array for agg
@@ -337,12 +368,7 @@ final(PG_FUNCTION_ARGS) {
 			sizeof(float8), (char **)&w);
 	memcpy(w, &(ptrSharedModel->w) + 1, wLen * sizeof(float8));
     // delete the shared memory
-    int shmid = shmget(ftok("/", mid), 0, SHM_R | SHM_W);
-    if (shmid == -1) { elog(ERROR, "In final, shmget failed!\n"); }
-    struct shmid_ds shm_buf;
-    if (shmctl(shmid, IPC_RMID, &shm_buf) == -1) {
-        elog(ERROR, "shmctl failed in final()");
-    }
+    remove_model_shmem(mid);
 #endif
     PG_RETURN_ARRAYTYPE_P(warray);
 }
@@ -357,10 +383,9 @@ loss(PG_FUNCTION_ARGS) {
     // 1. init a local CRFModel structure 
     // and get the weight vector from temp state
     //--------------------------------------------------------------------
-    ArrayType *wparray = (ArrayType *) PG_GETARG_RAW_VARLENA_P(0);
     double *wp;
-    int wpLen = my_parse_array_no_copy((struct varlena*)wparray, 
-            sizeof(float8), (char **)&wp);
+    int wpLen = my_parse_array_cached(fcinfo, 0, 
+            sizeof(float8), (char **) &wp);
     struct CRFModel modelBuffer;
     struct CRFModel *ptrModel;
     // local copy
@@ -369,8 +394,6 @@ loss(PG_FUNCTION_ARGS) {
     CRFModel_init(ptrModel, (int) wp[0], (int) wp[1], (int) wp[2], (int) wp[3], 
             (int) wp[4], (int) wp[5], wp[6], wp[7], wp[8]);
     ptrModel->w = wp + META_LEN;
-    // count
-    wp[10] ++;
     // elog(WARNING, "grad: count: %lf, nDims %d", ptrModel->w[ptrModel->nDims], ptrModel->nDims);
 #else
     //--------------------------------------------------------------------
@@ -381,11 +404,7 @@ loss(PG_FUNCTION_ARGS) {
     // model
     struct CRFModel modelBuffer;
     struct CRFModel* ptrModel = &modelBuffer;
-    static struct CRFModel* ptrSharedModel = NULL;
-    if (ptrSharedModel == NULL || ptrSharedModel->mid != mid) {
-        ptrSharedModel = (struct CRFModel*)get_model_by_mid(mid);
-        // elog(WARNING, "loss: NO");
-    }
+    struct CRFModel* ptrSharedModel = (struct CRFModel*) get_model_by_mid(mid);
     modelBuffer = (*ptrSharedModel);
     modelBuffer.w = (double *)(&(ptrSharedModel->w) + 1);
 #endif
@@ -411,6 +430,9 @@ loss(PG_FUNCTION_ARGS) {
     // 3. loss computation
     //--------------------------------------------------------------------
     double loss = CRFModel_loss(ptrModel, &d);
+    if (CRFScratch_failed()) {
+        elog(ERROR, "In loss, out of memory for a document of %d tokens", len);
+    }
 
     PG_RETURN_FLOAT8(loss);
 }
@@ -425,10 +447,9 @@ pred(PG_FUNCTION_ARGS) {
     // 1. init a local CRFModel structure 
     // and get the weight vector from temp state
     //--------------------------------------------------------------------
-    ArrayType *wparray = (ArrayType *) PG_GETARG_RAW_VARLENA_P(0);
     double *wp;
-    int wpLen = my_parse_array_no_copy((struct varlena*)wparray, 
-            sizeof(float8), (char **)&wp);
+    int wpLen = my_parse_array_cached(fcinfo, 0, 
+            sizeof(float8), (char **) &wp);
     struct CRFModel modelBuffer;
     struct CRFModel *ptrModel;
     // local copy
@@ -437,8 +458,6 @@ pred(PG_FUNCTION_ARGS) {
     CRFModel_init(ptrModel, (int) wp[0], (int) wp[1], (int) wp[2], (int) wp[3], 
             (int) wp[4], (int) wp[5], wp[6], wp[7], wp[8]);
     ptrModel->w = wp + META_LEN;
-    // count
-    wp[10] ++;
     // elog(WARNING, "grad: count: %lf, nDims %d", ptrModel->w[ptrModel->nDims], ptrModel->nDims);
 #else
     //--------------------------------------------------------------------
@@ -449,11 +468,7 @@ pred(PG_FUNCTION_ARGS) {
     // model
     struct CRFModel modelBuffer;
     struct CRFModel* ptrModel = &modelBuffer;
-    static struct CRFModel* ptrSharedModel = NULL;
-    if (ptrSharedModel == NULL || ptrSharedModel->mid != mid) {
-        ptrSharedModel = (struct CRFModel*)get_model_by_mid(mid);
-        // elog(WARNING, "pred: NO");
-    }
+    struct CRFModel* ptrSharedModel = (struct CRFModel*) get_model_by_mid(mid);
     modelBuffer = (*ptrSharedModel);
     modelBuffer.w = (double *)(&(ptrSharedModel->w) + 1);
 #endif
@@ -479,6 +494,9 @@ pred(PG_FUNCTION_ARGS) {
     //--------------------------------------------------------------------
     int *labels = palloc(sizeof(int) * len);
 	CRFModel_pred(ptrModel, &d, labels);
+    if (CRFScratch_failed()) {
+        elog(ERROR, "In pred, out of memory for a document of %d tokens", len);
+    }
 	ArrayType *retarray = my_construct_array(len, sizeof(int32), INT4OID);
 	int *ret;
 	my_parse_array_no_copy((struct varlena *) retarray, 
@@ -488,3 +506,273 @@ pred(PG_FUNCTION_ARGS) {
     PG_RETURN_ARRAYTYPE_P(retarray);
 }
 
+#ifndef VAGG
+// documents fetched from the cursor at a time by train
+#define TRAIN_BATCH (10000)
+// documents a thread claims at a time
+#define TRAIN_CHUNK (16)
+// upper bound of the threads of one train call
+#define TRAIN_MAX_THREADS (256)
+
+/** a batch of documents and the next one to be claimed */
+struct TrainBatch {
+    struct CRFModel *ptrSharedModel;
+    const struct Example *docs;
+    int ndocs;
+    int next;
+    // documents skipped for want of scratch space
+    int nfailed;
+};
+
+/**
+ * one gradient step on the shared model, as grad does for a tuple,
+ * returns 1 if the document had to be skipped
+ */
+static int
+train_step(struct CRFModel *ptrSharedModel, const struct Example *d) {
+    struct CRFModel modelBuffer = (*ptrSharedModel);
+    modelBuffer.w = (double *)(&(ptrSharedModel->w) + 1);
+#ifdef VLOCK
+    spin_lock(&(ptrSharedModel->lock));
+    // it may have been changed since the copy, and is ours now
+    modelBuffer.wscale = ptrSharedModel->wscale;
+#endif
+    CRFModel_grad(&modelBuffer, d);
+    CRFModel_regularize(&modelBuffer);
+    publish_wscale(ptrSharedModel, &modelBuffer);
+#ifdef VLOCK
+    spin_unlock(&(ptrSharedModel->lock));
+#endif
+    return CRFScratch_failed();
+}
+
+/**
+ * claim chunks of the batch until it is done,
+ * must not call into the backend (no palloc, elog, ...)
+ */
+static void
+train_batch(struct TrainBatch *batch) {
+    int i, end;
+    while ((i = __atomic_fetch_add(&(batch->next), TRAIN_CHUNK, __ATOMIC_RELAXED))
+            < batch->ndocs) {
+        end = i + TRAIN_CHUNK < batch->ndocs ? i + TRAIN_CHUNK : batch->ndocs;
+        for (; i < end; i++) {
+            if (train_step(batch->ptrSharedModel, &(batch->docs[i]))) {
+                __atomic_fetch_add(&(batch->nfailed), 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+static void *
+train_thread(void *arg) {
+    train_batch((struct TrainBatch *) arg);
+    CRFScratch_release();
+    return NULL;
+}
+
+/**
+ * one epoch of hogwild gradient steps over a table, by a number of threads
+ * inside this backend against the shared model, so a single session can
+ * use all cores. the documents are fetched through SPI in batches of
+ * TRAIN_BATCH; the backend detoasts a batch and shuffles it, a window of
+ * the table in a new order every epoch, then it and nthreads - 1 threads
+ * run CRFModel_grad on it. the threads never call into the
+ * backend and have all signals blocked, they are joined before the next
+ * batch is fetched.
+ *
+ * args:
+ *   mid int, model id
+ *   relation text, the table (or a quoted name) with uobs, bobs, labels
+ *   nthreads int, threads including the backend
+ * return:
+ *   bigint, number of documents
+ */
+Datum
+train(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    char *relation = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    int nthreads = PG_GETARG_INT32(2);
+    struct CRFModel* ptrSharedModel = (struct CRFModel*) get_model_by_mid(mid);
+    pthread_t threads[TRAIN_MAX_THREADS];
+    int nstarted = 0;
+    int64 ndocs = 0;
+    uint64_t shuffleState = random();
+    int i, t;
+    if (nthreads < 1) { nthreads = 1; }
+    if (nthreads > TRAIN_MAX_THREADS) { nthreads = TRAIN_MAX_THREADS; }
+
+    //--------------------------------------------------------------------
+    // 1. open a cursor over the documents
+    //--------------------------------------------------------------------
+    int querySize = strlen(relation) + 64;
+    char *query = palloc(querySize);
+    snprintf(query, querySize, "SELECT uobs, bobs, labels FROM %s", relation);
+    if (SPI_connect() != SPI_OK_CONNECT) { elog(ERROR, "In train, SPI_connect failed!\n"); }
+    Portal portal = SPI_cursor_open_with_args(NULL, query, 0, NULL, NULL, NULL, true, 0);
+    // the detoasted arrays of one batch
+    MemoryContext batchContext = AllocSetContextCreate(CurrentMemoryContext,
+            "crf train batch", ALLOCSET_DEFAULT_MINSIZE, ALLOCSET_DEFAULT_INITSIZE,
+            ALLOCSET_DEFAULT_MAXSIZE);
+    struct Example *docs = palloc(sizeof(struct Example) * TRAIN_BATCH);
+
+    for (;;) {
+        //----------------------------------------------------------------
+        // 2. fetch a batch and parse (uObs, bObs, labels) of each row
+        //----------------------------------------------------------------
+        SPI_cursor_fetch(portal, true, TRAIN_BATCH);
+        if (SPI_processed == 0) { break; }
+        MemoryContext oldContext = MemoryContextSwitchTo(batchContext);
+        struct TrainBatch batch = {ptrSharedModel, docs, 0, 0, 0};
+        for (i = 0; i < (int) SPI_processed; i++) {
+            HeapTuple tuple = SPI_tuptable->vals[i];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+            bool isnull1, isnull2, isnull3;
+            Datum v1 = SPI_getbinval(tuple, tupdesc, 1, &isnull1);
+            Datum v2 = SPI_getbinval(tuple, tupdesc, 2, &isnull2);
+            Datum v3 = SPI_getbinval(tuple, tupdesc, 3, &isnull3);
+            // as for the strict grad, rows with nulls are skipped
+            if (isnull1 || isnull2 || isnull3) { continue; }
+            struct Example *d = &(docs[batch.ndocs ++]);
+            my_parse_array_no_copy((struct varlena *) DatumGetPointer(v1),
+                    sizeof(int32), (char **) &(d->uObs));
+            my_parse_array_no_copy((struct varlena *) DatumGetPointer(v2),
+                    sizeof(int32), (char **) &(d->bObs));
+            d->len = my_parse_array_no_copy((struct varlena *) DatumGetPointer(v3),
+                    sizeof(int32), (char **) &(d->labels));
+        }
+        MemoryContextSwitchTo(oldContext);
+        SHUFFLE(docs, batch.ndocs, struct Example, &shuffleState);
+
+        //----------------------------------------------------------------
+        // 3. hogwild over the batch, the threads start with all signals
+        //    blocked so that they are only ever delivered to the backend
+        //----------------------------------------------------------------
+        sigset_t allSignals, oldSignals;
+        sigfillset(&allSignals);
+        pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+        for (nstarted = 0, t = 1; t < nthreads; t++) {
+            if (pthread_create(&(threads[nstarted]), NULL, train_thread, &batch) == 0) {
+                nstarted ++;
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+        train_batch(&batch);
+        for (t = 0; t < nstarted; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        if (batch.nfailed > 0) {
+            elog(ERROR, "In train, out of memory for %d documents of a batch", batch.nfailed);
+        }
+        ndocs += batch.ndocs;
+
+        SPI_freetuptable(SPI_tuptable);
+        MemoryContextReset(batchContext);
+        CHECK_FOR_INTERRUPTS();
+    }
+    if (nstarted < nthreads - 1) {
+        elog(WARNING, "train: only %d of %d threads could be started", nstarted + 1, nthreads);
+    }
+
+    SPI_cursor_close(portal);
+    MemoryContextDelete(batchContext);
+    SPI_finish();
+    PG_RETURN_INT64(ndocs);
+}
+
+/**
+ * gradient function that also returns the loss of the document against
+ * the model before its step, so an epoch gets its (progressive) loss in
+ * the same scan
+ */
+Datum
+grad_loss(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    struct CRFModel modelBuffer;
+    struct CRFModel* ptrModel = &modelBuffer;
+    struct CRFModel* ptrSharedModel = (struct CRFModel*) get_model_by_mid(mid);
+    modelBuffer = (*ptrSharedModel);
+    modelBuffer.w = (double *)(&(ptrSharedModel->w) + 1);
+    // (uObs, bObs, labels)
+    int32 *uObs, *bObs, *labels;
+    my_parse_array_no_copy((struct varlena*) PG_GETARG_RAW_VARLENA_P(1),
+            sizeof(int32), (char **)&uObs);
+    my_parse_array_no_copy((struct varlena*) PG_GETARG_RAW_VARLENA_P(2),
+            sizeof(int32), (char **)&bObs);
+    int len = my_parse_array_no_copy((struct varlena*) PG_GETARG_RAW_VARLENA_P(3),
+            sizeof(int32), (char **)&labels);
+    struct Example d = {len, labels, uObs, bObs};
+
+#ifdef VLOCK
+    spin_lock(&(ptrSharedModel->lock));
+    // it may have been changed since the copy, and is ours now
+    ptrModel->wscale = ptrSharedModel->wscale;
+#endif
+
+    double loss = CRFModel_grad_loss(ptrModel, &d);
+    CRFModel_regularize(ptrModel);
+    publish_wscale(ptrSharedModel, ptrModel);
+
+#ifdef VLOCK
+    spin_unlock(&(ptrSharedModel->lock));
+#endif
+    if (CRFScratch_failed()) {
+        elog(ERROR, "In grad_loss, out of memory for a document of %d tokens", len);
+    }
+
+    PG_RETURN_FLOAT8(loss);
+}
+
+/**
+ * lock contention of the shared model so far,
+ * {acquisitions, spin iterations, wait ns}
+ */
+Datum
+lock_stats(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    struct CRFModel* ptrSharedModel = (struct CRFModel*) get_model_by_mid(mid);
+    struct LockStats stats = {0, 0, 0};
+    spin_lock_stats_add(&stats, &(ptrSharedModel->lock));
+
+    PG_RETURN_ARRAYTYPE_P(my_float8_array((double *) &stats, 3));
+}
+
+/**
+ * snapshot the shared model to a file, (mid, path, epochs done so far)
+ */
+Datum
+checkpoint(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    char *path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    int32 epoch = PG_GETARG_INT32(2);
+    struct CRFModel* ptrSharedModel = (struct CRFModel*) get_model_by_mid(mid);
+    checkpoint_model_shmem(mid, path, epoch, sizeof(struct CRFModel)
+            + sizeof(double) * (ptrSharedModel->nDims) * 2);
+
+    PG_RETURN_NULL();
+}
+
+/** size of a crf model region, for restore_model_shmem */
+static size_t
+checkpoint_size(const char *ptrModel) {
+    return sizeof(struct CRFModel)
+            + sizeof(double) * (((const struct CRFModel *) ptrModel)->nDims) * 2;
+}
+
+/**
+ * push the model of mid again from a checkpoint file, (mid, path);
+ * returns the epochs it had done
+ */
+Datum
+restore(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    char *path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    struct ModelCheckpoint head;
+    struct CRFModel* ptrModel = (struct CRFModel*) restore_model_shmem(mid, path, &head,
+            sizeof(struct CRFModel), checkpoint_size);
+    // the lock may have been held when it was taken
+    spin_lock_init(&(ptrModel->lock));
+
+    PG_RETURN_INT32(head.epoch);
+}
+#endif
@@ -44,6 +44,24 @@ CREATE AGGREGATE factor_agg(integer, integer, double precision, double precision
 	FINALFUNC = factor_final,
 	SFUNC = factor_transit);
 
+-- the fused aggregate: the same steps, its final function returns {sum of
+-- squared errors, w}, the errors of every rating against the state before
+-- its step summed in the same scan (progressive validation)
+DROP AGGREGATE IF EXISTS factor_fused_agg(integer, integer, double precision, double precision[]) CASCADE;
+DROP FUNCTION IF EXISTS factor_final_loss(double precision[]) CASCADE;
+
+CREATE FUNCTION factor_final_loss(double precision[])
+RETURNS double precision[]
+AS 'factor-agg', 'final_loss'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE AGGREGATE factor_fused_agg(integer, integer, double precision, double precision[]) (
+	INITCOND = '{0}',
+	STYPE = double precision[],
+	PREFUNC = factor_pre,
+	FINALFUNC = factor_final_loss,
+	SFUNC = factor_transit);
+
 DROP FUNCTION IF EXISTS factor_loss(double precision[], integer, integer, double precision) CASCADE;
 CREATE FUNCTION factor_loss(double precision[], integer, integer, double precision)
 RETURNS double precision
@@ -92,19 +110,58 @@ BEGIN
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
-DROP FUNCTION IF EXISTS factor_train_agg(data_table text, model_id integer, iteration integer) CASCADE;
-CREATE FUNCTION factor_train_agg(data_table text, model_id integer, iteration integer)
+-- an epoch as factor_agg_iteration, but the loss is that of every row
+-- against the model before its step (progressive validation), summed by
+-- the aggregate in the same scan instead of a second scan after it
+DROP FUNCTION IF EXISTS factor_agg_fused_iteration(data_table text, model_id integer) CASCADE;
+CREATE FUNCTION factor_agg_fused_iteration(data_table text, model_id integer)
+RETURNS double precision AS $$
+DECLARE
+	wl double precision[];
+	loss double precision;
+BEGIN
+	-- grad and loss
+	EXECUTE 'SELECT factor_fused_agg(row, col, rating, 
+						    (SELECT factor_serialize(factor_model.*) 
+							 FROM factor_model 
+							 WHERE mid = ' || model_id || ')) '
+			|| 'FROM ' || quote_ident(data_table)
+		INTO wl;
+	SELECT sqrt(wl[1] / ntuples) FROM factor_model WHERE mid = model_id INTO loss;
+	-- update
+	UPDATE factor_model SET w = wl[2:array_upper(wl, 1)] WHERE mid = model_id;
+	UPDATE factor_model SET stepsize = (
+			SELECT stepsize * decay FROM factor_model WHERE mid = model_id)
+		WHERE mid = model_id;
+	RETURN loss;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+-- with is_fused, the loss of an epoch comes from the same scan
+-- (factor_agg_fused_iteration)
+DROP FUNCTION IF EXISTS factor_train_agg(data_table text, model_id integer, iteration integer, is_fused boolean) CASCADE;
+CREATE FUNCTION factor_train_agg(data_table text, model_id integer, iteration integer, is_fused boolean)
 RETURNS VOID AS $$
 DECLARE
 	loss double precision;
 BEGIN
 	FOR i IN 1..iteration LOOP
-		SELECT factor_agg_iteration(data_table, model_id) INTO loss;
+		IF is_fused THEN
+			SELECT factor_agg_fused_iteration(data_table, model_id) INTO loss;
+		ELSE
+			SELECT factor_agg_iteration(data_table, model_id) INTO loss;
+		END IF;
 		RAISE NOTICE '#iter: %, RMSE: %', i, loss;
 	END LOOP;
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
+DROP FUNCTION IF EXISTS factor_train_agg(data_table text, model_id integer, iteration integer) CASCADE;
+CREATE FUNCTION factor_train_agg(data_table text, model_id integer, iteration integer)
+RETURNS VOID AS $$
+	SELECT factor_train_agg($1, $2, $3, 'f');
+$$ LANGUAGE sql VOLATILE;
+
 DROP FUNCTION IF EXISTS factor_eval(data_table text, model_id integer) CASCADE;
 CREATE FUNCTION factor_eval(data_table text, model_id integer)
 RETURNS double precision AS $$
@@ -131,6 +188,51 @@ RETURNS VOID
 AS 'factor-shmem', 'init'
 LANGUAGE C STRICT;
 
+-- with the vectors padded to cache lines (boolean) and the rows and cols
+-- placed in the orders of ids given, ids left out follow in id order
+DROP FUNCTION IF EXISTS factor_shmem_push(factor_model, boolean, integer[], integer[]) CASCADE;
+CREATE FUNCTION factor_shmem_push(factor_model, boolean, integer[], integer[])
+RETURNS VOID
+AS 'factor-shmem', 'init'
+LANGUAGE C STRICT;
+
+-- the ids of a column of the table, the most frequent first
+DROP FUNCTION IF EXISTS factor_frequency_order(data_table text, id_col text) CASCADE;
+CREATE FUNCTION factor_frequency_order(data_table text, id_col text)
+RETURNS integer[] AS $$
+DECLARE
+	ids integer[];
+BEGIN
+	EXECUTE 'SELECT ARRAY(SELECT ' || quote_ident(id_col) || ' FROM ' || quote_ident(data_table)
+			|| ' WHERE ' || quote_ident(id_col) || ' IS NOT NULL'
+			|| ' GROUP BY 1 ORDER BY count(*) DESC, 1)'
+		INTO ids;
+	RETURN ids;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+-- push a model in a layout: 'dense', 'padded' or 'frequency' (padded, and
+-- the rows and cols of data_table by frequency)
+DROP FUNCTION IF EXISTS factor_shmem_push_layout(data_table text, model_id integer, layout text) CASCADE;
+CREATE FUNCTION factor_shmem_push_layout(data_table text, model_id integer, layout text)
+RETURNS VOID AS $$
+BEGIN
+	IF layout = 'dense' THEN
+		PERFORM factor_shmem_push(factor_model.*) FROM factor_model WHERE mid = model_id;
+	ELSIF layout = 'padded' THEN
+		PERFORM factor_shmem_push(factor_model.*, true, '{}', '{}')
+			FROM factor_model WHERE mid = model_id;
+	ELSIF layout = 'frequency' THEN
+		PERFORM factor_shmem_push(factor_model.*, true,
+				factor_frequency_order(data_table, 'row'),
+				factor_frequency_order(data_table, 'col'))
+			FROM factor_model WHERE mid = model_id;
+	ELSE
+		RAISE EXCEPTION 'Unknown layout %, use dense, padded or frequency', layout;
+	END IF;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
 DROP FUNCTION IF EXISTS factor_init(integer) CASCADE;
 CREATE FUNCTION factor_init(model_id integer)
 RETURNS VOID AS $$
@@ -160,6 +262,14 @@ RETURNS VOID
 AS 'factor-shmem', 'grad'
 LANGUAGE C STRICT;
 
+-- a gradient step that also returns the loss of the rating against the
+-- model before the step
+DROP FUNCTION IF EXISTS factor_grad_loss(integer, integer, integer, double precision) CASCADE;
+CREATE FUNCTION factor_grad_loss(integer, integer, integer, double precision)
+RETURNS double precision
+AS 'factor-shmem', 'grad_loss'
+LANGUAGE C STRICT;
+
 DROP FUNCTION IF EXISTS factor_loss(integer, integer, integer, double precision) CASCADE;
 CREATE FUNCTION factor_loss(integer, integer, integer, double precision)
 RETURNS double precision
@@ -184,15 +294,51 @@ RETURNS VOID
 AS 'factor-shmem', 'pre'
 LANGUAGE C STRICT;
 
-DROP FUNCTION IF EXISTS factor_shmem_iteration(data_table text, model_id integer) CASCADE;
-CREATE FUNCTION factor_shmem_iteration(data_table text, model_id integer)
+-- lock contention so far: {acquisitions, spin iterations, wait ns}
+DROP FUNCTION IF EXISTS factor_shmem_lock_stats(integer) CASCADE;
+CREATE FUNCTION factor_shmem_lock_stats(integer)
+RETURNS double precision[]
+AS 'factor-shmem', 'lock_stats'
+LANGUAGE C STRICT;
+
+-- snapshot the model to a file, (model_id, path, epochs done), written
+-- by a thread of the backend while training goes on
+DROP FUNCTION IF EXISTS factor_shmem_checkpoint(integer, text, integer) CASCADE;
+CREATE FUNCTION factor_shmem_checkpoint(integer, text, integer)
+RETURNS VOID
+AS 'factor-shmem', 'checkpoint'
+LANGUAGE C STRICT;
+
+-- push the model again from a checkpoint file, returns the epochs done
+DROP FUNCTION IF EXISTS factor_shmem_restore(integer, text) CASCADE;
+CREATE FUNCTION factor_shmem_restore(integer, text)
+RETURNS integer
+AS 'factor-shmem', 'restore'
+LANGUAGE C STRICT;
+
+-- one epoch of stratified sgd by p workers in this backend
+DROP FUNCTION IF EXISTS factor_shmem_dsgd(integer, text, integer) CASCADE;
+CREATE FUNCTION factor_shmem_dsgd(integer, text, integer)
+RETURNS bigint
+AS 'factor-shmem', 'dsgd'
+LANGUAGE C STRICT;
+
+-- an epoch over data_table, in a random order of its blocks drawn from
+-- seed, or in the order of the table if seed is null
+DROP FUNCTION IF EXISTS factor_shmem_iteration(data_table text, model_id integer, seed integer) CASCADE;
+CREATE FUNCTION factor_shmem_iteration(data_table text, model_id integer, seed integer)
 RETURNS double precision AS $$
 DECLARE
 	loss double precision;
 BEGIN
 	-- grad
-	EXECUTE 'SELECT count(factor_grad(' || model_id || ', row, col, rating)) '
-			|| 'FROM ' || quote_ident(data_table);
+	IF seed IS NULL THEN
+		EXECUTE 'SELECT count(factor_grad(' || model_id || ', row, col, rating)) '
+				|| 'FROM ' || quote_ident(data_table);
+	ELSE
+		PERFORM shuffled_scan('count(factor_grad(' || model_id || ', row, col, rating))',
+				quote_ident(data_table), seed);
+	END IF;
 	-- update
 	PERFORM factor_shmem_step(model_id);
 	UPDATE factor_model SET stepsize = (
@@ -206,21 +352,154 @@ BEGIN
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
+DROP FUNCTION IF EXISTS factor_shmem_iteration(data_table text, model_id integer) CASCADE;
+CREATE FUNCTION factor_shmem_iteration(data_table text, model_id integer)
+RETURNS double precision AS $$
+	SELECT factor_shmem_iteration($1, $2, NULL);
+$$ LANGUAGE sql VOLATILE;
+
+-- an epoch as factor_shmem_iteration, but returning the loss of every rating
+-- against the model before its step (progressive validation) summed in the
+-- same scan as the gradient, instead of a second scan for the loss after
+-- the epoch
+DROP FUNCTION IF EXISTS factor_shmem_fused_iteration(data_table text, model_id integer, seed integer) CASCADE;
+CREATE FUNCTION factor_shmem_fused_iteration(data_table text, model_id integer, seed integer)
+RETURNS double precision AS $$
+DECLARE
+	loss double precision;
+BEGIN
+	-- grad and loss
+	IF seed IS NULL THEN
+		EXECUTE 'SELECT rmse(factor_grad_loss(' || model_id || ', row, col, rating)) '
+				|| 'FROM ' || quote_ident(data_table)
+			INTO loss;
+	ELSE
+		SELECT sqrt(shuffled_scan('sum(factor_grad_loss(' || model_id || ', row, col, rating))',
+				quote_ident(data_table), seed) / ntuples)
+			FROM factor_model WHERE mid = model_id
+			INTO loss;
+	END IF;
+	-- update
+	PERFORM factor_shmem_step(model_id);
+	UPDATE factor_model SET stepsize = (
+			SELECT stepsize * decay FROM factor_model WHERE mid = model_id)
+		WHERE mid = model_id;
+	RETURN loss;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+-- with is_shuffle, every epoch reads the table in a new random order of
+-- its blocks; with is_fused, the loss of an epoch comes from the same scan
+-- (factor_shmem_fused_iteration)
+DROP FUNCTION IF EXISTS factor_train_shmem(data_table text, model_id integer, iteration integer, layout text, is_shuffle boolean, is_fused boolean) CASCADE;
+CREATE FUNCTION factor_train_shmem(data_table text, model_id integer, iteration integer, layout text, is_shuffle boolean, is_fused boolean)
+RETURNS VOID AS $$
+DECLARE
+	loss double precision;
+	seed integer;
+BEGIN
+	PERFORM factor_shmem_push_layout(data_table, model_id, layout);
+	FOR i IN 1..iteration LOOP
+		seed := CASE WHEN is_shuffle THEN (random() * 2147483647)::integer END;
+		IF is_fused THEN
+			SELECT factor_shmem_fused_iteration(data_table, model_id, seed) INTO loss;
+		ELSE
+			SELECT factor_shmem_iteration(data_table, model_id, seed) INTO loss;
+		END IF;
+		RAISE NOTICE '#iter: %, RMSE: %', i, loss;
+	END LOOP;
+	UPDATE factor_model SET w = (SELECT factor_shmem_pop(model_id)) WHERE mid = model_id;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+DROP FUNCTION IF EXISTS factor_train_shmem(data_table text, model_id integer, iteration integer, layout text, is_shuffle boolean) CASCADE;
+CREATE FUNCTION factor_train_shmem(data_table text, model_id integer, iteration integer, layout text, is_shuffle boolean)
+RETURNS VOID AS $$
+	SELECT factor_train_shmem($1, $2, $3, $4, $5, 'f');
+$$ LANGUAGE sql VOLATILE;
+
+DROP FUNCTION IF EXISTS factor_train_shmem(data_table text, model_id integer, iteration integer, layout text) CASCADE;
+CREATE FUNCTION factor_train_shmem(data_table text, model_id integer, iteration integer, layout text)
+RETURNS VOID AS $$
+	SELECT factor_train_shmem($1, $2, $3, $4, 'f');
+$$ LANGUAGE sql VOLATILE;
+
 DROP FUNCTION IF EXISTS factor_train_shmem(data_table text, model_id integer, iteration integer) CASCADE;
 CREATE FUNCTION factor_train_shmem(data_table text, model_id integer, iteration integer)
 RETURNS VOID AS $$
+	SELECT factor_train_shmem($1, $2, $3, 'dense');
+$$ LANGUAGE sql VOLATILE;
+
+DROP FUNCTION IF EXISTS factor_dsgd_iteration(data_table text, model_id integer, nworkers integer) CASCADE;
+CREATE FUNCTION factor_dsgd_iteration(data_table text, model_id integer, nworkers integer)
+RETURNS double precision AS $$
 DECLARE
 	loss double precision;
 BEGIN
-	PERFORM factor_shmem_push(factor_model.*) FROM factor_model WHERE mid = model_id;
-	FOR i IN 1..iteration LOOP
-		SELECT factor_shmem_iteration(data_table, model_id) INTO loss;
+	-- grad
+	PERFORM factor_shmem_dsgd(model_id, quote_ident(data_table), nworkers);
+	-- update
+	PERFORM factor_shmem_step(model_id);
+	UPDATE factor_model SET stepsize = (
+			SELECT stepsize * decay FROM factor_model WHERE mid = model_id)
+		WHERE mid = model_id;
+	-- loss
+	EXECUTE 'SELECT rmse(factor_loss(' || model_id || ', row, col, rating)) '
+			|| 'FROM ' || quote_ident(data_table)
+		INTO loss;
+	RETURN loss;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+-- with the model checkpointed to checkpoint_file every checkpoint_every epochs, or
+-- none if it is null; with resume, the model is restored from that file
+-- instead of pushed and training goes on after the epochs it had done
+DROP FUNCTION IF EXISTS factor_train_dsgd(data_table text, model_id integer, iteration integer, nworkers integer, layout text,
+	checkpoint_file text, checkpoint_every integer, resume boolean) CASCADE;
+CREATE FUNCTION factor_train_dsgd(data_table text, model_id integer, iteration integer, nworkers integer, layout text,
+	checkpoint_file text, checkpoint_every integer, resume boolean)
+RETURNS VOID AS $$
+DECLARE
+	loss double precision;
+	start_iter integer := 1;
+BEGIN
+	IF resume THEN
+		start_iter := factor_shmem_restore(model_id, checkpoint_file) + 1;
+		RAISE NOTICE 'Resumed from %, after % epochs', checkpoint_file, start_iter - 1;
+	ELSE
+		PERFORM factor_shmem_push_layout(data_table, model_id, layout);
+	END IF;
+	FOR i IN start_iter..iteration LOOP
+		SELECT factor_dsgd_iteration(data_table, model_id, nworkers) INTO loss;
 		RAISE NOTICE '#iter: %, RMSE: %', i, loss;
+		IF checkpoint_file IS NOT NULL AND checkpoint_every > 0 AND i % checkpoint_every = 0 THEN
+			PERFORM factor_shmem_checkpoint(model_id, checkpoint_file, i);
+		END IF;
 	END LOOP;
 	UPDATE factor_model SET w = (SELECT factor_shmem_pop(model_id)) WHERE mid = model_id;
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
+DROP FUNCTION IF EXISTS factor_train_dsgd(data_table text, model_id integer, iteration integer, nworkers integer, layout text) CASCADE;
+CREATE FUNCTION factor_train_dsgd(data_table text, model_id integer, iteration integer, nworkers integer, layout text)
+RETURNS VOID AS $$
+	SELECT factor_train_dsgd($1, $2, $3, $4, $5, NULL, 0, 'f');
+$$ LANGUAGE sql VOLATILE;
+
+DROP FUNCTION IF EXISTS factor_resume_dsgd(data_table text, model_id integer, iteration integer, nworkers integer,
+	checkpoint_file text, checkpoint_every integer) CASCADE;
+CREATE FUNCTION factor_resume_dsgd(data_table text, model_id integer, iteration integer, nworkers integer,
+	checkpoint_file text, checkpoint_every integer)
+RETURNS VOID AS $$
+	SELECT factor_train_dsgd($1, $2, $3, $4, NULL, $5, $6, 't');
+$$ LANGUAGE sql VOLATILE;
+
+DROP FUNCTION IF EXISTS factor_train_dsgd(data_table text, model_id integer, iteration integer, nworkers integer) CASCADE;
+CREATE FUNCTION factor_train_dsgd(data_table text, model_id integer, iteration integer, nworkers integer)
+RETURNS VOID AS $$
+	SELECT factor_train_dsgd($1, $2, $3, $4, 'dense');
+$$ LANGUAGE sql VOLATILE;
+
 --------------------------------------------------------------------------
 -- wrappers
 --------------------------------------------------------------------------
@@ -264,7 +543,10 @@ BEGIN
 	INSERT INTO factor_model VALUES (model_id, nrows, ncols, maxrank, ndims, 
 		ntuples, b, stepsize, decay, initw); 
 	-- execute iterations
-	IF is_shuffle THEN
+	-- in shared memory the table is read in a new random order of its
+	-- blocks every epoch, the aggregate takes a shuffled copy of it, and
+	-- so does shared memory where block_rows does not work (Greenplum)
+	IF is_shuffle AND NOT (is_shmem AND block_rows_supported()) THEN
 		tmp_table := '__bismarck_shuffled_' || data_table || '_' || model_id;
 		EXECUTE 'DROP TABLE IF EXISTS ' || tmp_table || ' CASCADE';
 		EXECUTE 'CREATE TABLE ' || tmp_table || ' AS 
@@ -274,7 +556,8 @@ BEGIN
 		tmp_table := data_table;
 	END IF;
 	IF is_shmem THEN
-		PERFORM factor_train_shmem(tmp_table, model_id, iteration);
+		PERFORM factor_train_shmem(tmp_table, model_id, iteration, 'dense',
+			is_shuffle AND block_rows_supported());
 	ELSE
 		PERFORM factor_train_agg(tmp_table, model_id, iteration);
 	END IF;
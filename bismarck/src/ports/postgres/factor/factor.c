@@ -18,12 +18,27 @@ limitations under the License.
 #include "utils/numeric.h"
 #include "modules/factor/factor_model.h"
 
+#ifndef VAGG
+#include <pthread.h>
+#include <signal.h>
+#endif
+
 /* the proof of postgresql version 1 C UDF */
 PG_FUNCTION_INFO_V1(init);
 PG_FUNCTION_INFO_V1(grad);
 PG_FUNCTION_INFO_V1(pre);
 PG_FUNCTION_INFO_V1(final);
 PG_FUNCTION_INFO_V1(loss);
+#ifdef VAGG
+PG_FUNCTION_INFO_V1(final_loss);
+#endif
+#ifndef VAGG
+PG_FUNCTION_INFO_V1(grad_loss);
+PG_FUNCTION_INFO_V1(dsgd);
+PG_FUNCTION_INFO_V1(lock_stats);
+PG_FUNCTION_INFO_V1(checkpoint);
+PG_FUNCTION_INFO_V1(restore);
+#endif
 
 /**
  * init for a new model instance
@@ -77,6 +92,7 @@ init(PG_FUNCTION_ARGS) {
     wp[7] = stepsize;
     wp[8] = decay;
     wp[9] = 0; // count of tuple seen
+    wp[10] = 0; // squared errors of the epoch, for final_loss
 
     // -------------------------------------------------------------------
     // 3. copy weight vector into w+
@@ -88,16 +104,33 @@ init(PG_FUNCTION_ARGS) {
 #else
     //--------------------------------------------------------------------
     // 1. create a shared memory region for the FactorModel structure
-    //    using mid as key
+    //    using mid as key; with the optional args (padded boolean,
+    //    row_order integer[], col_order integer[]) the vectors are padded
+    //    to cache lines and placed in the given orders of ids
     //--------------------------------------------------------------------
     struct FactorModel* ptrModel;
-    int size = sizeof(struct FactorModel) + sizeof(double) * (ndims) * 2;
-    // open the shared memory
-    int shmid = shmget(ftok("/", mid), size, SHM_R | SHM_W | IPC_CREAT);
-    if (shmid == -1) { elog(ERROR, "In init, shmget failed!\n"); }
-    // elog(WARNING, "init: after shmget\n");
+    bool padded = false;
+    int32 *rowOrder = NULL, *colOrder = NULL;
+    int nRowOrder = 0, nColOrder = 0;
+    if (PG_NARGS() > 1) {
+        ArrayType *rowArray = PG_GETARG_ARRAYTYPE_P(2);
+        ArrayType *colArray = PG_GETARG_ARRAYTYPE_P(3);
+        if (ARR_HASNULL(rowArray) || ARR_HASNULL(colArray)) {
+            elog(ERROR, "In init, row and col orders must not contain nulls");
+        }
+        padded = PG_GETARG_BOOL(1);
+        rowOrder = (int32 *) ARR_DATA_PTR(rowArray);
+        colOrder = (int32 *) ARR_DATA_PTR(colArray);
+        nRowOrder = ArrayGetNItems(ARR_NDIM(rowArray), ARR_DIMS(rowArray));
+        nColOrder = ArrayGetNItems(ARR_NDIM(colArray), ARR_DIMS(colArray));
+    }
+    int reordered = nRowOrder > 0 || nColOrder > 0;
+    int stride = padded ? FactorModel_padded_stride(maxrank) : maxrank;
+    size_t size = FactorModel_size(nrows, ncols, stride, reordered);
+    // open the shared memory, in huge pages if there are
+    create_model_shmem(mid, size);
     // attach the memory region
-    ptrModel = (struct FactorModel*) shmat(shmid, NULL, 0);
+    ptrModel = (struct FactorModel*) get_model_by_mid(mid);
     // elog(WARNING, "init: after shmat, model: %x\n", ptrModel);
 
     //--------------------------------------------------------------------
@@ -106,12 +139,22 @@ init(PG_FUNCTION_ARGS) {
     // constructor
     FactorModel_init(ptrModel, mid, nrows, ncols, maxrank, ntuples, 
 			B, stepsize, decay);
+    ptrModel->stride = stride;
+    ptrModel->padded = padded;
+    ptrModel->reordered = reordered;
+    FactorModel_attach(ptrModel, ptrModel);
+    if (reordered) {
+        FactorModel_order_slots(ptrModel->rowSlot, nrows, rowOrder, nRowOrder);
+        FactorModel_order_slots(ptrModel->colSlot, ncols, colOrder, nColOrder);
+    }
 
     // -------------------------------------------------------------------
-    // 3. copy weight vector into shared memory
+    // 3. copy weight vector into shared memory, the padding is all zeros
     // -------------------------------------------------------------------
-    memcpy(ptrModel->L, w, sizeof(double) * wLen);
-	ptrModel->R = ptrModel->L + ptrModel->nRows * ptrModel->maxRank;
+    if (stride != maxrank) {
+        memset(ptrModel->L, 0, sizeof(weight_t) * (size_t) (nrows + ncols) * stride);
+    }
+    FactorModel_store(ptrModel, w);
 
     PG_RETURN_NULL();
 #endif
@@ -165,14 +208,8 @@ grad(PG_FUNCTION_ARGS) {
     // model
     struct FactorModel modelBuffer;
     struct FactorModel* ptrModel = &modelBuffer;
-    static struct FactorModel* ptrSharedModel = NULL;
-    if (ptrSharedModel == NULL || ptrSharedModel->mid != mid) {
-        ptrSharedModel = (struct FactorModel*)get_model_by_mid(mid);
-        // elog(WARNING, "grad: NO");
-    }
-	*ptrModel = (*ptrSharedModel);
-	ptrModel->L = (double *)(&(ptrSharedModel->L) + 1);
-	ptrModel->R = ptrModel->L + ptrModel->nRows * ptrModel->maxRank;
+    struct FactorModel* ptrSharedModel = (struct FactorModel*) get_model_by_mid(mid);
+	FactorModel_attach(ptrModel, ptrSharedModel);
 #endif
 
     //--------------------------------------------------------------------
@@ -188,13 +225,19 @@ grad(PG_FUNCTION_ARGS) {
     // 3. performing the gradient 
     //--------------------------------------------------------------------
 #if !defined(VAGG) && defined(VLOCK)
-	while (compare_and_swap(&(ptrSharedModel->token), 0, 1) == 0) {}
+	spin_lock(&(ptrSharedModel->lock));
 #endif
 
+#ifdef VAGG
+    // the error against the state before the step, for final_loss
+    double err = FactorModel_grad(ptrModel, i, j, rating);
+    wp[10] += err * err;
+#else
     FactorModel_grad(ptrModel, i, j, rating);
+#endif
 
 #if !defined(VAGG) && defined(VLOCK)
-	ptrSharedModel->token = 0;
+	spin_unlock(&(ptrSharedModel->lock));
 #endif
 
 #ifdef VAGG
@@ -247,6 +290,7 @@ pre(PG_FUNCTION_ARGS) {
         wp[i] = (count0 * 1.0 / count) * wp[i] + (count1 * 1.0 / count) * wp1[i];
     }
     wp[9] = count;
+    wp[10] += wp1[10];
 
     PG_RETURN_ARRAYTYPE_P(wparray);
 #else
@@ -302,8 +346,10 @@ final(PG_FUNCTION_ARGS) {
     //--------------------------------------------------------------------
     int32 mid = PG_GETARG_INT32(0);
     // model
+    struct FactorModel modelBuffer;
     struct FactorModel* ptrSharedModel = 
 		(struct FactorModel*) get_model_by_mid(mid);
+	FactorModel_attach(&modelBuffer, ptrSharedModel);
 
     //--------------------------------------------------------------------
     // 2. construct a PG array to return and delete the shared memory
@@ -312,18 +358,34 @@ final(PG_FUNCTION_ARGS) {
 	warray = my_construct_array(wLen, sizeof(float8), FLOAT8OID);
 	wLen = my_parse_array_no_copy((struct varlena *)warray, 
 			sizeof(float8), (char **)&w);
-	memcpy(w, &(ptrSharedModel->L) + 1, wLen * sizeof(float8));
+	FactorModel_load(&modelBuffer, w);
 	// delete the shared memory
-	int shmid = shmget(ftok("/", mid), 0, SHM_R | SHM_W);
-	if (shmid == -1) {	elog(ERROR, "In final, shmget failed!\n"); }
-	struct shmid_ds shm_buf;
-	if (shmctl(shmid, IPC_RMID, &shm_buf) == -1) {
-		elog(ERROR, "shmctl failed in final()");
-	}
+	remove_model_shmem(mid);
 #endif
     PG_RETURN_ARRAYTYPE_P(warray);
 }
 
+#ifdef VAGG
+/**
+ * final function of the fused aggregate, {squared errors, w}: the errors
+ * of every rating against the state before its step (progressive
+ * validation) summed in the gradient scan, so an epoch needs no second
+ * scan for the loss
+ */
+Datum
+final_loss(PG_FUNCTION_ARGS) {
+    double *wp;
+    int wpLen = my_parse_array_no_copy(PG_GETARG_RAW_VARLENA_P(0), 
+            sizeof(float8), (char **) &wp);
+    double *w;
+	ArrayType *warray = my_construct_array(wpLen - META_LEN + 1, sizeof(float8), FLOAT8OID);
+	my_parse_array_no_copy((struct varlena *)warray, sizeof(float8), (char **)&w);
+    w[0] = wp[10];
+	memcpy(w + 1, wp + META_LEN, (wpLen - META_LEN) * sizeof(float8));
+    PG_RETURN_ARRAYTYPE_P(warray);
+}
+#endif
+
 /**
  * loss function
  */
@@ -334,9 +396,8 @@ loss(PG_FUNCTION_ARGS) {
     // 1. init a local FactorModel structure 
     // and get the weight vector from temp state
     //--------------------------------------------------------------------
-    ArrayType *wparray = (ArrayType *) PG_GETARG_RAW_VARLENA_P(0);
     double *wp;
-    int wpLen = my_parse_array_no_copy((struct varlena*) wparray, 
+    int wpLen = my_parse_array_cached(fcinfo, 0, 
             sizeof(float8), (char **) &wp);
     struct FactorModel modelBuffer;
     struct FactorModel *ptrModel;
@@ -347,8 +408,6 @@ loss(PG_FUNCTION_ARGS) {
             wp[6], wp[7], wp[8]);
     ptrModel->L = wp + META_LEN;
 	ptrModel->R = ptrModel->L + ptrModel->nRows * ptrModel->maxRank;
-    // count
-    wp[9] ++;
     // elog(WARNING, "grad: count: %lf, nDims %d", ptrModel->w[ptrModel->nDims], ptrModel->nDims);
 #else
     //--------------------------------------------------------------------
@@ -359,14 +418,8 @@ loss(PG_FUNCTION_ARGS) {
     // model
     struct FactorModel modelBuffer;
     struct FactorModel* ptrModel = &modelBuffer;
-    static struct FactorModel* ptrSharedModel = NULL;
-    if (ptrSharedModel == NULL || ptrSharedModel->mid != mid) {
-        ptrSharedModel = (struct FactorModel*)get_model_by_mid(mid);
-        // elog(WARNING, "grad: NO");
-    }
-	*ptrModel = (*ptrSharedModel);
-	ptrModel->L = (double *)(&(ptrSharedModel->L) + 1);
-	ptrModel->R = ptrModel->L + ptrModel->nRows * ptrModel->maxRank;
+    struct FactorModel* ptrSharedModel = (struct FactorModel*) get_model_by_mid(mid);
+	FactorModel_attach(ptrModel, ptrSharedModel);
 #endif
 
     //--------------------------------------------------------------------
@@ -396,9 +449,8 @@ pred(PG_FUNCTION_ARGS) {
     // 1. init a local FactorModel structure 
     // and get the weight vector from temp state
     //--------------------------------------------------------------------
-    ArrayType *wparray = (ArrayType *) PG_GETARG_RAW_VARLENA_P(0);
     double *wp;
-    int wpLen = my_parse_array_no_copy((struct varlena*) wparray, 
+    int wpLen = my_parse_array_cached(fcinfo, 0, 
             sizeof(float8), (char **) &wp);
     struct FactorModel modelBuffer;
     struct FactorModel *ptrModel;
@@ -409,8 +461,6 @@ pred(PG_FUNCTION_ARGS) {
             wp[6], wp[7], wp[8]);
     ptrModel->L = wp + META_LEN;
 	ptrModel->R = ptrModel->L + ptrModel->nRows * ptrModel->maxRank;
-    // count
-    wp[9] ++;
     // elog(WARNING, "grad: count: %lf, nDims %d", ptrModel->w[ptrModel->nDims], ptrModel->nDims);
 #else
     //--------------------------------------------------------------------
@@ -421,14 +471,8 @@ pred(PG_FUNCTION_ARGS) {
     // model
     struct FactorModel modelBuffer;
     struct FactorModel* ptrModel = &modelBuffer;
-    static struct FactorModel* ptrSharedModel = NULL;
-    if (ptrSharedModel == NULL || ptrSharedModel->mid != mid) {
-        ptrSharedModel = (struct FactorModel*)get_model_by_mid(mid);
-        // elog(WARNING, "grad: NO");
-    }
-	*ptrModel = (*ptrSharedModel);
-	ptrModel->L = (double *)(&(ptrSharedModel->L) + 1);
-	ptrModel->R = ptrModel->L + ptrModel->nRows * ptrModel->maxRank;
+    struct FactorModel* ptrSharedModel = (struct FactorModel*) get_model_by_mid(mid);
+	FactorModel_attach(ptrModel, ptrSharedModel);
 #endif
 
     //--------------------------------------------------------------------
@@ -447,3 +491,295 @@ pred(PG_FUNCTION_ARGS) {
     PG_RETURN_FLOAT8(pred);
 }
 
+#ifndef VAGG
+// ratings fetched from the cursor at a time by dsgd
+#define DSGD_FETCH (100000)
+// upper bound of the workers of one dsgd call
+#define DSGD_MAX_WORKERS (256)
+
+// more than 1GB of ratings needs the huge allocations of 9.4
+#if PG_VERSION_NUM >= 90400
+#define dsgd_alloc(size) MemoryContextAllocHuge(CurrentMemoryContext, (size))
+#define dsgd_realloc(ptr, size) repalloc_huge((ptr), (size))
+#else
+#define dsgd_alloc(size) palloc(size)
+#define dsgd_realloc(ptr, size) repalloc((ptr), (size))
+#endif
+
+/** a rating, row and col counted from 0 */
+struct Rating {
+    int32 i;
+    int32 j;
+    double rating;
+};
+
+/** the ratings of one block of the grid */
+struct DsgdBlock {
+    struct FactorModel *ptrModel;
+    const struct Rating *ratings;
+    int64 n;
+};
+
+/**
+ * gradient steps over one block, no lock is needed as no other worker
+ * touches its rows and columns; must not call into the backend
+ */
+static void
+dsgd_block(struct DsgdBlock *block) {
+    int64 k;
+    for (k = 0; k < block->n; k++) {
+        const struct Rating *r = &(block->ratings[k]);
+        FactorModel_grad(block->ptrModel, r->i, r->j, r->rating);
+    }
+}
+
+static void *
+dsgd_thread(void *arg) {
+    dsgd_block((struct DsgdBlock *) arg);
+    return NULL;
+}
+
+/**
+ * one epoch of stratified (DSGD) gradient steps over a table, by p workers
+ * inside this backend against the shared model.
+ *
+ * rows and cols are cut into p ranges each, which splits the ratings into
+ * a p x p grid of blocks. an epoch is p sub-epochs; in each one worker k
+ * runs block (k, (k + shift) % p), so no two workers share a row of L or
+ * a column of R and none of them takes a lock. the shifts are visited in
+ * a random order every epoch, and the ratings of each block are shuffled
+ * every epoch, so the order of the table does not matter. the backend
+ * reads all ratings through SPI first, then it and p - 1 threads (with
+ * all signals blocked, never calling into the backend) run each
+ * sub-epoch and are joined before the next.
+ *
+ * args:
+ *   mid int, model id
+ *   relation text, the table (or a quoted name) with row, col, rating
+ *   p int, workers including the backend
+ * return:
+ *   bigint, number of ratings
+ */
+Datum
+dsgd(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    char *relation = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    int p = PG_GETARG_INT32(2);
+    struct FactorModel modelBuffer;
+    struct FactorModel* ptrModel = &modelBuffer;
+    struct FactorModel* ptrSharedModel = (struct FactorModel*) get_model_by_mid(mid);
+	FactorModel_attach(ptrModel, ptrSharedModel);
+    if (p > DSGD_MAX_WORKERS) { p = DSGD_MAX_WORKERS; }
+    if (p > ptrModel->nRows) { p = ptrModel->nRows; }
+    if (p > ptrModel->nCols) { p = ptrModel->nCols; }
+    if (p < 1) { p = 1; }
+
+    //--------------------------------------------------------------------
+    // 1. read (row, col, rating) of every tuple
+    //--------------------------------------------------------------------
+    int querySize = strlen(relation) + 64;
+    char *query = palloc(querySize);
+    snprintf(query, querySize, "SELECT row, col, rating FROM %s", relation);
+    if (SPI_connect() != SPI_OK_CONNECT) { elog(ERROR, "In dsgd, SPI_connect failed!\n"); }
+    Portal portal = SPI_cursor_open_with_args(NULL, query, 0, NULL, NULL, NULL, true, 0);
+    int64 n = 0, cap = DSGD_FETCH, nskipped = 0;
+    struct Rating *ratings = dsgd_alloc(sizeof(struct Rating) * cap);
+    int64 k;
+    for (;;) {
+        SPI_cursor_fetch(portal, true, DSGD_FETCH);
+        if (SPI_processed == 0) { break; }
+        if (n + (int64) SPI_processed > cap) {
+            while (n + (int64) SPI_processed > cap) { cap *= 2; }
+            ratings = dsgd_realloc(ratings, sizeof(struct Rating) * cap);
+        }
+        for (k = 0; k < (int64) SPI_processed; k++) {
+            HeapTuple tuple = SPI_tuptable->vals[k];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+            bool isnull1, isnull2, isnull3;
+            int32 row = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isnull1));
+            int32 col = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 2, &isnull2));
+            float8 rating = DatumGetFloat8(SPI_getbinval(tuple, tupdesc, 3, &isnull3));
+            // as for the strict grad, rows with nulls are skipped,
+            // and so are cells outside the model
+            if (isnull1 || isnull2 || isnull3
+                    || row < 1 || row > ptrModel->nRows || col < 1 || col > ptrModel->nCols) {
+                nskipped ++;
+                continue;
+            }
+            ratings[n].i = row - 1;
+            ratings[n].j = col - 1;
+            ratings[n].rating = rating;
+            n ++;
+        }
+        SPI_freetuptable(SPI_tuptable);
+        CHECK_FOR_INTERRUPTS();
+    }
+    SPI_cursor_close(portal);
+    if (nskipped > 0) {
+        elog(WARNING, "dsgd: %ld tuples with nulls or outside the model skipped", (long) nskipped);
+    }
+
+    //--------------------------------------------------------------------
+    // 2. counting sort into the p x p blocks, stable
+    //--------------------------------------------------------------------
+    int64 *start = palloc0(sizeof(int64) * (p * p + 1));
+    struct Rating *sorted = dsgd_alloc(sizeof(struct Rating) * (n > 0 ? n : 1));
+    int b, s, t;
+#define DSGD_BLOCK(r) ((int) ((int64) (r).i * p / ptrModel->nRows) * p \
+        + (int) ((int64) (r).j * p / ptrModel->nCols))
+    for (k = 0; k < n; k++) { start[DSGD_BLOCK(ratings[k]) + 1] ++; }
+    for (b = 0; b < p * p; b++) { start[b + 1] += start[b]; }
+    int64 *fill = palloc(sizeof(int64) * p * p);
+    memcpy(fill, start, sizeof(int64) * p * p);
+    for (k = 0; k < n; k++) { sorted[fill[DSGD_BLOCK(ratings[k])] ++] = ratings[k]; }
+#undef DSGD_BLOCK
+    pfree(ratings);
+    // the blocks are cut by ids, then a reordered layout is looked up
+    // once here instead of on every step
+    if (ptrModel->reordered) {
+        for (k = 0; k < n; k++) {
+            sorted[k].i = ptrModel->rowSlot[sorted[k].i];
+            sorted[k].j = ptrModel->colSlot[sorted[k].j];
+        }
+        ptrModel->rowSlot = NULL;
+        ptrModel->colSlot = NULL;
+    }
+
+    // a new order within each block
+    uint64_t shuffleState = random();
+    for (b = 0; b < p * p; b++) {
+        SHUFFLE(sorted + start[b], start[b + 1] - start[b], struct Rating, &shuffleState);
+    }
+
+    //--------------------------------------------------------------------
+    // 3. the p sub-epochs, the shifts in random order
+    //--------------------------------------------------------------------
+    int *shifts = palloc(sizeof(int) * p);
+    for (s = 0; s < p; s++) { shifts[s] = s; }
+    for (s = p - 1; s > 0; s--) {
+        int other = random() % (s + 1);
+        int swap = shifts[s];
+        shifts[s] = shifts[other];
+        shifts[other] = swap;
+    }
+    struct DsgdBlock *blocks = palloc(sizeof(struct DsgdBlock) * p);
+    pthread_t threads[DSGD_MAX_WORKERS];
+    int nfallback = 0;
+    for (s = 0; s < p; s++) {
+        for (t = 0; t < p; t++) {
+            b = t * p + (t + shifts[s]) % p;
+            blocks[t].ptrModel = ptrModel;
+            blocks[t].ratings = sorted + start[b];
+            blocks[t].n = start[b + 1] - start[b];
+        }
+        // threads start with all signals blocked, they go to the backend
+        sigset_t allSignals, oldSignals;
+        sigfillset(&allSignals);
+        pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+        int started[DSGD_MAX_WORKERS];
+        for (t = 1; t < p; t++) {
+            started[t] = pthread_create(&(threads[t]), NULL, dsgd_thread, &(blocks[t])) == 0;
+        }
+        pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+        dsgd_block(&(blocks[0]));
+        for (t = 1; t < p; t++) {
+            if (started[t]) {
+                pthread_join(threads[t], NULL);
+            } else {
+                // the blocks are disjoint, so running it late is just as good
+                dsgd_block(&(blocks[t]));
+                nfallback ++;
+            }
+        }
+        CHECK_FOR_INTERRUPTS();
+    }
+    if (nfallback > 0) {
+        elog(WARNING, "dsgd: %d blocks ran in the backend, threads could not be started", nfallback);
+    }
+
+    SPI_finish();
+    PG_RETURN_INT64(n);
+}
+
+/**
+ * gradient function that also returns the loss of the rating against the
+ * model before its step, as loss does, so an epoch gets its (progressive)
+ * loss in the same scan
+ */
+Datum
+grad_loss(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    struct FactorModel modelBuffer;
+    struct FactorModel* ptrModel = &modelBuffer;
+    struct FactorModel* ptrSharedModel = (struct FactorModel*) get_model_by_mid(mid);
+	FactorModel_attach(ptrModel, ptrSharedModel);
+    int32 row = PG_GETARG_INT32(1);
+    int32 col = PG_GETARG_INT32(2);
+    float8 rating = PG_GETARG_FLOAT8(3);
+
+#ifdef VLOCK
+	spin_lock(&(ptrSharedModel->lock));
+#endif
+
+    double err = FactorModel_grad(ptrModel, row - 1, col - 1, rating);
+
+#ifdef VLOCK
+	spin_unlock(&(ptrSharedModel->lock));
+#endif
+
+    PG_RETURN_FLOAT8(err*err);
+}
+
+/**
+ * lock contention of the shared model so far,
+ * {acquisitions, spin iterations, wait ns}
+ */
+Datum
+lock_stats(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    struct FactorModel* ptrSharedModel = (struct FactorModel*) get_model_by_mid(mid);
+    struct LockStats stats = {0, 0, 0};
+    spin_lock_stats_add(&stats, &(ptrSharedModel->lock));
+
+    PG_RETURN_ARRAYTYPE_P(my_float8_array((double *) &stats, 3));
+}
+
+/**
+ * snapshot the shared model to a file, (mid, path, epochs done so far)
+ */
+Datum
+checkpoint(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    char *path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    int32 epoch = PG_GETARG_INT32(2);
+    struct FactorModel* ptrSharedModel = (struct FactorModel*) get_model_by_mid(mid);
+    checkpoint_model_shmem(mid, path, epoch, FactorModel_size(ptrSharedModel->nRows,
+            ptrSharedModel->nCols, ptrSharedModel->stride, ptrSharedModel->reordered));
+
+    PG_RETURN_NULL();
+}
+
+/** size of a factor model region, for restore_model_shmem */
+static size_t
+checkpoint_size(const char *ptrModel) {
+    const struct FactorModel *m = (const struct FactorModel *) ptrModel;
+    return FactorModel_size(m->nRows, m->nCols, m->stride, m->reordered);
+}
+
+/**
+ * push the model of mid again from a checkpoint file, (mid, path), in
+ * the layout it had; returns the epochs it had done
+ */
+Datum
+restore(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    char *path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    struct ModelCheckpoint head;
+    struct FactorModel* ptrModel = (struct FactorModel*) restore_model_shmem(mid, path, &head,
+            sizeof(struct FactorModel), checkpoint_size);
+    // the lock may have been held when it was taken
+    spin_lock_init(&(ptrModel->lock));
+
+    PG_RETURN_INT32(head.epoch);
+}
+#endif
@@ -24,7 +24,10 @@ CREATE TABLE linear_model (
 	stepsize		double precision,
 	decay			double precision,
 	w				double precision [],
-	temp_v			double precision [])
+	temp_v			double precision [],
+	batchsize		integer DEFAULT 1,
+	l2				double precision DEFAULT 0,
+	wscale			double precision DEFAULT 1)
 --DISTRIBUTED BY (mid);
 ;
 
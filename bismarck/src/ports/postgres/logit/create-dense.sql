@@ -44,6 +44,30 @@ CREATE AGGREGATE dense_logit_agg(double precision[], integer, double precision[]
 	FINALFUNC = dense_logit_final,
 	SFUNC = dense_logit_transit);
 
+-- the fused aggregate: the same steps, that also sum the loss of every row
+-- against the state before its step (progressive validation); its final
+-- function returns {loss, w}
+DROP AGGREGATE IF EXISTS dense_logit_fused_agg(double precision[], integer, double precision[]) CASCADE;
+DROP FUNCTION IF EXISTS dense_logit_transit_loss(double precision[], double precision[], integer, double precision[]) CASCADE;
+DROP FUNCTION IF EXISTS dense_logit_final_loss(double precision[]) CASCADE;
+
+CREATE FUNCTION dense_logit_transit_loss(double precision[], double precision[], integer, double precision[])
+RETURNS double precision[]
+AS 'dense-logit-agg', 'grad_loss'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION dense_logit_final_loss(double precision[])
+RETURNS double precision[]
+AS 'dense-logit-agg', 'final_loss'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE AGGREGATE dense_logit_fused_agg(double precision[], integer, double precision[]) (
+	INITCOND = '{0}',
+	STYPE = double precision[],
+	PREFUNC = dense_logit_pre,
+	FINALFUNC = dense_logit_final_loss,
+	SFUNC = dense_logit_transit_loss);
+
 DROP FUNCTION IF EXISTS dense_logit_loss(double precision[], double precision[], integer) CASCADE;
 CREATE FUNCTION dense_logit_loss(double precision[], double precision[], integer)
 RETURNS double precision
@@ -92,19 +116,58 @@ BEGIN
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
-DROP FUNCTION IF EXISTS dense_logit_train_agg(data_table text, model_id integer, iteration integer) CASCADE;
-CREATE FUNCTION dense_logit_train_agg(data_table text, model_id integer, iteration integer)
+-- an epoch as dense_logit_agg_iteration, but the loss is that of every row
+-- against the model before its step (progressive validation), summed by
+-- the aggregate in the same scan instead of a second scan after it
+DROP FUNCTION IF EXISTS dense_logit_agg_fused_iteration(data_table text, model_id integer) CASCADE;
+CREATE FUNCTION dense_logit_agg_fused_iteration(data_table text, model_id integer)
+RETURNS double precision AS $$
+DECLARE
+	wl double precision[];
+	loss double precision;
+BEGIN
+	-- grad and loss
+	EXECUTE 'SELECT dense_logit_fused_agg(vec, labeli, 
+						    (SELECT dense_logit_serialize(linear_model.*) 
+							 FROM linear_model 
+							 WHERE mid = ' || model_id || ')) '
+			|| 'FROM ' || quote_ident(data_table)
+		INTO wl;
+	loss := wl[1];
+	-- update
+	UPDATE linear_model SET w = wl[2:array_upper(wl, 1)] WHERE mid = model_id;
+	UPDATE linear_model SET stepsize = (
+			SELECT stepsize * decay FROM linear_model WHERE mid = model_id)
+		WHERE mid = model_id;
+	RETURN loss;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+-- with is_fused, the loss of an epoch comes from the same scan
+-- (dense_logit_agg_fused_iteration)
+DROP FUNCTION IF EXISTS dense_logit_train_agg(data_table text, model_id integer, iteration integer, is_fused boolean) CASCADE;
+CREATE FUNCTION dense_logit_train_agg(data_table text, model_id integer, iteration integer, is_fused boolean)
 RETURNS VOID AS $$
 DECLARE
 	loss double precision;
 BEGIN
 	FOR i IN 1..iteration LOOP
-		SELECT dense_logit_agg_iteration(data_table, model_id) INTO loss;
+		IF is_fused THEN
+			SELECT dense_logit_agg_fused_iteration(data_table, model_id) INTO loss;
+		ELSE
+			SELECT dense_logit_agg_iteration(data_table, model_id) INTO loss;
+		END IF;
 		RAISE NOTICE '#iter: %, loss value: %', i, loss;
 	END LOOP;
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
+DROP FUNCTION IF EXISTS dense_logit_train_agg(data_table text, model_id integer, iteration integer) CASCADE;
+CREATE FUNCTION dense_logit_train_agg(data_table text, model_id integer, iteration integer)
+RETURNS VOID AS $$
+	SELECT dense_logit_train_agg($1, $2, $3, 'f');
+$$ LANGUAGE sql VOLATILE;
+
 DROP FUNCTION IF EXISTS dense_logit_eval(data_table text, model_id integer) CASCADE;
 CREATE FUNCTION dense_logit_eval(data_table text, model_id integer)
 RETURNS double precision AS $$
@@ -160,6 +223,14 @@ RETURNS VOID
 AS 'dense-logit-shmem', 'grad'
 LANGUAGE C STRICT;
 
+-- a gradient step that also returns the loss of the row against the
+-- model before the step
+DROP FUNCTION IF EXISTS dense_logit_grad_loss(integer, double precision[], integer) CASCADE;
+CREATE FUNCTION dense_logit_grad_loss(integer, double precision[], integer)
+RETURNS double precision
+AS 'dense-logit-shmem', 'grad_loss'
+LANGUAGE C STRICT;
+
 DROP FUNCTION IF EXISTS dense_logit_loss(integer, double precision[], integer) CASCADE;
 CREATE FUNCTION dense_logit_loss(integer, double precision[], integer)
 RETURNS double precision
@@ -184,15 +255,44 @@ RETURNS VOID
 AS 'dense-logit-shmem', 'pre'
 LANGUAGE C STRICT;
 
-DROP FUNCTION IF EXISTS dense_logit_shmem_iteration(data_table text, model_id integer) CASCADE;
-CREATE FUNCTION dense_logit_shmem_iteration(data_table text, model_id integer)
+-- lock contention so far: {acquisitions, spin iterations, wait ns}
+DROP FUNCTION IF EXISTS dense_logit_shmem_lock_stats(integer) CASCADE;
+CREATE FUNCTION dense_logit_shmem_lock_stats(integer)
+RETURNS double precision[]
+AS 'dense-logit-shmem', 'lock_stats'
+LANGUAGE C STRICT;
+
+-- snapshot the model to a file, (model_id, path, epochs done), written
+-- by a thread of the backend while training goes on
+DROP FUNCTION IF EXISTS dense_logit_shmem_checkpoint(integer, text, integer) CASCADE;
+CREATE FUNCTION dense_logit_shmem_checkpoint(integer, text, integer)
+RETURNS VOID
+AS 'dense-logit-shmem', 'checkpoint'
+LANGUAGE C STRICT;
+
+-- push the model again from a checkpoint file, returns the epochs done
+DROP FUNCTION IF EXISTS dense_logit_shmem_restore(integer, text) CASCADE;
+CREATE FUNCTION dense_logit_shmem_restore(integer, text)
+RETURNS integer
+AS 'dense-logit-shmem', 'restore'
+LANGUAGE C STRICT;
+
+-- an epoch over data_table, in a random order of its blocks drawn from
+-- seed, or in the order of the table if seed is null
+DROP FUNCTION IF EXISTS dense_logit_shmem_iteration(data_table text, model_id integer, seed integer) CASCADE;
+CREATE FUNCTION dense_logit_shmem_iteration(data_table text, model_id integer, seed integer)
 RETURNS double precision AS $$
 DECLARE
 	loss double precision;
 BEGIN
 	-- grad
-	EXECUTE 'SELECT count(dense_logit_grad(' || model_id || ', vec, labeli)) '
-			|| 'FROM ' || quote_ident(data_table);
+	IF seed IS NULL THEN
+		EXECUTE 'SELECT count(dense_logit_grad(' || model_id || ', vec, labeli)) '
+				|| 'FROM ' || quote_ident(data_table);
+	ELSE
+		PERFORM shuffled_scan('count(dense_logit_grad(' || model_id || ', vec, labeli))',
+				quote_ident(data_table), seed);
+	END IF;
 	-- update
 	PERFORM dense_logit_shmem_step(model_id);
 	UPDATE linear_model SET stepsize = (
@@ -206,21 +306,76 @@ BEGIN
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
-DROP FUNCTION IF EXISTS dense_logit_train_shmem(data_table text, model_id integer, iteration integer) CASCADE;
-CREATE FUNCTION dense_logit_train_shmem(data_table text, model_id integer, iteration integer)
+DROP FUNCTION IF EXISTS dense_logit_shmem_iteration(data_table text, model_id integer) CASCADE;
+CREATE FUNCTION dense_logit_shmem_iteration(data_table text, model_id integer)
+RETURNS double precision AS $$
+	SELECT dense_logit_shmem_iteration($1, $2, NULL);
+$$ LANGUAGE sql VOLATILE;
+
+-- an epoch as dense_logit_shmem_iteration, but returning the loss of every row
+-- against the model before its step (progressive validation) summed in the
+-- same scan as the gradient, instead of a second scan for the loss after
+-- the epoch
+DROP FUNCTION IF EXISTS dense_logit_shmem_fused_iteration(data_table text, model_id integer, seed integer) CASCADE;
+CREATE FUNCTION dense_logit_shmem_fused_iteration(data_table text, model_id integer, seed integer)
+RETURNS double precision AS $$
+DECLARE
+	loss double precision;
+BEGIN
+	-- grad and loss
+	IF seed IS NULL THEN
+		EXECUTE 'SELECT sum(dense_logit_grad_loss(' || model_id || ', vec, labeli)) '
+				|| 'FROM ' || quote_ident(data_table)
+			INTO loss;
+	ELSE
+		SELECT shuffled_scan('sum(dense_logit_grad_loss(' || model_id || ', vec, labeli))',
+				quote_ident(data_table), seed) INTO loss;
+	END IF;
+	-- update
+	PERFORM dense_logit_shmem_step(model_id);
+	UPDATE linear_model SET stepsize = (
+			SELECT stepsize * decay FROM linear_model WHERE mid = model_id)
+		WHERE mid = model_id;
+	RETURN loss;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+-- with is_shuffle, every epoch reads the table in a new random order of
+-- its blocks; with is_fused, the loss of an epoch comes from the same scan
+-- (dense_logit_shmem_fused_iteration)
+DROP FUNCTION IF EXISTS dense_logit_train_shmem(data_table text, model_id integer, iteration integer, is_shuffle boolean, is_fused boolean) CASCADE;
+CREATE FUNCTION dense_logit_train_shmem(data_table text, model_id integer, iteration integer, is_shuffle boolean, is_fused boolean)
 RETURNS VOID AS $$
 DECLARE
 	loss double precision;
+	seed integer;
 BEGIN
 	PERFORM dense_logit_shmem_push(linear_model.*) FROM linear_model WHERE mid = model_id;
 	FOR i IN 1..iteration LOOP
-		SELECT dense_logit_shmem_iteration(data_table, model_id) INTO loss;
+		seed := CASE WHEN is_shuffle THEN (random() * 2147483647)::integer END;
+		IF is_fused THEN
+			SELECT dense_logit_shmem_fused_iteration(data_table, model_id, seed) INTO loss;
+		ELSE
+			SELECT dense_logit_shmem_iteration(data_table, model_id, seed) INTO loss;
+		END IF;
 		RAISE NOTICE '#iter: %, loss value: %', i, loss;
 	END LOOP;
 	UPDATE linear_model SET w = (SELECT dense_logit_shmem_pop(model_id)) WHERE mid = model_id;
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
+DROP FUNCTION IF EXISTS dense_logit_train_shmem(data_table text, model_id integer, iteration integer, is_shuffle boolean) CASCADE;
+CREATE FUNCTION dense_logit_train_shmem(data_table text, model_id integer, iteration integer, is_shuffle boolean)
+RETURNS VOID AS $$
+	SELECT dense_logit_train_shmem($1, $2, $3, $4, 'f');
+$$ LANGUAGE sql VOLATILE;
+
+DROP FUNCTION IF EXISTS dense_logit_train_shmem(data_table text, model_id integer, iteration integer) CASCADE;
+CREATE FUNCTION dense_logit_train_shmem(data_table text, model_id integer, iteration integer)
+RETURNS VOID AS $$
+	SELECT dense_logit_train_shmem($1, $2, $3, 'f');
+$$ LANGUAGE sql VOLATILE;
+
 --------------------------------------------------------------------------
 -- wrappers
 --------------------------------------------------------------------------
@@ -250,7 +405,10 @@ BEGIN
 	DELETE FROM linear_model WHERE mid = model_id;
 	INSERT INTO linear_model VALUES (model_id, ndims, ntuples, mu, stepsize, decay, initw, initv); 
 	-- execute iterations
-	IF is_shuffle THEN
+	-- in shared memory the table is read in a new random order of its
+	-- blocks every epoch, the aggregate takes a shuffled copy of it, and
+	-- so does shared memory where block_rows does not work (Greenplum)
+	IF is_shuffle AND NOT (is_shmem AND block_rows_supported()) THEN
 		tmp_table := '__bismarck_shuffled_' || data_table || '_' || model_id;
 		EXECUTE 'DROP TABLE IF EXISTS ' || tmp_table || ' CASCADE';
 		EXECUTE 'CREATE TABLE ' || tmp_table || ' AS 
@@ -260,7 +418,8 @@ BEGIN
 		tmp_table := data_table;
 	END IF;
 	IF is_shmem THEN
-		PERFORM dense_logit_train_shmem(tmp_table, model_id, iteration);
+		PERFORM dense_logit_train_shmem(tmp_table, model_id, iteration,
+			is_shuffle AND block_rows_supported());
 	ELSE
 		PERFORM dense_logit_train_agg(tmp_table, model_id, iteration);
 	END IF;
@@ -0,0 +1,87 @@
+/*
+Copyright 2012 Xixuan (Aaron) Feng and Arun Kumar and Christopher Re
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+--------------------------------------------------------------------------
+-- for shared-memory version with float4 weights (-DW_FLOAT4)
+--
+-- same as the sparse_logit_* functions, but the model in shared memory is
+-- kept in single precision; the model table still holds float8 weights
+--------------------------------------------------------------------------
+DROP FUNCTION IF EXISTS sparse_logit_f4_shmem_push(linear_model) CASCADE;
+CREATE FUNCTION sparse_logit_f4_shmem_push(linear_model)
+RETURNS VOID
+AS 'sparse-logit-shmem-f4', 'init'
+LANGUAGE C STRICT;
+
+DROP FUNCTION IF EXISTS sparse_logit_f4_grad(integer, integer[], double precision[], integer) CASCADE;
+CREATE FUNCTION sparse_logit_f4_grad(integer, integer[], double precision[], integer)
+RETURNS VOID
+AS 'sparse-logit-shmem-f4', 'grad'
+LANGUAGE C STRICT;
+
+-- a gradient step that also returns the loss of the row against the
+-- model before the step
+DROP FUNCTION IF EXISTS sparse_logit_f4_grad_loss(integer, integer[], double precision[], integer) CASCADE;
+CREATE FUNCTION sparse_logit_f4_grad_loss(integer, integer[], double precision[], integer)
+RETURNS double precision
+AS 'sparse-logit-shmem-f4', 'grad_loss'
+LANGUAGE C STRICT;
+
+DROP FUNCTION IF EXISTS sparse_logit_f4_loss(integer, integer[], double precision[], integer) CASCADE;
+CREATE FUNCTION sparse_logit_f4_loss(integer, integer[], double precision[], integer)
+RETURNS double precision
+AS 'sparse-logit-shmem-f4', 'loss'
+LANGUAGE C STRICT;
+
+DROP FUNCTION IF EXISTS sparse_logit_f4_pred(integer, integer[], double precision[]) CASCADE;
+CREATE FUNCTION sparse_logit_f4_pred(integer, integer[], double precision[])
+RETURNS double precision
+AS 'sparse-logit-shmem-f4', 'pred'
+LANGUAGE C STRICT;
+
+DROP FUNCTION IF EXISTS sparse_logit_f4_shmem_pop(integer) CASCADE;
+CREATE FUNCTION sparse_logit_f4_shmem_pop(integer)
+RETURNS double precision []
+AS 'sparse-logit-shmem-f4', 'final'
+LANGUAGE C STRICT;
+
+DROP FUNCTION IF EXISTS sparse_logit_f4_shmem_step(integer) CASCADE;
+CREATE FUNCTION sparse_logit_f4_shmem_step(integer)
+RETURNS VOID
+AS 'sparse-logit-shmem-f4', 'pre'
+LANGUAGE C STRICT;
+
+-- lock contention so far: {acquisitions, spin iterations, wait ns}
+DROP FUNCTION IF EXISTS sparse_logit_f4_shmem_lock_stats(integer) CASCADE;
+CREATE FUNCTION sparse_logit_f4_shmem_lock_stats(integer)
+RETURNS double precision[]
+AS 'sparse-logit-shmem-f4', 'lock_stats'
+LANGUAGE C STRICT;
+
+-- snapshot the model to a file, (model_id, path, epochs done), written
+-- by a thread of the backend while training goes on
+DROP FUNCTION IF EXISTS sparse_logit_f4_shmem_checkpoint(integer, text, integer) CASCADE;
+CREATE FUNCTION sparse_logit_f4_shmem_checkpoint(integer, text, integer)
+RETURNS VOID
+AS 'sparse-logit-shmem-f4', 'checkpoint'
+LANGUAGE C STRICT;
+
+-- push the model again from a checkpoint file, returns the epochs done
+DROP FUNCTION IF EXISTS sparse_logit_f4_shmem_restore(integer, text) CASCADE;
+CREATE FUNCTION sparse_logit_f4_shmem_restore(integer, text)
+RETURNS integer
+AS 'sparse-logit-shmem-f4', 'restore'
+LANGUAGE C STRICT;
@@ -44,6 +44,30 @@ CREATE AGGREGATE sparse_logit_agg(integer[], double precision[], integer, double
 	FINALFUNC = sparse_logit_final,
 	SFUNC = sparse_logit_transit);
 
+-- the fused aggregate: the same steps, that also sum the loss of every row
+-- against the state before its step (progressive validation); its final
+-- function returns {loss, w}
+DROP AGGREGATE IF EXISTS sparse_logit_fused_agg(integer[], double precision[], integer, double precision[]) CASCADE;
+DROP FUNCTION IF EXISTS sparse_logit_transit_loss(double precision[], integer[], double precision[], integer, double precision[]) CASCADE;
+DROP FUNCTION IF EXISTS sparse_logit_final_loss(double precision[]) CASCADE;
+
+CREATE FUNCTION sparse_logit_transit_loss(double precision[], integer[], double precision[], integer, double precision[])
+RETURNS double precision[]
+AS 'sparse-logit-agg', 'grad_loss'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE FUNCTION sparse_logit_final_loss(double precision[])
+RETURNS double precision[]
+AS 'sparse-logit-agg', 'final_loss'
+LANGUAGE C IMMUTABLE STRICT;
+
+CREATE AGGREGATE sparse_logit_fused_agg(integer[], double precision[], integer, double precision[]) (
+	INITCOND = '{0}',
+	STYPE = double precision[],
+	PREFUNC = sparse_logit_pre,
+	FINALFUNC = sparse_logit_final_loss,
+	SFUNC = sparse_logit_transit_loss);
+
 DROP FUNCTION IF EXISTS sparse_logit_loss(double precision[], integer[], double precision[], integer) CASCADE;
 CREATE FUNCTION sparse_logit_loss(double precision[], integer[], double precision[], integer)
 RETURNS double precision
@@ -92,19 +116,58 @@ BEGIN
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
-DROP FUNCTION IF EXISTS sparse_logit_train_agg(data_table text, model_id integer, iteration integer) CASCADE;
-CREATE FUNCTION sparse_logit_train_agg(data_table text, model_id integer, iteration integer)
+-- an epoch as sparse_logit_agg_iteration, but the loss is that of every row
+-- against the model before its step (progressive validation), summed by
+-- the aggregate in the same scan instead of a second scan after it
+DROP FUNCTION IF EXISTS sparse_logit_agg_fused_iteration(data_table text, model_id integer) CASCADE;
+CREATE FUNCTION sparse_logit_agg_fused_iteration(data_table text, model_id integer)
+RETURNS double precision AS $$
+DECLARE
+	wl double precision[];
+	loss double precision;
+BEGIN
+	-- grad and loss
+	EXECUTE 'SELECT sparse_logit_fused_agg(k, v, label, 
+						    (SELECT sparse_logit_serialize(linear_model.*) 
+							 FROM linear_model 
+							 WHERE mid = ' || model_id || ')) '
+			|| 'FROM ' || quote_ident(data_table)
+		INTO wl;
+	loss := wl[1];
+	-- update
+	UPDATE linear_model SET w = wl[2:array_upper(wl, 1)] WHERE mid = model_id;
+	UPDATE linear_model SET stepsize = (
+			SELECT stepsize * decay FROM linear_model WHERE mid = model_id)
+		WHERE mid = model_id;
+	RETURN loss;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+-- with is_fused, the loss of an epoch comes from the same scan
+-- (sparse_logit_agg_fused_iteration)
+DROP FUNCTION IF EXISTS sparse_logit_train_agg(data_table text, model_id integer, iteration integer, is_fused boolean) CASCADE;
+CREATE FUNCTION sparse_logit_train_agg(data_table text, model_id integer, iteration integer, is_fused boolean)
 RETURNS VOID AS $$
 DECLARE
 	loss double precision;
 BEGIN
 	FOR i IN 1..iteration LOOP
-		SELECT sparse_logit_agg_iteration(data_table, model_id) INTO loss;
+		IF is_fused THEN
+			SELECT sparse_logit_agg_fused_iteration(data_table, model_id) INTO loss;
+		ELSE
+			SELECT sparse_logit_agg_iteration(data_table, model_id) INTO loss;
+		END IF;
 		RAISE NOTICE '#iter: %, loss value: %', i, loss;
 	END LOOP;
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
+DROP FUNCTION IF EXISTS sparse_logit_train_agg(data_table text, model_id integer, iteration integer) CASCADE;
+CREATE FUNCTION sparse_logit_train_agg(data_table text, model_id integer, iteration integer)
+RETURNS VOID AS $$
+	SELECT sparse_logit_train_agg($1, $2, $3, 'f');
+$$ LANGUAGE sql VOLATILE;
+
 DROP FUNCTION IF EXISTS sparse_logit_eval(data_table text, model_id integer) CASCADE;
 CREATE FUNCTION sparse_logit_eval(data_table text, model_id integer)
 RETURNS double precision AS $$
@@ -160,6 +223,14 @@ RETURNS VOID
 AS 'sparse-logit-shmem', 'grad'
 LANGUAGE C STRICT;
 
+-- a gradient step that also returns the loss of the row against the
+-- model before the step
+DROP FUNCTION IF EXISTS sparse_logit_grad_loss(integer, integer[], double precision[], integer) CASCADE;
+CREATE FUNCTION sparse_logit_grad_loss(integer, integer[], double precision[], integer)
+RETURNS double precision
+AS 'sparse-logit-shmem', 'grad_loss'
+LANGUAGE C STRICT;
+
 DROP FUNCTION IF EXISTS sparse_logit_loss(integer, integer[], double precision[], integer) CASCADE;
 CREATE FUNCTION sparse_logit_loss(integer, integer[], double precision[], integer)
 RETURNS double precision
@@ -184,15 +255,44 @@ RETURNS VOID
 AS 'sparse-logit-shmem', 'pre'
 LANGUAGE C STRICT;
 
-DROP FUNCTION IF EXISTS sparse_logit_shmem_iteration(data_table text, model_id integer) CASCADE;
-CREATE FUNCTION sparse_logit_shmem_iteration(data_table text, model_id integer)
+-- lock contention so far: {acquisitions, spin iterations, wait ns}
+DROP FUNCTION IF EXISTS sparse_logit_shmem_lock_stats(integer) CASCADE;
+CREATE FUNCTION sparse_logit_shmem_lock_stats(integer)
+RETURNS double precision[]
+AS 'sparse-logit-shmem', 'lock_stats'
+LANGUAGE C STRICT;
+
+-- snapshot the model to a file, (model_id, path, epochs done), written
+-- by a thread of the backend while training goes on
+DROP FUNCTION IF EXISTS sparse_logit_shmem_checkpoint(integer, text, integer) CASCADE;
+CREATE FUNCTION sparse_logit_shmem_checkpoint(integer, text, integer)
+RETURNS VOID
+AS 'sparse-logit-shmem', 'checkpoint'
+LANGUAGE C STRICT;
+
+-- push the model again from a checkpoint file, returns the epochs done
+DROP FUNCTION IF EXISTS sparse_logit_shmem_restore(integer, text) CASCADE;
+CREATE FUNCTION sparse_logit_shmem_restore(integer, text)
+RETURNS integer
+AS 'sparse-logit-shmem', 'restore'
+LANGUAGE C STRICT;
+
+-- an epoch over data_table, in a random order of its blocks drawn from
+-- seed, or in the order of the table if seed is null
+DROP FUNCTION IF EXISTS sparse_logit_shmem_iteration(data_table text, model_id integer, seed integer) CASCADE;
+CREATE FUNCTION sparse_logit_shmem_iteration(data_table text, model_id integer, seed integer)
 RETURNS double precision AS $$
 DECLARE
 	loss double precision;
 BEGIN
 	-- grad
-	EXECUTE 'SELECT count(sparse_logit_grad(' || model_id || ', k, v, label)) '
-			|| 'FROM ' || quote_ident(data_table);
+	IF seed IS NULL THEN
+		EXECUTE 'SELECT count(sparse_logit_grad(' || model_id || ', k, v, label)) '
+				|| 'FROM ' || quote_ident(data_table);
+	ELSE
+		PERFORM shuffled_scan('count(sparse_logit_grad(' || model_id || ', k, v, label))',
+				quote_ident(data_table), seed);
+	END IF;
 	-- update
 	PERFORM sparse_logit_shmem_step(model_id);
 	UPDATE linear_model SET stepsize = (
@@ -206,21 +306,76 @@ BEGIN
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
-DROP FUNCTION IF EXISTS sparse_logit_train_shmem(data_table text, model_id integer, iteration integer) CASCADE;
-CREATE FUNCTION sparse_logit_train_shmem(data_table text, model_id integer, iteration integer)
+DROP FUNCTION IF EXISTS sparse_logit_shmem_iteration(data_table text, model_id integer) CASCADE;
+CREATE FUNCTION sparse_logit_shmem_iteration(data_table text, model_id integer)
+RETURNS double precision AS $$
+	SELECT sparse_logit_shmem_iteration($1, $2, NULL);
+$$ LANGUAGE sql VOLATILE;
+
+-- an epoch as sparse_logit_shmem_iteration, but returning the loss of every row
+-- against the model before its step (progressive validation) summed in the
+-- same scan as the gradient, instead of a second scan for the loss after
+-- the epoch
+DROP FUNCTION IF EXISTS sparse_logit_shmem_fused_iteration(data_table text, model_id integer, seed integer) CASCADE;
+CREATE FUNCTION sparse_logit_shmem_fused_iteration(data_table text, model_id integer, seed integer)
+RETURNS double precision AS $$
+DECLARE
+	loss double precision;
+BEGIN
+	-- grad and loss
+	IF seed IS NULL THEN
+		EXECUTE 'SELECT sum(sparse_logit_grad_loss(' || model_id || ', k, v, label)) '
+				|| 'FROM ' || quote_ident(data_table)
+			INTO loss;
+	ELSE
+		SELECT shuffled_scan('sum(sparse_logit_grad_loss(' || model_id || ', k, v, label))',
+				quote_ident(data_table), seed) INTO loss;
+	END IF;
+	-- update
+	PERFORM sparse_logit_shmem_step(model_id);
+	UPDATE linear_model SET stepsize = (
+			SELECT stepsize * decay FROM linear_model WHERE mid = model_id)
+		WHERE mid = model_id;
+	RETURN loss;
+END;
+$$ LANGUAGE plpgsql VOLATILE;
+
+-- with is_shuffle, every epoch reads the table in a new random order of
+-- its blocks; with is_fused, the loss of an epoch comes from the same scan
+-- (sparse_logit_shmem_fused_iteration)
+DROP FUNCTION IF EXISTS sparse_logit_train_shmem(data_table text, model_id integer, iteration integer, is_shuffle boolean, is_fused boolean) CASCADE;
+CREATE FUNCTION sparse_logit_train_shmem(data_table text, model_id integer, iteration integer, is_shuffle boolean, is_fused boolean)
 RETURNS VOID AS $$
 DECLARE
 	loss double precision;
+	seed integer;
 BEGIN
 	PERFORM sparse_logit_shmem_push(linear_model.*) FROM linear_model WHERE mid = model_id;
 	FOR i IN 1..iteration LOOP
-		SELECT sparse_logit_shmem_iteration(data_table, model_id) INTO loss;
+		seed := CASE WHEN is_shuffle THEN (random() * 2147483647)::integer END;
+		IF is_fused THEN
+			SELECT sparse_logit_shmem_fused_iteration(data_table, model_id, seed) INTO loss;
+		ELSE
+			SELECT sparse_logit_shmem_iteration(data_table, model_id, seed) INTO loss;
+		END IF;
 		RAISE NOTICE '#iter: %, loss value %', i, loss;
 	END LOOP;
 	UPDATE linear_model SET w = (SELECT sparse_logit_shmem_pop(model_id)) WHERE mid = model_id;
 END;
 $$ LANGUAGE plpgsql VOLATILE;
 
+DROP FUNCTION IF EXISTS sparse_logit_train_shmem(data_table text, model_id integer, iteration integer, is_shuffle boolean) CASCADE;
+CREATE FUNCTION sparse_logit_train_shmem(data_table text, model_id integer, iteration integer, is_shuffle boolean)
+RETURNS VOID AS $$
+	SELECT sparse_logit_train_shmem($1, $2, $3, $4, 'f');
+$$ LANGUAGE sql VOLATILE;
+
+DROP FUNCTION IF EXISTS sparse_logit_train_shmem(data_table text, model_id integer, iteration integer) CASCADE;
+CREATE FUNCTION sparse_logit_train_shmem(data_table text, model_id integer, iteration integer)
+RETURNS VOID AS $$
+	SELECT sparse_logit_train_shmem($1, $2, $3, 'f');
+$$ LANGUAGE sql VOLATILE;
+
 --------------------------------------------------------------------------
 -- wrappers
 --------------------------------------------------------------------------
@@ -250,7 +405,10 @@ BEGIN
 	INSERT INTO linear_model VALUES (model_id, ndims, ntuples, mu, stepsize, decay, NULL); 
 	UPDATE linear_model SET w = initw WHERE mid = model_id;
 	-- execute iterations
-	IF is_shuffle THEN
+	-- in shared memory the table is read in a new random order of its
+	-- blocks every epoch, the aggregate takes a shuffled copy of it, and
+	-- so does shared memory where block_rows does not work (Greenplum)
+	IF is_shuffle AND NOT (is_shmem AND block_rows_supported()) THEN
 		tmp_table := '__bismarck_shuffled_' || data_table || '_' || model_id;
 		EXECUTE 'DROP TABLE IF EXISTS ' || tmp_table || ' CASCADE';
 		EXECUTE 'CREATE TABLE ' || tmp_table || ' AS 
@@ -260,7 +418,8 @@ BEGIN
 		tmp_table := data_table;
 	END IF;
 	IF is_shmem THEN
-		PERFORM sparse_logit_train_shmem(tmp_table, model_id, iteration);
+		PERFORM sparse_logit_train_shmem(tmp_table, model_id, iteration,
+			is_shuffle AND block_rows_supported());
 	ELSE
 		PERFORM sparse_logit_train_agg(tmp_table, model_id, iteration);
 	END IF;
@@ -26,6 +26,155 @@ PG_FUNCTION_INFO_V1(pre);
 PG_FUNCTION_INFO_V1(final);
 PG_FUNCTION_INFO_V1(loss);
 PG_FUNCTION_INFO_V1(pred);
+PG_FUNCTION_INFO_V1(grad_loss);
+#ifdef VAGG
+PG_FUNCTION_INFO_V1(final_loss);
+PG_FUNCTION_INFO_V1(grad_state);
+PG_FUNCTION_INFO_V1(final_state);
+PG_FUNCTION_INFO_V1(grad_loss_state);
+PG_FUNCTION_INFO_V1(final_loss_state);
+#endif
+#ifndef VAGG
+PG_FUNCTION_INFO_V1(lock_stats);
+PG_FUNCTION_INFO_V1(checkpoint);
+PG_FUNCTION_INFO_V1(restore);
+#endif
+
+#ifdef VAGG
+/**
+ * point a local LinearModel at the aggregate state w+, laid out as
+ * [META | w | temp_v | L1 stamps | mini-batch buffer]
+ */
+static void
+unpack_state(struct LinearModel *ptrModel, double *wp, int wpLen) {
+    int wLen = (int) wp[1];
+    LinearModel_init(ptrModel, (int) wp[0], wLen, (int) wp[2], 
+            wp[3], wp[10], wp[4], wp[5]);
+    ptrModel->wscale = wp[11];
+    ptrModel->w = wp + META_LEN;
+    ptrModel->temp_v = wp + META_LEN + wLen;
+    ptrModel->l1Stamp = wp + META_LEN + 2 * wLen;
+    ptrModel->l1Clock = wp[9];
+    if (wpLen > META_LEN + 3 * wLen) {
+        LinearModel_set_batch(ptrModel, (int) wp[7], (int) wp[8], 
+                wp + META_LEN + 3 * wLen);
+    }
+}
+
+/**
+ * bring the weights of state w+ up to date: apply the rows still
+ * buffered in a dense mini-batch, the pending L1 shrinkage and wscale
+ */
+static void
+flush_state(double *wp, int wpLen) {
+    struct LinearModel modelBuffer;
+    struct LinearModel *ptrModel = &modelBuffer;
+    unpack_state(ptrModel, wp, wpLen);
+#ifndef SPARSE
+    dense_logit_grad_batch(ptrModel);
+    wp[8] = 0;
+#endif
+    LinearModel_scale(ptrModel);
+    wp[9] = ptrModel->l1Clock;
+    wp[11] = ptrModel->wscale;
+}
+#if defined(SPARSE)
+#define OLD_MODEL (4)
+#else
+#define OLD_MODEL (3)
+#endif
+
+/**
+ * length of the state w+ of an epoch: the L1 stamps, then the dense rows
+ * of a mini-batch, go behind the serialized model [META | w | temp_v]
+ */
+static int
+state_len(const double *initwp, int initwpLen) {
+    int batchLen = 0;
+#ifndef SPARSE
+    if (initwp[7] > 1) {
+        batchLen = LinearModel_batch_len((int) initwp[1], (int) initwp[7]);
+    }
+#endif
+    return initwpLen + (int) initwp[1] + batchLen;
+}
+
+/**
+ * one gradient step of state w+ on the row (k, v, y) or (v, y) of args 1..,
+ * with withLoss also adding the loss of the row against the state before
+ * the step to wp[12]. always inlined, so grad pays nothing for the loss
+ */
+__attribute__((always_inline)) static inline void
+step_state(FunctionCallInfo fcinfo, double *wp, int wpLen, const int withLoss) {
+    struct LinearModel modelBuffer;
+    struct LinearModel *ptrModel = &modelBuffer;
+    // local copy, updated in place
+    unpack_state(ptrModel, wp, wpLen);
+    // count
+    wp[6] ++;
+#if defined(SPARSE)
+    // k
+    int32 *k;
+    int len1 = my_parse_array_no_copy((struct varlena*) PG_GETARG_RAW_VARLENA_P(1), 
+            sizeof(int32), (char **)&k);
+    // v
+    float8 *v;
+    my_parse_array_no_copy((struct varlena*) PG_GETARG_RAW_VARLENA_P(2),
+            sizeof(float8), (char **)&v);
+    // y
+    int32 y = PG_GETARG_INT32(3);
+    double wx = sparse_logit_grad(ptrModel, len1, k, v, y);
+    if (withLoss) { wp[12] += logit_margin_loss(wx, y); }
+#else
+    // v
+    float8 *v;
+    my_parse_array_no_copy((struct varlena*) PG_GETARG_RAW_VARLENA_P(1),
+            sizeof(float8), (char **)&v);
+    // y
+    int32 y = PG_GETARG_INT32(2);
+    if (ptrModel->batchSize > 1) {
+        // the rows of a batch all see the state before its step
+        if (withLoss) { wp[12] += dense_logit_loss(ptrModel, v, y); }
+        if (LinearModel_buffer_row(ptrModel, v, y)) {
+            dense_logit_grad_batch(ptrModel);
+        }
+    } else {
+        double wx = dense_logit_grad(ptrModel, v, y);
+        if (withLoss) { wp[12] += logit_margin_loss(wx, y); }
+    }
+#endif
+    wp[8] = ptrModel->nBuffered;
+    wp[9] = ptrModel->l1Clock;
+    wp[11] = ptrModel->wscale;
+}
+
+/**
+ * the weights of state w+, with the pending updates applied, as an array;
+ * with withLoss led by the loss summed by the fused aggregate, {loss, w}
+ */
+static ArrayType *
+state_to_array(double *wp, int wpLen, const int withLoss) {
+    double *w;
+    // sanity checking
+    assert(wpLen >= 3 * ((int) wp[1]) + META_LEN);
+    assert(((int) wp[2]) == ((int) wp[6]));
+    // apply the last, partial mini-batch and the pending shrinkage to a
+    // copy: the final function must leave the state as it is, which the
+    // executor may finalize again (window frames, shared aggregates)
+    double *flushed = (double *) palloc(wpLen * sizeof(double));
+    memcpy(flushed, wp, wpLen * sizeof(double));
+    flush_state(flushed, wpLen);
+    // get rid of meta data when outputing
+    int wLen = (int) wp[1];
+    ArrayType *warray = my_construct_array(wLen + withLoss, sizeof(float8), FLOAT8OID);
+    my_parse_array_no_copy((struct varlena *)warray, 
+            sizeof(float8), (char **)&w);
+    if (withLoss) { *(w ++) = wp[12]; }
+    memcpy(w, flushed + META_LEN, wLen * sizeof(float8));
+    pfree(flushed);
+    return warray;
+}
+#endif
 
 /**
  * init for a new model instance
@@ -71,6 +220,14 @@ init(PG_FUNCTION_ARGS) {
     ereport( INFO,
             ( errcode( ERRCODE_SUCCESSFUL_COMPLETION ),
               errmsg( "wlen: %d; vlen: %d\n", wLen, vLen )));
+    // mini-batch size, rows buffered per update (dense VAGG only)
+    int batchsize = DatumGetInt32(GetAttributeByNum(modelTuple, 9, &isnull));
+    if (isnull || batchsize < 1) { batchsize = 1; }
+    // L2 regularization, and the scale of the stored w
+    double l2 = DatumGetFloat8(GetAttributeByNum(modelTuple, 10, &isnull));
+    if (isnull) { l2 = 0; }
+    double wscale = DatumGetFloat8(GetAttributeByNum(modelTuple, 11, &isnull));
+    if (isnull || wscale == 0) { wscale = 1; }
     // dimension sanity check
     assert(wLen == ndims);
     assert(vLen == ndims);
@@ -97,6 +254,12 @@ init(PG_FUNCTION_ARGS) {
     wp[4] = stepsize;
     wp[5] = decay;
     wp[6] = 0;  // count of tuple seen
+    wp[7] = batchsize;
+    wp[8] = 0;  // count of rows buffered for the mini-batch
+    wp[9] = 0;  // lazy L1 clock
+    wp[10] = l2;
+    wp[11] = wscale;
+    wp[12] = 0; // loss summed by the fused aggregate
 
     // -------------------------------------------------------------------
     // 3. copy weight vector into w+
@@ -113,13 +276,11 @@ init(PG_FUNCTION_ARGS) {
     //    using mid as key
     //--------------------------------------------------------------------
     struct LinearModel* ptrModel;
-    int size = sizeof(struct LinearModel) + sizeof(double) * (ndims) * 2;
-    // open the shared memory
-    int shmid = shmget(ftok("/", mid), size, SHM_R | SHM_W | IPC_CREAT);
-    if (shmid == -1) { elog(ERROR, "In init, shmget failed!\n"); }
-    // elog(WARNING, "init: after shmget\n");
+    size_t size = LinearModel_size(ndims);
+    // open the shared memory, in huge pages if there are
+    create_model_shmem(mid, size);
     // attach the memory region
-    ptrModel = (struct LinearModel*) shmat(shmid, NULL, 0);
+    ptrModel = (struct LinearModel*) get_model_by_mid(mid);
     // elog(WARNING, "init: after shmat, model: %x\n", ptrModel);
 
     //--------------------------------------------------------------------
@@ -127,67 +288,37 @@ init(PG_FUNCTION_ARGS) {
     //--------------------------------------------------------------------
     // constructor
     LinearModel_init(ptrModel, mid, ndims, ntuples, 
-			mu, stepsize, decay);
+			mu, l2, stepsize, decay);
+    ptrModel->wscale = wscale;
+    if (batchsize > 1) {
+        elog(WARNING, "mini-batch is only supported by the aggregate version, "
+                "batchsize %d ignored", batchsize);
+    }
 
     // -------------------------------------------------------------------
     // 3. copy weight vector into shared memory
     // -------------------------------------------------------------------
-    memcpy(ptrModel->w, w, sizeof(double) * wLen);
+    store_w(ptrModel->w, w, wLen);
 
-    memcpy(ptrModel->temp_v, temp_v, sizeof(double) * vLen);
+    store_w(ptrModel->temp_v, temp_v, vLen);
+    memset(ptrModel->l1Stamp, 0, sizeof(double) * wLen);
+    // a dense row touches every stripe, dense steps take the model lock
+#if defined(VSTRIPE) && defined(SPARSE)
+    LinearModel_init_stripes(ptrModel);
+#endif
 
     PG_RETURN_NULL();
 #endif
 }
 
+#ifndef VAGG
 /**
- * gradient function
+ * one gradient step of the shared model on the row (k, v, y) or (v, y) of
+ * args 1.., with withLoss also the loss of the row against the model before
+ * the step. always inlined, so grad pays nothing for the loss
  */
-Datum
-grad(PG_FUNCTION_ARGS) {
-#if defined(VAGG) && defined(SPARSE)
-#define OLD_MODEL (4)
-#elif defined(VAGG) 
-#define OLD_MODEL (3)
-#endif
-
-#ifdef VAGG
-    //--------------------------------------------------------------------
-    // 1. init a local LinearModel structure 
-    // and get the weight vector from temp state
-    //--------------------------------------------------------------------
-    ArrayType *wparray = (ArrayType *) PG_GETARG_RAW_VARLENA_P(0);
-    double *wp;
-    int wpLen = my_parse_array_no_copy((struct varlena*) wparray, 
-            sizeof(float8), (char **) &wp);
-    struct LinearModel modelBuffer;
-    struct LinearModel *ptrModel;
-    // beginning of an epoch
-    if (wpLen == 1) {
-        // use arg[4] to retrieve serialized model w+
-        ArrayType *initwparray = (ArrayType *) PG_GETARG_RAW_VARLENA_P(OLD_MODEL);
-        double *initwp;
-        int initwpLen = my_parse_array_no_copy((struct varlena*) initwparray, 
-                sizeof(float8), (char **) &initwp);
-        wparray = my_construct_array(initwpLen, sizeof(float8), FLOAT8OID);
-        wpLen = my_parse_array_no_copy((struct varlena *)wparray, 
-                sizeof(float8), (char **)&wp);
-		memcpy(wp, initwp, initwpLen * sizeof(float8));
-		assert(wp[6] == 0);
-    }
-    // local copy
-    ptrModel = &modelBuffer;
-    // init hyper parameters
-    LinearModel_init(ptrModel, (int) wp[0], (int) wp[1], (int) wp[2], 
-            wp[3], wp[4], wp[5]);
-	// point to the weight vector and update in place
-    ptrModel->w = wp + META_LEN;
-    int wLen = (wpLen - META_LEN)/2;
-    ptrModel->temp_v = wp + META_LEN + wLen;
-    // count
-    wp[6] ++;
-    // elog(WARNING, "grad: count: %lf, nDims %d", ptrModel->w[ptrModel->nDims], ptrModel->nDims);
-#else
+__attribute__((always_inline)) static inline double
+step_shmem(FunctionCallInfo fcinfo, const int withLoss) {
     //--------------------------------------------------------------------
     // 1. get the LinearModel structure from the shared memory
     //    using mid (arg[0])
@@ -196,15 +327,10 @@ grad(PG_FUNCTION_ARGS) {
     // model
     struct LinearModel modelBuffer;
     struct LinearModel* ptrModel = &modelBuffer;
-    static struct LinearModel* ptrSharedModel = NULL;
-    if (ptrSharedModel == NULL || ptrSharedModel->mid != mid) {
-        ptrSharedModel = (struct LinearModel*)get_model_by_mid(mid);
-        // elog(WARNING, "grad: NO");
-    }
-	*ptrModel = (*ptrSharedModel);
-	ptrModel->w = (double *)(&(ptrSharedModel->w) + 1);
-    ptrModel->temp_v = (double *)(&(ptrSharedModel->temp_v) + 1);
-#endif
+    struct LinearModel* ptrSharedModel = (struct LinearModel*) get_model_by_mid(mid);
+	LinearModel_attach(ptrModel, ptrSharedModel);
+    double l1Clock = ptrModel->l1Clock;
+    double wscale = ptrModel->wscale;
 
     //--------------------------------------------------------------------
     // 2. parse the args (k, v, y) or (v, y)
@@ -238,24 +364,110 @@ grad(PG_FUNCTION_ARGS) {
     //--------------------------------------------------------------------
     // 3. performing the gradient 
     //--------------------------------------------------------------------
-#if !defined(VAGG) && defined(VLOCK)
-	while (compare_and_swap(&(ptrSharedModel->token), 0, 1) == 0) {}
+#ifdef VLOCK
+	spin_lock(&(ptrSharedModel->lock));
+    // the shared scalars are only read once the lock is held, another
+    // backend may have moved them, or folded, since the attach
+    ptrModel->l1Clock = l1Clock = ptrSharedModel->l1Clock;
+    ptrModel->wscale = wscale = ptrSharedModel->wscale;
+#endif
+#ifdef VSTRIPE
+#ifdef SPARSE
+    int allStripes = LinearModel_lock_stripes(ptrModel, k, len1);
+#else
+    spin_lock(&(ptrSharedModel->lock));
+#endif
+    // the shared scalars are only read once our stripes, or the lock, are held
+    ptrModel->l1Clock = l1Clock = ptrSharedModel->l1Clock;
+    ptrModel->wscale = wscale = ptrSharedModel->wscale;
 #endif
 
+    double loss = 0;
 #ifdef SPARSE
-    sparse_logit_grad(ptrModel, len1, k, v, y);
-#else    
-    dense_logit_grad(ptrModel, v, y);
+    double wx = sparse_logit_grad(ptrModel, len1, k, v, y);
+    if (withLoss) { loss = logit_margin_loss(wx, y); }
+#else
+    // shared-memory models always step one row at a time, see init
+    double wx = dense_logit_grad(ptrModel, v, y);
+    if (withLoss) { loss = logit_margin_loss(wx, y); }
+#endif
+
+    // publish the shrinkage and decay handed out by this tuple, without
+    // the model lock others publish theirs concurrently
+#ifdef VLOCK
+    ptrSharedModel->l1Clock += ptrModel->l1Clock - l1Clock;
+    ptrSharedModel->wscale = ptrModel->wscale;
+#else
+    atomic_add_double(&(ptrSharedModel->l1Clock), ptrModel->l1Clock - l1Clock);
+    atomic_scale_double(&(ptrSharedModel->wscale), ptrModel->wscale / wscale);
+#endif
+
+#ifdef VLOCK
+	spin_unlock(&(ptrSharedModel->lock));
+#endif
+#ifdef VSTRIPE
+#ifdef SPARSE
+    LinearModel_unlock_stripes(ptrModel, k, len1, allStripes);
+#else
+    spin_unlock(&(ptrSharedModel->lock));
+#endif
+#endif
+#ifndef VLOCK
+    if (ptrSharedModel->wscale < WSCALE_MIN) {
+        LinearModel_scale_shared(ptrSharedModel);
+    }
+#endif
+
+    return loss;
+}
 #endif
 
-#if !defined(VAGG) && defined(VLOCK)
-	ptrSharedModel->token = 0;
+#ifdef VAGG
+/**
+ * a step of the aggregate over the array state w+, see grad
+ */
+__attribute__((always_inline)) static inline ArrayType *
+step_array(FunctionCallInfo fcinfo, const int withLoss) {
+    //--------------------------------------------------------------------
+    // 1. get the weight vector from temp state
+    //--------------------------------------------------------------------
+    ArrayType *wparray = (ArrayType *) PG_GETARG_RAW_VARLENA_P(0);
+    double *wp;
+    int wpLen = my_parse_array_no_copy((struct varlena*) wparray, 
+            sizeof(float8), (char **) &wp);
+    // beginning of an epoch
+    if (wpLen == 1) {
+        // use arg[OLD_MODEL] to retrieve serialized model w+
+        ArrayType *initwparray = (ArrayType *) PG_GETARG_RAW_VARLENA_P(OLD_MODEL);
+        double *initwp;
+        int initwpLen = my_parse_array_no_copy((struct varlena*) initwparray, 
+                sizeof(float8), (char **) &initwp);
+        wparray = my_construct_array(state_len(initwp, initwpLen), 
+                sizeof(float8), FLOAT8OID);
+        wpLen = my_parse_array_no_copy((struct varlena *)wparray, 
+                sizeof(float8), (char **)&wp);
+		memcpy(wp, initwp, initwpLen * sizeof(float8));
+		assert(wp[6] == 0);
+		assert(wp[8] == 0);
+		assert(wp[9] == 0);
+    }
+
+    step_state(fcinfo, wp, wpLen, withLoss);
+    return wparray;
+}
 #endif
 
+/**
+ * gradient function
+ */
+Datum
+grad(PG_FUNCTION_ARGS) {
 #ifdef VAGG
 	// return array for agg
-    PG_RETURN_ARRAYTYPE_P(wparray);
+    PG_RETURN_ARRAYTYPE_P(step_array(fcinfo, 0));
 #else
+    step_shmem(fcinfo, 0);
+
 	// return null
     PG_RETURN_NULL();
 #endif
@@ -289,6 +501,9 @@ pre(PG_FUNCTION_ARGS) {
 	if (wpLen1 == 1) {
         PG_RETURN_ARRAYTYPE_P(wparray);
     }
+    // apply pending mini-batches and shrinkage before averaging
+    flush_state(wp, wpLen);
+    flush_state(wp1, wpLen1);
     // the count
     int count0 = wp[6];
     // elog(WARNING, "inside pre 3");
@@ -296,13 +511,14 @@ pre(PG_FUNCTION_ARGS) {
     // elog(WARNING, "inside pre 4");
     // elog(WARNING, "count0: %d, count1: %d", count0, count1);
     int count = count0 + count1;
-    int vLen = (wpLen - META_LEN)/2;
+    int wLen = (int) wp[1];
     // add 1 to 0 in place
     int i;
-    for (i = META_LEN; i < wpLen - vLen; i ++) {
+    for (i = META_LEN; i < META_LEN + wLen; i ++) {
         wp[i] = (count0 * 1.0 / count) * wp[i] + (count1 * 1.0 / count) * wp1[i];
     }
     wp[6] = count;
+    wp[12] += wp1[12];
 
     PG_RETURN_ARRAYTYPE_P(wparray);
 #else
@@ -313,10 +529,16 @@ pre(PG_FUNCTION_ARGS) {
     int32 mid = PG_GETARG_INT32(0);
     // model
     struct LinearModel* ptrSharedModel = (struct LinearModel*) get_model_by_mid(mid);
+    struct LinearModel modelBuffer;
 
     //--------------------------------------------------------------------
-    // 2. update step size
+    // 2. apply the pending shrinkage and scale, so loss and pred read 
+    //    up-to-date weights, and update step size
     //--------------------------------------------------------------------
+    LinearModel_attach(&modelBuffer, ptrSharedModel);
+    LinearModel_scale(&modelBuffer);
+    ptrSharedModel->l1Clock = modelBuffer.l1Clock;
+    ptrSharedModel->wscale = modelBuffer.wscale;
 	LinearModel_take_step(ptrSharedModel);
     
     // return null
@@ -336,29 +558,13 @@ final(PG_FUNCTION_ARGS) {
     int vLen; 
 #ifdef VAGG
     //--------------------------------------------------------------------
-    // 1. cut the last count and return the state
+    // 1. cut the meta data and return the weights of the state
     //--------------------------------------------------------------------
-    // get state
-    // elog(WARNING, "final: 0");
     ArrayType *wparray = (ArrayType *) PG_GETARG_RAW_VARLENA_P(0);
 	double *wp;
     int wpLen = my_parse_array_no_copy((struct varlena*) wparray, 
             sizeof(float8), (char **) &wp);
-    // sanity checking
-    assert(wpLen == ((int) wp[1]) + (int) wp[1] + META_LEN);
-    assert(((int) wp[2]) == ((int) wp[6]));
-    //--------------------------------------------------------------------
-    // 2. get rid of count when outputing
-    //--------------------------------------------------------------------
-	warray = my_construct_array((wpLen - META_LEN)/2, sizeof(float8), FLOAT8OID);
-    ArrayType *varray = my_construct_array((wpLen - META_LEN)/2, sizeof(float8), FLOAT8OID);
-	wLen = my_parse_array_no_copy((struct varlena *)warray, 
-			sizeof(float8), (char **)&w);
-    vLen = my_parse_array_no_copy((struct varlena *)varray, 
-        sizeof(float8), (char **)&temp_v);
-
-	memcpy(w, wp + META_LEN, (wpLen - META_LEN)/2 * sizeof(float8));
-    memcpy(temp_v, wp + META_LEN + wLen, (wpLen - META_LEN)/2 * sizeof(float8));
+    warray = state_to_array(wp, wpLen, 0);
 #else
     //--------------------------------------------------------------------
     // 1. get model from shared memory
@@ -366,6 +572,10 @@ final(PG_FUNCTION_ARGS) {
     int32 mid = PG_GETARG_INT32(0);
     // model
     struct LinearModel* ptrSharedModel = (struct LinearModel*) get_model_by_mid(mid);
+    struct LinearModel modelBuffer;
+    // apply the pending shrinkage and scale
+    LinearModel_attach(&modelBuffer, ptrSharedModel);
+    LinearModel_scale(&modelBuffer);
 
     //--------------------------------------------------------------------
     // 2. construct a PG array to return and delete the shared memory
@@ -374,25 +584,98 @@ final(PG_FUNCTION_ARGS) {
 	warray = my_construct_array(wLen, sizeof(float8), FLOAT8OID);
 	wLen = my_parse_array_no_copy((struct varlena *)warray, 
 			sizeof(float8), (char **)&w);
-	memcpy(w, &(ptrSharedModel->w) + 1, wLen * sizeof(float8));
+	load_w(w, modelBuffer.w, wLen);
 
     vLen = ptrSharedModel->nDims;
     ArrayType *varray = my_construct_array(vLen, sizeof(float8), FLOAT8OID);
     vLen = my_parse_array_no_copy((struct varlena *)varray, 
             sizeof(float8), (char **)&temp_v);
-    memcpy(temp_v, &(ptrSharedModel->temp_v) + 1, vLen * sizeof(float8));
+    load_w(temp_v, modelBuffer.temp_v, vLen);
 
 	// delete the shared memory
-	int shmid = shmget(ftok("/", mid), 0, SHM_R | SHM_W);
-	if (shmid == -1) {	elog(ERROR, "In final, shmget failed!\n"); }
-	struct shmid_ds shm_buf;
-	if (shmctl(shmid, IPC_RMID, &shm_buf) == -1) {
-		elog(ERROR, "shmctl failed in final()");
-	}
+	remove_model_shmem(mid);
 #endif
     PG_RETURN_ARRAYTYPE_P(warray);
 }
 
+#ifdef VAGG
+/**
+ * gradient function over an internal state (PostgreSQL 9.0 or later)
+ *
+ * w+ is allocated once per scan in the aggregate memory context and
+ * updated in place, so no array is built or copied until final_state
+ */
+__attribute__((always_inline)) static inline Datum
+step_agg_buffer(FunctionCallInfo fcinfo, const int withLoss) {
+    struct AggBuffer *state = PG_ARGISNULL(0) ? NULL :
+            (struct AggBuffer *) PG_GETARG_POINTER(0);
+    // not strict, rows with nulls are skipped here
+    int i;
+    for (i = 1; i <= OLD_MODEL; i ++) {
+        if (PG_ARGISNULL(i)) {
+            if (state == NULL) { PG_RETURN_NULL(); }
+            PG_RETURN_POINTER(state);
+        }
+    }
+    // beginning of an epoch
+    if (state == NULL) {
+        double *initwp;
+        int initwpLen = my_parse_array_no_copy(PG_GETARG_RAW_VARLENA_P(OLD_MODEL), 
+                sizeof(float8), (char **) &initwp);
+        state = my_agg_buffer(fcinfo, state_len(initwp, initwpLen));
+		memcpy(state->data, initwp, initwpLen * sizeof(float8));
+		assert(state->data[6] == 0);
+    }
+    step_state(fcinfo, state->data, state->len, withLoss);
+    PG_RETURN_POINTER(state);
+}
+
+Datum
+grad_state(PG_FUNCTION_ARGS) {
+    return step_agg_buffer(fcinfo, 0);
+}
+
+/**
+ * final function over an internal state
+ */
+Datum
+final_state(PG_FUNCTION_ARGS) {
+    if (PG_ARGISNULL(0)) { PG_RETURN_NULL(); }
+    struct AggBuffer *state = (struct AggBuffer *) PG_GETARG_POINTER(0);
+    PG_RETURN_ARRAYTYPE_P(state_to_array(state->data, state->len, 0));
+}
+
+/**
+ * the fused aggregate: its steps also sum the loss of every row against
+ * the state before its step (progressive validation), and its final
+ * function returns {loss, w}, so an epoch needs no second scan for the loss
+ */
+Datum
+grad_loss(PG_FUNCTION_ARGS) {
+    PG_RETURN_ARRAYTYPE_P(step_array(fcinfo, 1));
+}
+
+Datum
+final_loss(PG_FUNCTION_ARGS) {
+    double *wp;
+    int wpLen = my_parse_array_no_copy(PG_GETARG_RAW_VARLENA_P(0), 
+            sizeof(float8), (char **) &wp);
+    PG_RETURN_ARRAYTYPE_P(state_to_array(wp, wpLen, 1));
+}
+
+Datum
+grad_loss_state(PG_FUNCTION_ARGS) {
+    return step_agg_buffer(fcinfo, 1);
+}
+
+Datum
+final_loss_state(PG_FUNCTION_ARGS) {
+    if (PG_ARGISNULL(0)) { PG_RETURN_NULL(); }
+    struct AggBuffer *state = (struct AggBuffer *) PG_GETARG_POINTER(0);
+    PG_RETURN_ARRAYTYPE_P(state_to_array(state->data, state->len, 1));
+}
+#endif
+
 /**
  * loss function
  */
@@ -403,9 +686,8 @@ loss(PG_FUNCTION_ARGS) {
     // 1. init a local LinearModel structure 
     // and get the weight vector from temp state
     //--------------------------------------------------------------------
-    ArrayType *wparray = (ArrayType *) PG_GETARG_RAW_VARLENA_P(0);
     double *wp;
-    int wpLen = my_parse_array_no_copy((struct varlena*) wparray, 
+    int wpLen = my_parse_array_cached(fcinfo, 0, 
             sizeof(float8), (char **) &wp);
     struct LinearModel modelBuffer;
     struct LinearModel *ptrModel;
@@ -413,13 +695,12 @@ loss(PG_FUNCTION_ARGS) {
     ptrModel = &modelBuffer;
     // init hyper parameters
     LinearModel_init(ptrModel, (int) wp[0], (int) wp[1], (int) wp[2], 
-            wp[3], wp[4], wp[5]);
+            wp[3], wp[10], wp[4], wp[5]);
+    ptrModel->wscale = wp[11];
 	// point to the weight vector
     int wLen = (wpLen - META_LEN)/2;
     ptrModel->w = wp + META_LEN;
     ptrModel->temp_v = wp + META_LEN + wLen;
-    // count
-    wp[6] ++;
     // elog(WARNING, "grad: count: %lf, nDims %d", ptrModel->w[ptrModel->nDims], ptrModel->nDims);
 #else
     //--------------------------------------------------------------------
@@ -430,14 +711,8 @@ loss(PG_FUNCTION_ARGS) {
     // model
     struct LinearModel modelBuffer;
     struct LinearModel* ptrModel = &modelBuffer;
-    static struct LinearModel* ptrSharedModel = NULL;
-    if (ptrSharedModel == NULL || ptrSharedModel->mid != mid) {
-        ptrSharedModel = (struct LinearModel*) get_model_by_mid(mid);
-        // elog(WARNING, "grad: NO");
-    }
-	*ptrModel = (*ptrSharedModel);
-	ptrModel->w = (double *) (&(ptrSharedModel->w) + 1);
-    ptrModel->temp_v = (double *) (&(ptrSharedModel->temp_v) + 1);
+    struct LinearModel* ptrSharedModel = (struct LinearModel*) get_model_by_mid(mid);
+	LinearModel_attach(ptrModel, ptrSharedModel);
 
 #endif
 
@@ -493,9 +768,8 @@ pred(PG_FUNCTION_ARGS) {
     // 1. init a local LinearModel structure 
     // and get the weight vector from temp state
     //--------------------------------------------------------------------
-    ArrayType *wparray = (ArrayType *) PG_GETARG_RAW_VARLENA_P(0);
     double *wp;
-    int wpLen = my_parse_array_no_copy((struct varlena*) wparray, 
+    int wpLen = my_parse_array_cached(fcinfo, 0, 
             sizeof(float8), (char **) &wp);
     struct LinearModel modelBuffer;
     struct LinearModel *ptrModel;
@@ -503,15 +777,14 @@ pred(PG_FUNCTION_ARGS) {
     ptrModel = &modelBuffer;
     // init hyper parameters
     LinearModel_init(ptrModel, (int) wp[0], (int) wp[1], (int) wp[2], 
-            wp[3], wp[4], wp[5]);
+            wp[3], wp[10], wp[4], wp[5]);
+    ptrModel->wscale = wp[11];
 	// point to the weight vector
 
     int wLen = (wpLen - META_LEN)/2;
 
     ptrModel->w = wp + META_LEN;
     ptrModel->temp_v = wp + META_LEN + wLen;
-    // count
-    wp[6] ++;
     // elog(WARNING, "grad: count: %lf, nDims %d", ptrModel->w[ptrModel->nDims], ptrModel->nDims);
 #else
     //--------------------------------------------------------------------
@@ -522,14 +795,8 @@ pred(PG_FUNCTION_ARGS) {
     // model
     struct LinearModel modelBuffer;
     struct LinearModel* ptrModel = &modelBuffer;
-    static struct LinearModel* ptrSharedModel = NULL;
-    if (ptrSharedModel == NULL || ptrSharedModel->mid != mid) {
-        ptrSharedModel = (struct LinearModel*) get_model_by_mid(mid);
-        // elog(WARNING, "grad: NO");
-    }
-	*ptrModel = (*ptrSharedModel);
-	ptrModel->w = (double *) (&(ptrSharedModel->w) + 1);
-    ptrModel->temp_v = (double *) (&(ptrSharedModel->temp_v) + 1);
+    struct LinearModel* ptrSharedModel = (struct LinearModel*) get_model_by_mid(mid);
+	LinearModel_attach(ptrModel, ptrSharedModel);
     #endif //We always read the model into shmem for prediction
 
     //--------------------------------------------------------------------
@@ -569,4 +836,69 @@ pred(PG_FUNCTION_ARGS) {
     PG_RETURN_FLOAT8(pred);
 }
 
+#ifndef VAGG
+/**
+ * gradient function that also returns the loss of the row against the
+ * model before its step, so an epoch gets its (progressive) loss in the
+ * same scan
+ */
+Datum
+grad_loss(PG_FUNCTION_ARGS) {
+    PG_RETURN_FLOAT8(step_shmem(fcinfo, 1));
+}
+
+/**
+ * lock contention of the shared model so far,
+ * {acquisitions, spin iterations, wait ns}
+ */
+Datum
+lock_stats(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    struct LinearModel modelBuffer;
+    struct LinearModel* ptrSharedModel = (struct LinearModel*) get_model_by_mid(mid);
+    LinearModel_attach(&modelBuffer, ptrSharedModel);
+    struct LockStats stats = LinearModel_lock_stats(&modelBuffer);
+
+    PG_RETURN_ARRAYTYPE_P(my_float8_array((double *) &stats, 3));
+}
+
+/**
+ * snapshot the shared model to a file, (mid, path, epochs done so far)
+ */
+Datum
+checkpoint(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    char *path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    int32 epoch = PG_GETARG_INT32(2);
+    struct LinearModel* ptrSharedModel = (struct LinearModel*) get_model_by_mid(mid);
+    checkpoint_model_shmem(mid, path, epoch, LinearModel_size(ptrSharedModel->nDims));
+
+    PG_RETURN_NULL();
+}
+
+/** size of a linear model region, for restore_model_shmem */
+static size_t
+checkpoint_size(const char *ptrModel) {
+    return LinearModel_size(((const struct LinearModel *) ptrModel)->nDims);
+}
 
+/**
+ * push the model of mid again from a checkpoint file, (mid, path);
+ * returns the epochs it had done
+ */
+Datum
+restore(PG_FUNCTION_ARGS) {
+    int32 mid = PG_GETARG_INT32(0);
+    char *path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    struct ModelCheckpoint head;
+    struct LinearModel* ptrModel = (struct LinearModel*) restore_model_shmem(mid, path, &head,
+            sizeof(struct LinearModel), checkpoint_size);
+    // the locks may have been held when it was taken
+    spin_lock_init(&(ptrModel->lock));
+    if (ptrModel->nStripes > 0) {
+        LinearModel_init_stripes(ptrModel);
+    }
+
+    PG_RETURN_INT32(head.epoch);
+}
+#endif
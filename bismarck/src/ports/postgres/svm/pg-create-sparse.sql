@@ -0,0 +1,60 @@
+/*
+Copyright 2012 Xixuan (Aaron) Feng and Arun Kumar and Christopher Re
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+--------------------------------------------------------------------------
+-- for UDA version, PostgreSQL 9.0 or later only
+--
+-- replaces the aggregate of create-sparse.sql by one over an internal state
+-- that is updated in place for the whole scan. Greenplum keeps the array
+-- state, which its PREFUNC can merge across segments.
+--------------------------------------------------------------------------
+DROP AGGREGATE IF EXISTS sparse_svm_agg(integer[], double precision[], integer, double precision[]) CASCADE;
+DROP FUNCTION IF EXISTS sparse_svm_transit_state(internal, integer[], double precision[], integer, double precision[]) CASCADE;
+DROP FUNCTION IF EXISTS sparse_svm_final_state(internal) CASCADE;
+
+CREATE FUNCTION sparse_svm_transit_state(internal, integer[], double precision[], integer, double precision[])
+RETURNS internal
+AS 'sparse-svm-agg', 'grad_state'
+LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION sparse_svm_final_state(internal)
+RETURNS double precision[]
+AS 'sparse-svm-agg', 'final_state'
+LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE sparse_svm_agg(integer[], double precision[], integer, double precision[]) (
+	STYPE = internal,
+	FINALFUNC = sparse_svm_final_state,
+	SFUNC = sparse_svm_transit_state);
+
+DROP AGGREGATE IF EXISTS sparse_svm_fused_agg(integer[], double precision[], integer, double precision[]) CASCADE;
+DROP FUNCTION IF EXISTS sparse_svm_transit_loss_state(internal, integer[], double precision[], integer, double precision[]) CASCADE;
+DROP FUNCTION IF EXISTS sparse_svm_final_loss_state(internal) CASCADE;
+
+CREATE FUNCTION sparse_svm_transit_loss_state(internal, integer[], double precision[], integer, double precision[])
+RETURNS internal
+AS 'sparse-svm-agg', 'grad_loss_state'
+LANGUAGE C IMMUTABLE;
+
+CREATE FUNCTION sparse_svm_final_loss_state(internal)
+RETURNS double precision[]
+AS 'sparse-svm-agg', 'final_loss_state'
+LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE sparse_svm_fused_agg(integer[], double precision[], integer, double precision[]) (
+	STYPE = internal,
+	FINALFUNC = sparse_svm_final_loss_state,
+	SFUNC = sparse_svm_transit_loss_state);
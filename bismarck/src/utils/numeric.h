@@ -23,23 +23,18 @@ limitations under the License.
 #include <arpa/inet.h>
 #include <time.h>
 
+#include "utils/numeric_simd.h"
+#include "utils/spinlock.h"
+
 /**
  * function definitions
  */
 
 inline void
 ball_project(double*  x, const int size, const double B, const double B2) {
-	double norm_square = 0.0;
-	int i;
-	for(i = size - 1; i >= 0; i --) {
-		norm_square += x[i]*x[i];
-	}
+	double norm_square = numeric_kernels.norm(x, size);
 	if(norm_square > B2) {
-		double norm = sqrt(norm_square);
-		int j;
-		for(j = size - 1; j >= 0; j --) {
-			x[j] *= B / norm;
-		}
+		numeric_kernels.scale_i(x, size, B / sqrt(norm_square));
 	}
 }
 
@@ -62,7 +57,7 @@ add_vector_dss(double *x, const int *k, double *temp, const int sparseSize){
 }
 
 inline void 
-scale_dot(double *x, int scalor, const int n){
+scale_dot(double *x, const double scalor, const int n){
   int i;
   for(i = n-1; i>=0; i--){
     x[i] = x[i] * scalor;
@@ -71,7 +66,7 @@ scale_dot(double *x, int scalor, const int n){
 }
 
 inline void
-scale_dot_dss(double *x, const int *k, int scalor, const int sparseSize){
+scale_dot_dss(double *x, const int *k, const double scalor, const int sparseSize){
   int i;
   for(i = sparseSize -1; i >= 0; i--){
     x[k[i]] = x[k[i]] * scalor;
@@ -80,30 +75,17 @@ scale_dot_dss(double *x, const int *k, int scalor, const int sparseSize){
 
 inline double
 dot(const double* x, const double* y, const int size) {
-  double ret = 0.0;
-  int i;
-  for(i = size - 1; i >= 0; i--) {
-    ret += x[i]*y[i];
-  }
-  return ret;
+  return numeric_kernels.dot(x, y, size);
 }
 
 inline double
 dot_dss(const double* x, const int* k, const double* v, const int sparseSize) {
-  double ret = 0.0;
-  int i;
-  for(i = sparseSize - 1; i >= 0; i--) {
-    ret += x[k[i]]*v[i];
-  }
-  return ret;
+  return SPARSE_KERNELS(sparseSize)->dot_dss(x, k, v, sparseSize);
 }
 
 inline void
 add_and_scale(double* x, const int size, const double* y, const double c) {
-  int i;
-  for(i = size - 1; i >= 0; i--) {
-    x[i] += y[i]*c;
-  }
+  numeric_kernels.add_and_scale(x, size, y, c);
 }
 
 inline void
@@ -116,28 +98,17 @@ add_c_dss(double* x, const int* k, const int sparseSize, const double c) {
 
 inline void
 add_and_scale_dss(double* x, const int* k, const double* v, const int sparseSize, const double c) {
-  int i;
-  for(i = sparseSize - 1; i >= 0; i--) {
-    x[k[i]] += v[i]*c;
-  }
+  SPARSE_KERNELS(sparseSize)->add_and_scale_dss(x, k, v, sparseSize, c);
 }
 
 inline void
 scale_i(double* x, const int size, const double c) {
-  int i;
-  for(i = size - 1; i >= 0; i --) {
-    x[i] *= c;
-  }
+  numeric_kernels.scale_i(x, size, c);
 }
 
 inline double
 norm(const double *x, const int size) {
-  double norm = 0;
-  int i;
-  for(i = size - 1; i >= 0; i --) {
-    norm += x[i] * x[i];
-  }
-  return norm;
+  return numeric_kernels.norm(x, size);
 }
 
 inline double
@@ -148,12 +119,7 @@ sigma(const double v) {
 
 inline void
 l1_shrink_mask(double* x, const double u, const int* k, const int sparseSize) {
-  int i;
-  for(i = sparseSize-1; i >= 0; i--) {
-    if (x[k[i]] > u) { x[k[i]] -= u; }
-    else if (x[k[i]] < -u) { x[k[i]] += u; }
-    else { x[k[i]] = 0; }
-  }
+  SPARSE_KERNELS(sparseSize)->l1_shrink_mask(x, u, k, sparseSize);
 }
 
 inline void
@@ -167,16 +133,198 @@ l2_shrink_mask_d(double* x, const double u, const int size) {
 
 inline void
 l1_shrink_mask_d(double* x, const double u, const int size) {
+  numeric_kernels.l1_shrink_mask_d(x, u, size);
+}
+
+/**
+ * kernels over stored model weights, of type weight_t
+ *
+ * built with -DW_FLOAT4 the weights of a shared-memory model are kept in
+ * single precision, halving the bytes a step gathers and scatters, while
+ * products and sums are still done in double. KERNEL_W names the kernel
+ * of numeric_kernels for weight_t, the float one (*_f) or the double one.
+ */
+#ifdef W_FLOAT4
+typedef float weight_t;
+#define KERNEL_W(f) f##_f
+#else
+typedef double weight_t;
+#define KERNEL_W(f) f
+#endif
+
+inline double
+dot_w(const weight_t* x, const double* y, const int size) {
+  return numeric_kernels.KERNEL_W(dot)(x, y, size);
+}
+
+inline double
+dot_ww(const weight_t* x, const weight_t* y, const int size) {
+#ifdef W_FLOAT4
   int i;
-  double xi = 0.0;
-  for(i = size-1; i >= 0; i--) {
-    xi = x[i];
-    if (xi > u)		  { x[i] -= u; }
-    else if (xi > -u) { x[i] += u; }
-    else			  { x[i] = 0.0; }
-    //if (x[i] > u) { x[i] -= u; }
-    //else if (x[i] < -u) { x[i] += u; }
-    //else { x[i] = 0; }
+  double ret = 0.0;
+  for(i = 0; i < size; i++) {
+    ret += (double) x[i] * y[i];
+  }
+  return ret;
+#else
+  return numeric_kernels.dot(x, y, size);
+#endif
+}
+
+inline double
+dot_dss_w(const weight_t* x, const int* k, const double* v, const int sparseSize) {
+  return SPARSE_KERNELS(sparseSize)->KERNEL_W(dot_dss)(x, k, v, sparseSize);
+}
+
+inline void
+add_and_scale_w(weight_t* x, const int size, const double* y, const double c) {
+  numeric_kernels.KERNEL_W(add_and_scale)(x, size, y, c);
+}
+
+inline void
+add_and_scale_ww(weight_t* x, const int size, const weight_t* y, const double c) {
+#ifdef W_FLOAT4
+  int i;
+  for(i = 0; i < size; i++) {
+    x[i] = x[i] + c * y[i];
+  }
+#else
+  numeric_kernels.add_and_scale(x, size, y, c);
+#endif
+}
+
+inline void
+add_and_scale_dss_w(weight_t* x, const int* k, const double* v, const int sparseSize, const double c) {
+  SPARSE_KERNELS(sparseSize)->KERNEL_W(add_and_scale_dss)(x, k, v, sparseSize, c);
+}
+
+inline void
+scale_dot_dss_w(weight_t *x, const int *k, const double scalor, const int sparseSize) {
+  int i;
+  for(i = sparseSize - 1; i >= 0; i--) {
+    x[k[i]] = x[k[i]] * scalor;
+  }
+}
+
+inline void
+scale_i_w(weight_t* x, const int size, const double c) {
+  numeric_kernels.KERNEL_W(scale_i)(x, size, c);
+}
+
+inline void
+ball_project_w(weight_t* x, const int size, const double B, const double B2) {
+  double norm_square = dot_ww(x, x, size);
+  if(norm_square > B2) {
+    scale_i_w(x, size, B / sqrt(norm_square));
+  }
+}
+
+inline void
+l1_shrink_mask_d_w(weight_t* x, const double u, const int size) {
+  numeric_kernels.KERNEL_W(l1_shrink_mask_d)(x, u, size);
+}
+
+/**
+ * lazy soft threshold: x[j] is shrunk by the u accumulated since stamp[j]
+ * (clock - stamp[j]) and stamped with clock; for the sparse indices k,
+ * for the nonzeros of a dense v, or for every element. a stamp ahead of
+ * clock (a concurrent writer got there first) is left alone
+ */
+inline void
+l1_shrink_lazy_w(weight_t* x, double* stamp, const double clock, const int* k, const int sparseSize) {
+  int i, j;
+  double u;
+  for(i = 0; i < sparseSize; i++) {
+    j = k[i];
+    u = clock - stamp[j];
+    if (u <= 0) { continue; }
+    if (x[j] > u) { x[j] -= u; }
+    else if (x[j] < -u) { x[j] += u; }
+    else { x[j] = 0; }
+    stamp[j] = clock;
+  }
+}
+
+inline void
+l1_shrink_lazy_nz_w(weight_t* x, double* stamp, const double clock, const double* v, const int size) {
+  int j;
+  double u;
+  for(j = 0; j < size; j++) {
+    if (v[j] == 0.0) { continue; }
+    u = clock - stamp[j];
+    if (u <= 0) { continue; }
+    if (x[j] > u) { x[j] -= u; }
+    else if (x[j] < -u) { x[j] += u; }
+    else { x[j] = 0; }
+    stamp[j] = clock;
+  }
+}
+
+inline void
+l1_shrink_lazy_d_w(weight_t* x, double* stamp, const double clock, const int size) {
+  int j;
+  double u;
+  for(j = 0; j < size; j++) {
+    u = clock - stamp[j];
+    if (u <= 0) { continue; }
+    if (x[j] > u) { x[j] -= u; }
+    else if (x[j] < -u) { x[j] += u; }
+    else { x[j] = 0; }
+    stamp[j] = clock;
+  }
+}
+
+/* doubles of x kept hot while a batch of rows streams past */
+#define BATCH_BLOCK (512)
+
+/**
+ * out[b] = x . Y[b] for the n rows of Y (n x size, row-major),
+ * reading x once per batch instead of once per row
+ */
+inline void
+dot_batch_w(const weight_t* x, const double* Y, const int n, const int size, double* out) {
+  int b, j, len;
+  for(b = 0; b < n; b++) {
+    out[b] = 0.0;
+  }
+  for(j = 0; j < size; j += BATCH_BLOCK) {
+    len = (size - j < BATCH_BLOCK) ? size - j : BATCH_BLOCK;
+    for(b = 0; b < n; b++) {
+      out[b] += dot_w(x + j, Y + b * size + j, len);
+    }
+  }
+}
+
+/**
+ * x += sum_b c[b] * Y[b] for the n rows of Y (n x size, row-major),
+ * writing x once per batch instead of once per row
+ */
+inline void
+add_and_scale_batch_w(weight_t* x, const double* Y, const int n, const int size, const double* c) {
+  int b, j, len;
+  for(j = 0; j < size; j += BATCH_BLOCK) {
+    len = (size - j < BATCH_BLOCK) ? size - j : BATCH_BLOCK;
+    for(b = 0; b < n; b++) {
+      if (c[b] == 0.0) { continue; }
+      add_and_scale_w(x + j, len, Y + b * size + j, c[b]);
+    }
+  }
+}
+
+/* x = y, converting to and from the stored precision */
+inline void
+store_w(weight_t* x, const double* y, const int size) {
+  int i;
+  for(i = 0; i < size; i++) {
+    x[i] = y[i];
+  }
+}
+
+inline void
+load_w(double* x, const weight_t* y, const int size) {
+  int i;
+  for(i = 0; i < size; i++) {
+    x[i] = y[i];
   }
 }
 
@@ -212,19 +360,52 @@ log_sum(const double a, const double b) {
 	return a + log(1.0 + exp(b - a));
 }
 
-/* atomic operation compareandswap */
-inline unsigned char 
-compare_and_swap (volatile int* ptr, int oldvar, int newvar) {
-	unsigned char result;
-	__asm__ __volatile__ (
-			"lock; cmpxchg %3, %1\n"
-			"sete %b0\n"
-			: "=r"(result),
-			  "+m"(*ptr),
-			  "+a"(oldvar)
-			: "r"(newvar)
-			: "memory", "cc"
-			);
-	return result;
+/* log sum_i exp(x[i]) */
+inline double
+log_sum_exp(const double* x, const int size) {
+	double m = x[0], s = 0.0;
+	int i;
+	for (i = 1; i < size; i++) {
+		if (x[i] > m) { m = x[i]; }
+	}
+	for (i = 0; i < size; i++) {
+		s += exp(x[i] - m);
+	}
+	return m + log(s);
+}
+
+/* log domain vector-matrix and matrix-vector products, M is n x n */
+inline void
+log_vm(const double* a, const double* M, const int n, double* out) {
+	numeric_kernels.log_vm(a, M, n, out);
+}
+
+inline void
+log_mv(const double* M, const double* b, const int n, double* out) {
+	numeric_kernels.log_mv(M, b, n, out);
+}
+
+inline void
+exp_i(double* x, const int size) {
+	numeric_kernels.exp_i(x, size);
+}
+
+/* atomic x += y and x *= y on a double shared between processes */
+inline void
+atomic_add_double(double* x, const double y) {
+	double oldvar = *x, newvar;
+	do {
+		newvar = oldvar + y;
+	} while (!__atomic_compare_exchange(x, &oldvar, &newvar, 0, 
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+inline void
+atomic_scale_double(double* x, const double y) {
+	double oldvar = *x, newvar;
+	do {
+		newvar = oldvar * y;
+	} while (!__atomic_compare_exchange(x, &oldvar, &newvar, 0, 
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
 }
 
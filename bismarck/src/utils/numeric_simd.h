@@ -0,0 +1,1028 @@
+/*
+Copyright 2012 Xixuan (Aaron) Feng and Arun Kumar and Christopher Re
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef NUMERIC_SIMD_H
+#define NUMERIC_SIMD_H
+
+/**
+ * dense vector kernels with scalar, SSE2, AVX2 and AVX-512 implementations,
+ * and sparse (dense x indexed sparse) kernels with scalar, AVX2 gather
+ * and AVX-512 gather/scatter implementations.
+ *
+ * every variant is compiled into the same object through target attributes,
+ * so no -m flags are needed; the widest one the host supports is picked
+ * once by numeric_kernels_init() when the .so is loaded.
+ *
+ * the sparse kernels assume the indices k[] of one vector are distinct,
+ * as they are for every sparse feature vector bismarck stores. below
+ * SPARSE_GATHER_MIN nonzeros the wrappers in numeric.h run the scalar
+ * ones, the gathers only pay off on longer vectors.
+ *
+ * the float kernels (*_f) are for weights stored in single precision
+ * (-DW_FLOAT4): x is loaded and stored as float, while the products and
+ * sums are done in double as in the kernels over double weights.
+ *
+ * the log domain kernels run the crf trellis: a log-sum-exp over each
+ * row or column of a Y x Y block, with the max subtracted first so only
+ * one exp per element and one log per output is needed.
+ */
+
+/* nonzeros from which the gather kernels beat scalar (bench/sparse_kernels) */
+#define SPARSE_GATHER_MIN (128)
+
+/* the kernels for a sparse vector of n nonzeros */
+#define SPARSE_KERNELS(n) \
+	((n) < SPARSE_GATHER_MIN ? &numeric_scalar_kernels : &numeric_kernels)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NUMERIC_X86
+#include <immintrin.h>
+#endif
+
+/** a table of dense and sparse kernels, filled at load time */
+struct NumericKernels {
+	const char *name;
+	double (*dot)(const double *x, const double *y, const int size);
+	void   (*add_and_scale)(double *x, const int size, const double *y, const double c);
+	void   (*scale_i)(double *x, const int size, const double c);
+	double (*norm)(const double *x, const int size);
+	void   (*l1_shrink_mask_d)(double *x, const double u, const int size);
+	// sparse
+	const char *sparse_name;
+	double (*dot_dss)(const double *x, const int *k, const double *v, const int sparseSize);
+	void   (*add_and_scale_dss)(double *x, const int *k, const double *v, const int sparseSize, const double c);
+	void   (*l1_shrink_mask)(double *x, const double u, const int *k, const int sparseSize);
+	// log domain
+	const char *log_name;
+	void   (*log_vm)(const double *a, const double *M, const int n, double *out);
+	void   (*log_mv)(const double *M, const double *b, const int n, double *out);
+	void   (*exp_i)(double *x, const int size);
+	// float weights, dense with name and sparse with sparse_name
+	double (*dot_f)(const float *x, const double *y, const int size);
+	void   (*add_and_scale_f)(float *x, const int size, const double *y, const double c);
+	void   (*scale_i_f)(float *x, const int size, const double c);
+	void   (*l1_shrink_mask_d_f)(float *x, const double u, const int size);
+	double (*dot_dss_f)(const float *x, const int *k, const double *v, const int sparseSize);
+	void   (*add_and_scale_dss_f)(float *x, const int *k, const double *v, const int sparseSize, const double c);
+};
+
+/**
+ * scalar fallback
+ */
+
+static double
+dot_scalar(const double *x, const double *y, const int size) {
+	double ret = 0.0;
+	int i;
+	for (i = 0; i < size; i++) {
+		ret += x[i]*y[i];
+	}
+	return ret;
+}
+
+static void
+add_and_scale_scalar(double *x, const int size, const double *y, const double c) {
+	int i;
+	for (i = 0; i < size; i++) {
+		x[i] += y[i]*c;
+	}
+}
+
+static void
+scale_i_scalar(double *x, const int size, const double c) {
+	int i;
+	for (i = 0; i < size; i++) {
+		x[i] *= c;
+	}
+}
+
+static double
+norm_scalar(const double *x, const int size) {
+	double ret = 0.0;
+	int i;
+	for (i = 0; i < size; i++) {
+		ret += x[i]*x[i];
+	}
+	return ret;
+}
+
+static void
+l1_shrink_mask_d_scalar(double *x, const double u, const int size) {
+	int i;
+	for (i = 0; i < size; i++) {
+		if (x[i] > u)		{ x[i] -= u; }
+		else if (x[i] < -u)	{ x[i] += u; }
+		else				{ x[i] = 0.0; }
+	}
+}
+
+static double
+dot_dss_scalar(const double *x, const int *k, const double *v, const int sparseSize) {
+	double ret = 0.0;
+	int i;
+	for (i = 0; i < sparseSize; i++) {
+		ret += x[k[i]]*v[i];
+	}
+	return ret;
+}
+
+static void
+add_and_scale_dss_scalar(double *x, const int *k, const double *v, const int sparseSize, const double c) {
+	int i;
+	for (i = 0; i < sparseSize; i++) {
+		x[k[i]] += v[i]*c;
+	}
+}
+
+static void
+l1_shrink_mask_scalar(double *x, const double u, const int *k, const int sparseSize) {
+	int i;
+	for (i = 0; i < sparseSize; i++) {
+		if (x[k[i]] > u)		{ x[k[i]] -= u; }
+		else if (x[k[i]] < -u)	{ x[k[i]] += u; }
+		else					{ x[k[i]] = 0.0; }
+	}
+}
+
+static double
+dot_f_scalar(const float *x, const double *y, const int size) {
+	double ret = 0.0;
+	int i;
+	for (i = 0; i < size; i++) {
+		ret += x[i]*y[i];
+	}
+	return ret;
+}
+
+static void
+add_and_scale_f_scalar(float *x, const int size, const double *y, const double c) {
+	int i;
+	for (i = 0; i < size; i++) {
+		x[i] = x[i] + y[i]*c;
+	}
+}
+
+static void
+scale_i_f_scalar(float *x, const int size, const double c) {
+	int i;
+	for (i = 0; i < size; i++) {
+		x[i] = x[i] * c;
+	}
+}
+
+static void
+l1_shrink_mask_d_f_scalar(float *x, const double u, const int size) {
+	int i;
+	for (i = 0; i < size; i++) {
+		if (x[i] > u)		{ x[i] = x[i] - u; }
+		else if (x[i] < -u)	{ x[i] = x[i] + u; }
+		else				{ x[i] = 0.0f; }
+	}
+}
+
+static double
+dot_dss_f_scalar(const float *x, const int *k, const double *v, const int sparseSize) {
+	double ret = 0.0;
+	int i;
+	for (i = 0; i < sparseSize; i++) {
+		ret += x[k[i]]*v[i];
+	}
+	return ret;
+}
+
+static void
+add_and_scale_dss_f_scalar(float *x, const int *k, const double *v, const int sparseSize, const double c) {
+	int i;
+	for (i = 0; i < sparseSize; i++) {
+		x[k[i]] = x[k[i]] + v[i]*c;
+	}
+}
+
+/**
+ * out[y] = log sum_yp exp(a[yp] + M[yp][y]), M is n x n row-major
+ */
+static void
+log_vm_scalar(const double *a, const double *M, const int n, double *out) {
+	double m[n], s[n];
+	int y, yp;
+	for (y = 0; y < n; y++) {
+		m[y] = a[0] + M[y];
+		s[y] = 0.0;
+	}
+	for (yp = 1; yp < n; yp++) {
+		for (y = 0; y < n; y++) {
+			double v = a[yp] + M[yp * n + y];
+			if (v > m[y]) { m[y] = v; }
+		}
+	}
+	for (yp = 0; yp < n; yp++) {
+		for (y = 0; y < n; y++) {
+			s[y] += exp(a[yp] + M[yp * n + y] - m[y]);
+		}
+	}
+	for (y = 0; y < n; y++) {
+		out[y] = m[y] + log(s[y]);
+	}
+}
+
+/**
+ * out[yp] = log sum_y exp(M[yp][y] + b[y]), M is n x n row-major
+ */
+static void
+log_mv_scalar(const double *M, const double *b, const int n, double *out) {
+	int y, yp;
+	for (yp = 0; yp < n; yp++) {
+		const double *row = M + yp * n;
+		double m = row[0] + b[0], s = 0.0;
+		for (y = 1; y < n; y++) {
+			if (row[y] + b[y] > m) { m = row[y] + b[y]; }
+		}
+		for (y = 0; y < n; y++) {
+			s += exp(row[y] + b[y] - m);
+		}
+		out[yp] = m + log(s);
+	}
+}
+
+static void
+exp_i_scalar(double *x, const int size) {
+	int i;
+	for (i = 0; i < size; i++) {
+		x[i] = exp(x[i]);
+	}
+}
+
+#ifdef NUMERIC_X86
+
+/**
+ * SSE2, 2 lanes
+ */
+
+__attribute__((target("sse2"))) static double
+dot_sse2(const double *x, const double *y, const int size) {
+	__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+	double ret[2];
+	int i = 0;
+	for (; i + 4 <= size; i += 4) {
+		acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+		acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+	}
+	_mm_storeu_pd(ret, _mm_add_pd(acc0, acc1));
+	ret[0] += ret[1];
+	for (; i < size; i++) {
+		ret[0] += x[i]*y[i];
+	}
+	return ret[0];
+}
+
+__attribute__((target("sse2"))) static void
+add_and_scale_sse2(double *x, const int size, const double *y, const double c) {
+	__m128d vc = _mm_set1_pd(c);
+	int i = 0;
+	for (; i + 2 <= size; i += 2) {
+		_mm_storeu_pd(x + i, _mm_add_pd(_mm_loadu_pd(x + i),
+					_mm_mul_pd(_mm_loadu_pd(y + i), vc)));
+	}
+	for (; i < size; i++) {
+		x[i] += y[i]*c;
+	}
+}
+
+__attribute__((target("sse2"))) static void
+scale_i_sse2(double *x, const int size, const double c) {
+	__m128d vc = _mm_set1_pd(c);
+	int i = 0;
+	for (; i + 2 <= size; i += 2) {
+		_mm_storeu_pd(x + i, _mm_mul_pd(_mm_loadu_pd(x + i), vc));
+	}
+	for (; i < size; i++) {
+		x[i] *= c;
+	}
+}
+
+__attribute__((target("sse2"))) static double
+norm_sse2(const double *x, const int size) {
+	__m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+	double ret[2];
+	int i = 0;
+	for (; i + 4 <= size; i += 4) {
+		__m128d a = _mm_loadu_pd(x + i), b = _mm_loadu_pd(x + i + 2);
+		acc0 = _mm_add_pd(acc0, _mm_mul_pd(a, a));
+		acc1 = _mm_add_pd(acc1, _mm_mul_pd(b, b));
+	}
+	_mm_storeu_pd(ret, _mm_add_pd(acc0, acc1));
+	ret[0] += ret[1];
+	for (; i < size; i++) {
+		ret[0] += x[i]*x[i];
+	}
+	return ret[0];
+}
+
+/* branch free soft threshold: max(x - u, 0) + min(x + u, 0), for u >= 0 */
+__attribute__((target("sse2"))) static void
+l1_shrink_mask_d_sse2(double *x, const double u, const int size) {
+	__m128d vu = _mm_set1_pd(u), zero = _mm_setzero_pd();
+	int i = 0;
+	for (; i + 2 <= size; i += 2) {
+		__m128d a = _mm_loadu_pd(x + i);
+		_mm_storeu_pd(x + i, _mm_add_pd(_mm_max_pd(_mm_sub_pd(a, vu), zero),
+					_mm_min_pd(_mm_add_pd(a, vu), zero)));
+	}
+	l1_shrink_mask_d_scalar(x + i, u, size - i);
+}
+
+/**
+ * AVX2 + FMA, 4 lanes
+ */
+
+__attribute__((target("avx2,fma"))) static double
+dot_avx2(const double *x, const double *y, const int size) {
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+	double ret[4];
+	int i = 0;
+	for (; i + 8 <= size; i += 8) {
+		acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), acc0);
+		acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4), acc1);
+	}
+	if (i + 4 <= size) {
+		acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), acc0);
+		i += 4;
+	}
+	_mm256_storeu_pd(ret, _mm256_add_pd(acc0, acc1));
+	ret[0] += ret[1] + ret[2] + ret[3];
+	for (; i < size; i++) {
+		ret[0] += x[i]*y[i];
+	}
+	return ret[0];
+}
+
+__attribute__((target("avx2,fma"))) static void
+add_and_scale_avx2(double *x, const int size, const double *y, const double c) {
+	__m256d vc = _mm256_set1_pd(c);
+	int i = 0;
+	for (; i + 4 <= size; i += 4) {
+		_mm256_storeu_pd(x + i, _mm256_fmadd_pd(_mm256_loadu_pd(y + i), vc,
+					_mm256_loadu_pd(x + i)));
+	}
+	for (; i < size; i++) {
+		x[i] += y[i]*c;
+	}
+}
+
+__attribute__((target("avx2,fma"))) static void
+scale_i_avx2(double *x, const int size, const double c) {
+	__m256d vc = _mm256_set1_pd(c);
+	int i = 0;
+	for (; i + 4 <= size; i += 4) {
+		_mm256_storeu_pd(x + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), vc));
+	}
+	for (; i < size; i++) {
+		x[i] *= c;
+	}
+}
+
+__attribute__((target("avx2,fma"))) static double
+norm_avx2(const double *x, const int size) {
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+	double ret[4];
+	int i = 0;
+	for (; i + 8 <= size; i += 8) {
+		__m256d a = _mm256_loadu_pd(x + i), b = _mm256_loadu_pd(x + i + 4);
+		acc0 = _mm256_fmadd_pd(a, a, acc0);
+		acc1 = _mm256_fmadd_pd(b, b, acc1);
+	}
+	if (i + 4 <= size) {
+		__m256d a = _mm256_loadu_pd(x + i);
+		acc0 = _mm256_fmadd_pd(a, a, acc0);
+		i += 4;
+	}
+	_mm256_storeu_pd(ret, _mm256_add_pd(acc0, acc1));
+	ret[0] += ret[1] + ret[2] + ret[3];
+	for (; i < size; i++) {
+		ret[0] += x[i]*x[i];
+	}
+	return ret[0];
+}
+
+__attribute__((target("avx2,fma"))) static void
+l1_shrink_mask_d_avx2(double *x, const double u, const int size) {
+	__m256d vu = _mm256_set1_pd(u), zero = _mm256_setzero_pd();
+	int i = 0;
+	for (; i + 4 <= size; i += 4) {
+		__m256d a = _mm256_loadu_pd(x + i);
+		_mm256_storeu_pd(x + i, _mm256_add_pd(
+					_mm256_max_pd(_mm256_sub_pd(a, vu), zero),
+					_mm256_min_pd(_mm256_add_pd(a, vu), zero)));
+	}
+	l1_shrink_mask_d_scalar(x + i, u, size - i);
+}
+
+/**
+ * AVX-512F, 8 lanes, masked tails
+ */
+
+__attribute__((target("avx512f"))) static double
+dot_avx512(const double *x, const double *y, const int size) {
+	__m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+	int i = 0;
+	for (; i + 16 <= size; i += 16) {
+		acc0 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i), acc0);
+		acc1 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i + 8), _mm512_loadu_pd(y + i + 8), acc1);
+	}
+	for (; i < size; i += 8) {
+		__mmask8 m = (size - i >= 8) ? 0xFF : (__mmask8) ((1u << (size - i)) - 1);
+		acc0 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, x + i),
+				_mm512_maskz_loadu_pd(m, y + i), acc0);
+	}
+	return _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+}
+
+__attribute__((target("avx512f"))) static void
+add_and_scale_avx512(double *x, const int size, const double *y, const double c) {
+	__m512d vc = _mm512_set1_pd(c);
+	int i;
+	for (i = 0; i < size; i += 8) {
+		__mmask8 m = (size - i >= 8) ? 0xFF : (__mmask8) ((1u << (size - i)) - 1);
+		_mm512_mask_storeu_pd(x + i, m, _mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, y + i),
+					vc, _mm512_maskz_loadu_pd(m, x + i)));
+	}
+}
+
+__attribute__((target("avx512f"))) static void
+scale_i_avx512(double *x, const int size, const double c) {
+	__m512d vc = _mm512_set1_pd(c);
+	int i;
+	for (i = 0; i < size; i += 8) {
+		__mmask8 m = (size - i >= 8) ? 0xFF : (__mmask8) ((1u << (size - i)) - 1);
+		_mm512_mask_storeu_pd(x + i, m, _mm512_mul_pd(_mm512_maskz_loadu_pd(m, x + i), vc));
+	}
+}
+
+__attribute__((target("avx512f"))) static double
+norm_avx512(const double *x, const int size) {
+	__m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+	int i = 0;
+	for (; i + 16 <= size; i += 16) {
+		__m512d a = _mm512_loadu_pd(x + i), b = _mm512_loadu_pd(x + i + 8);
+		acc0 = _mm512_fmadd_pd(a, a, acc0);
+		acc1 = _mm512_fmadd_pd(b, b, acc1);
+	}
+	for (; i < size; i += 8) {
+		__mmask8 m = (size - i >= 8) ? 0xFF : (__mmask8) ((1u << (size - i)) - 1);
+		__m512d a = _mm512_maskz_loadu_pd(m, x + i);
+		acc0 = _mm512_fmadd_pd(a, a, acc0);
+	}
+	return _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+}
+
+__attribute__((target("avx512f"))) static void
+l1_shrink_mask_d_avx512(double *x, const double u, const int size) {
+	__m512d vu = _mm512_set1_pd(u), zero = _mm512_setzero_pd();
+	int i;
+	for (i = 0; i < size; i += 8) {
+		__mmask8 m = (size - i >= 8) ? 0xFF : (__mmask8) ((1u << (size - i)) - 1);
+		__m512d a = _mm512_maskz_loadu_pd(m, x + i);
+		_mm512_mask_storeu_pd(x + i, m, _mm512_add_pd(
+					_mm512_max_pd(_mm512_sub_pd(a, vu), zero),
+					_mm512_min_pd(_mm512_add_pd(a, vu), zero)));
+	}
+}
+
+/**
+ * AVX2 gathers (vgatherdpd); AVX2 has no scatter, so stores stay scalar
+ */
+
+__attribute__((target("avx2,fma"))) static double
+dot_dss_avx2(const double *x, const int *k, const double *v, const int sparseSize) {
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+	double ret[4];
+	int i = 0;
+	for (; i + 8 <= sparseSize; i += 8) {
+		__m256d x0 = _mm256_i32gather_pd(x, _mm_loadu_si128((const __m128i *) (k + i)), 8);
+		__m256d x1 = _mm256_i32gather_pd(x, _mm_loadu_si128((const __m128i *) (k + i + 4)), 8);
+		acc0 = _mm256_fmadd_pd(x0, _mm256_loadu_pd(v + i), acc0);
+		acc1 = _mm256_fmadd_pd(x1, _mm256_loadu_pd(v + i + 4), acc1);
+	}
+	_mm256_storeu_pd(ret, _mm256_add_pd(acc0, acc1));
+	ret[0] += ret[1] + ret[2] + ret[3];
+	for (; i < sparseSize; i++) {
+		ret[0] += x[k[i]]*v[i];
+	}
+	return ret[0];
+}
+
+__attribute__((target("avx2,fma"))) static void
+add_and_scale_dss_avx2(double *x, const int *k, const double *v, const int sparseSize, const double c) {
+	__m256d vc = _mm256_set1_pd(c);
+	double r[4];
+	int i = 0;
+	for (; i + 4 <= sparseSize; i += 4) {
+		__m256d xk = _mm256_i32gather_pd(x, _mm_loadu_si128((const __m128i *) (k + i)), 8);
+		_mm256_storeu_pd(r, _mm256_fmadd_pd(_mm256_loadu_pd(v + i), vc, xk));
+		x[k[i]] = r[0];
+		x[k[i + 1]] = r[1];
+		x[k[i + 2]] = r[2];
+		x[k[i + 3]] = r[3];
+	}
+	add_and_scale_dss_scalar(x, k + i, v + i, sparseSize - i, c);
+}
+
+__attribute__((target("avx2,fma"))) static void
+l1_shrink_mask_avx2(double *x, const double u, const int *k, const int sparseSize) {
+	__m256d vu = _mm256_set1_pd(u), zero = _mm256_setzero_pd();
+	double r[4];
+	int i = 0;
+	for (; i + 4 <= sparseSize; i += 4) {
+		__m256d a = _mm256_i32gather_pd(x, _mm_loadu_si128((const __m128i *) (k + i)), 8);
+		_mm256_storeu_pd(r, _mm256_add_pd(
+					_mm256_max_pd(_mm256_sub_pd(a, vu), zero),
+					_mm256_min_pd(_mm256_add_pd(a, vu), zero)));
+		x[k[i]] = r[0];
+		x[k[i + 1]] = r[1];
+		x[k[i + 2]] = r[2];
+		x[k[i + 3]] = r[3];
+	}
+	l1_shrink_mask_scalar(x, u, k + i, sparseSize - i);
+}
+
+/**
+ * AVX-512F gathers and scatters
+ */
+
+__attribute__((target("avx512f"))) static double
+dot_dss_avx512(const double *x, const int *k, const double *v, const int sparseSize) {
+	__m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+	double ret;
+	int i = 0;
+	for (; i + 16 <= sparseSize; i += 16) {
+		__m512d x0 = _mm512_i32gather_pd(_mm256_loadu_si256((const __m256i *) (k + i)), x, 8);
+		__m512d x1 = _mm512_i32gather_pd(_mm256_loadu_si256((const __m256i *) (k + i + 8)), x, 8);
+		acc0 = _mm512_fmadd_pd(x0, _mm512_loadu_pd(v + i), acc0);
+		acc1 = _mm512_fmadd_pd(x1, _mm512_loadu_pd(v + i + 8), acc1);
+	}
+	if (i + 8 <= sparseSize) {
+		__m512d x0 = _mm512_i32gather_pd(_mm256_loadu_si256((const __m256i *) (k + i)), x, 8);
+		acc0 = _mm512_fmadd_pd(x0, _mm512_loadu_pd(v + i), acc0);
+		i += 8;
+	}
+	ret = _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+	for (; i < sparseSize; i++) {
+		ret += x[k[i]]*v[i];
+	}
+	return ret;
+}
+
+__attribute__((target("avx512f"))) static void
+add_and_scale_dss_avx512(double *x, const int *k, const double *v, const int sparseSize, const double c) {
+	__m512d vc = _mm512_set1_pd(c);
+	int i = 0;
+	for (; i + 8 <= sparseSize; i += 8) {
+		__m256i idx = _mm256_loadu_si256((const __m256i *) (k + i));
+		__m512d xk = _mm512_i32gather_pd(idx, x, 8);
+		_mm512_i32scatter_pd(x, idx, _mm512_fmadd_pd(_mm512_loadu_pd(v + i), vc, xk), 8);
+	}
+	add_and_scale_dss_scalar(x, k + i, v + i, sparseSize - i, c);
+}
+
+__attribute__((target("avx512f"))) static void
+l1_shrink_mask_avx512(double *x, const double u, const int *k, const int sparseSize) {
+	__m512d vu = _mm512_set1_pd(u), zero = _mm512_setzero_pd();
+	int i = 0;
+	for (; i + 8 <= sparseSize; i += 8) {
+		__m256i idx = _mm256_loadu_si256((const __m256i *) (k + i));
+		__m512d a = _mm512_i32gather_pd(idx, x, 8);
+		_mm512_i32scatter_pd(x, idx, _mm512_add_pd(
+					_mm512_max_pd(_mm512_sub_pd(a, vu), zero),
+					_mm512_min_pd(_mm512_add_pd(a, vu), zero)), 8);
+	}
+	l1_shrink_mask_scalar(x, u, k + i, sparseSize - i);
+}
+
+/**
+ * AVX2 + FMA float weights, 4 double lanes of converted floats
+ */
+
+__attribute__((target("avx2,fma"))) static double
+dot_f_avx2(const float *x, const double *y, const int size) {
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+	double ret[4];
+	int i = 0;
+	for (; i + 8 <= size; i += 8) {
+		acc0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(x + i)), _mm256_loadu_pd(y + i), acc0);
+		acc1 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(x + i + 4)), _mm256_loadu_pd(y + i + 4), acc1);
+	}
+	if (i + 4 <= size) {
+		acc0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm_loadu_ps(x + i)), _mm256_loadu_pd(y + i), acc0);
+		i += 4;
+	}
+	_mm256_storeu_pd(ret, _mm256_add_pd(acc0, acc1));
+	ret[0] += ret[1] + ret[2] + ret[3];
+	for (; i < size; i++) {
+		ret[0] += x[i]*y[i];
+	}
+	return ret[0];
+}
+
+__attribute__((target("avx2,fma"))) static void
+add_and_scale_f_avx2(float *x, const int size, const double *y, const double c) {
+	__m256d vc = _mm256_set1_pd(c);
+	int i = 0;
+	for (; i + 4 <= size; i += 4) {
+		_mm_storeu_ps(x + i, _mm256_cvtpd_ps(_mm256_fmadd_pd(_mm256_loadu_pd(y + i), vc,
+						_mm256_cvtps_pd(_mm_loadu_ps(x + i)))));
+	}
+	add_and_scale_f_scalar(x + i, size - i, y + i, c);
+}
+
+__attribute__((target("avx2,fma"))) static void
+scale_i_f_avx2(float *x, const int size, const double c) {
+	__m256d vc = _mm256_set1_pd(c);
+	int i = 0;
+	for (; i + 4 <= size; i += 4) {
+		_mm_storeu_ps(x + i, _mm256_cvtpd_ps(_mm256_mul_pd(
+						_mm256_cvtps_pd(_mm_loadu_ps(x + i)), vc)));
+	}
+	scale_i_f_scalar(x + i, size - i, c);
+}
+
+__attribute__((target("avx2,fma"))) static void
+l1_shrink_mask_d_f_avx2(float *x, const double u, const int size) {
+	__m256d vu = _mm256_set1_pd(u), zero = _mm256_setzero_pd();
+	int i = 0;
+	for (; i + 4 <= size; i += 4) {
+		__m256d a = _mm256_cvtps_pd(_mm_loadu_ps(x + i));
+		_mm_storeu_ps(x + i, _mm256_cvtpd_ps(_mm256_add_pd(
+						_mm256_max_pd(_mm256_sub_pd(a, vu), zero),
+						_mm256_min_pd(_mm256_add_pd(a, vu), zero))));
+	}
+	l1_shrink_mask_d_f_scalar(x + i, u, size - i);
+}
+
+__attribute__((target("avx2,fma"))) static double
+dot_dss_f_avx2(const float *x, const int *k, const double *v, const int sparseSize) {
+	__m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+	double ret[4];
+	int i = 0;
+	for (; i + 8 <= sparseSize; i += 8) {
+		__m256 xk = _mm256_i32gather_ps(x, _mm256_loadu_si256((const __m256i *) (k + i)), 4);
+		acc0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(xk)),
+				_mm256_loadu_pd(v + i), acc0);
+		acc1 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(xk, 1)),
+				_mm256_loadu_pd(v + i + 4), acc1);
+	}
+	_mm256_storeu_pd(ret, _mm256_add_pd(acc0, acc1));
+	ret[0] += ret[1] + ret[2] + ret[3];
+	for (; i < sparseSize; i++) {
+		ret[0] += x[k[i]]*v[i];
+	}
+	return ret[0];
+}
+
+__attribute__((target("avx2,fma"))) static void
+add_and_scale_dss_f_avx2(float *x, const int *k, const double *v, const int sparseSize, const double c) {
+	__m256d vc = _mm256_set1_pd(c);
+	float r[4];
+	int i = 0;
+	for (; i + 4 <= sparseSize; i += 4) {
+		__m128 xk = _mm_i32gather_ps(x, _mm_loadu_si128((const __m128i *) (k + i)), 4);
+		_mm_storeu_ps(r, _mm256_cvtpd_ps(_mm256_fmadd_pd(_mm256_loadu_pd(v + i), vc,
+						_mm256_cvtps_pd(xk))));
+		x[k[i]] = r[0];
+		x[k[i + 1]] = r[1];
+		x[k[i + 2]] = r[2];
+		x[k[i + 3]] = r[3];
+	}
+	add_and_scale_dss_f_scalar(x, k + i, v + i, sparseSize - i, c);
+}
+
+/**
+ * AVX-512F float weights, 8 double lanes of converted floats, masked tails
+ */
+
+__attribute__((target("avx512f"))) static double
+dot_f_avx512(const float *x, const double *y, const int size) {
+	__m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+	int i = 0;
+	for (; i + 16 <= size; i += 16) {
+		__m512 xf = _mm512_loadu_ps(x + i);
+		acc0 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(xf)),
+				_mm512_loadu_pd(y + i), acc0);
+		acc1 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_castpd_ps(
+						_mm512_extractf64x4_pd(_mm512_castps_pd(xf), 1))),
+				_mm512_loadu_pd(y + i + 8), acc1);
+	}
+	for (; i < size; i += 8) {
+		__mmask8 m = (size - i >= 8) ? 0xFF : (__mmask8) ((1u << (size - i)) - 1);
+		acc0 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(
+						_mm512_maskz_loadu_ps(m, x + i))),
+				_mm512_maskz_loadu_pd(m, y + i), acc0);
+	}
+	return _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+}
+
+__attribute__((target("avx512f"))) static void
+add_and_scale_f_avx512(float *x, const int size, const double *y, const double c) {
+	__m512d vc = _mm512_set1_pd(c);
+	int i;
+	for (i = 0; i < size; i += 8) {
+		__mmask8 m = (size - i >= 8) ? 0xFF : (__mmask8) ((1u << (size - i)) - 1);
+		__m512d a = _mm512_cvtps_pd(_mm512_castps512_ps256(_mm512_maskz_loadu_ps(m, x + i)));
+		_mm512_mask_storeu_ps(x + i, m, _mm512_castps256_ps512(_mm512_cvtpd_ps(
+						_mm512_fmadd_pd(_mm512_maskz_loadu_pd(m, y + i), vc, a))));
+	}
+}
+
+__attribute__((target("avx512f"))) static void
+scale_i_f_avx512(float *x, const int size, const double c) {
+	__m512d vc = _mm512_set1_pd(c);
+	int i;
+	for (i = 0; i < size; i += 8) {
+		__mmask8 m = (size - i >= 8) ? 0xFF : (__mmask8) ((1u << (size - i)) - 1);
+		__m512d a = _mm512_cvtps_pd(_mm512_castps512_ps256(_mm512_maskz_loadu_ps(m, x + i)));
+		_mm512_mask_storeu_ps(x + i, m, _mm512_castps256_ps512(_mm512_cvtpd_ps(
+						_mm512_mul_pd(a, vc))));
+	}
+}
+
+__attribute__((target("avx512f"))) static void
+l1_shrink_mask_d_f_avx512(float *x, const double u, const int size) {
+	__m512d vu = _mm512_set1_pd(u), zero = _mm512_setzero_pd();
+	int i;
+	for (i = 0; i < size; i += 8) {
+		__mmask8 m = (size - i >= 8) ? 0xFF : (__mmask8) ((1u << (size - i)) - 1);
+		__m512d a = _mm512_cvtps_pd(_mm512_castps512_ps256(_mm512_maskz_loadu_ps(m, x + i)));
+		_mm512_mask_storeu_ps(x + i, m, _mm512_castps256_ps512(_mm512_cvtpd_ps(_mm512_add_pd(
+						_mm512_max_pd(_mm512_sub_pd(a, vu), zero),
+						_mm512_min_pd(_mm512_add_pd(a, vu), zero)))));
+	}
+}
+
+/* the low 8 of 16 float lanes gathered and scattered, by the mask 0xFF */
+__attribute__((target("avx512f"))) static double
+dot_dss_f_avx512(const float *x, const int *k, const double *v, const int sparseSize) {
+	__m512d acc0 = _mm512_setzero_pd(), acc1 = _mm512_setzero_pd();
+	double ret;
+	int i = 0;
+	for (; i + 16 <= sparseSize; i += 16) {
+		__m512 xk = _mm512_i32gather_ps(_mm512_loadu_si512((const void *) (k + i)), x, 4);
+		acc0 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(xk)),
+				_mm512_loadu_pd(v + i), acc0);
+		acc1 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_castpd_ps(
+						_mm512_extractf64x4_pd(_mm512_castps_pd(xk), 1))),
+				_mm512_loadu_pd(v + i + 8), acc1);
+	}
+	if (i + 8 <= sparseSize) {
+		__m512 xk = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFF,
+				_mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *) (k + i))), x, 4);
+		acc0 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(xk)),
+				_mm512_loadu_pd(v + i), acc0);
+		i += 8;
+	}
+	ret = _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+	for (; i < sparseSize; i++) {
+		ret += x[k[i]]*v[i];
+	}
+	return ret;
+}
+
+__attribute__((target("avx512f"))) static void
+add_and_scale_dss_f_avx512(float *x, const int *k, const double *v, const int sparseSize, const double c) {
+	__m512d vc = _mm512_set1_pd(c);
+	int i = 0;
+	for (; i + 8 <= sparseSize; i += 8) {
+		__m512i idx = _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i *) (k + i)));
+		__m512d xk = _mm512_cvtps_pd(_mm512_castps512_ps256(
+					_mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFF, idx, x, 4)));
+		_mm512_mask_i32scatter_ps(x, 0xFF, idx, _mm512_castps256_ps512(_mm512_cvtpd_ps(
+						_mm512_fmadd_pd(_mm512_loadu_pd(v + i), vc, xk))), 4);
+	}
+	add_and_scale_dss_f_scalar(x, k + i, v + i, sparseSize - i, c);
+}
+
+/**
+ * AVX2 + FMA log domain kernels, 4 lanes, masked tails
+ */
+
+/* lanes [0, n) of 4 */
+__attribute__((target("avx2,fma"))) static inline __m256i
+tail_mask_avx2(const int n) {
+	return _mm256_cmpgt_epi64(_mm256_set1_epi64x(n), _mm256_set_epi64x(3, 2, 1, 0));
+}
+
+/**
+ * exp of 4 lanes: x = k ln2 + r with |r| <= ln2 / 2, exp(x) = 2^k * p(r),
+ * p the degree 12 taylor polynomial (relative error below 1e-15).
+ * x is clamped to 709 above, results below exp(-708) are flushed to 0
+ */
+__attribute__((target("avx2,fma"))) static inline __m256d
+exp_avx2_pd(__m256d x) {
+	const __m256d under = _mm256_cmp_pd(x, _mm256_set1_pd(-708.0), _CMP_LT_OQ);
+	__m256d k, r, p;
+	__m256i e;
+	x = _mm256_max_pd(_mm256_min_pd(x, _mm256_set1_pd(709.0)), _mm256_set1_pd(-708.0));
+	k = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.44269504088896340736)),
+			_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	// ln2 in two parts, so k * ln2_hi is exact
+	r = _mm256_fnmadd_pd(k, _mm256_set1_pd(6.93147180369123816490e-01), x);
+	r = _mm256_fnmadd_pd(k, _mm256_set1_pd(1.90821492927058770002e-10), r);
+	p = _mm256_set1_pd(1.0 / 479001600);
+	p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 39916800));
+	p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 3628800));
+	p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 362880));
+	p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 40320));
+	p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 5040));
+	p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 720));
+	p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 120));
+	p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 24));
+	p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 6));
+	p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / 2));
+	p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+	p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+	// 2^k built in the exponent bits
+	e = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(k));
+	e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52);
+	return _mm256_andnot_pd(under, _mm256_mul_pd(p, _mm256_castsi256_pd(e)));
+}
+
+/* 4 columns of M at a time, the rows of the block are streamed twice */
+__attribute__((target("avx2,fma"))) static void
+log_vm_avx2(const double *a, const double *M, const int n, double *out) {
+	double m[4], s[4];
+	int y, yp, l;
+	for (y = 0; y < n; y += 4) {
+		__m256i mask = tail_mask_avx2(n - y);
+		__m256d vm = _mm256_set1_pd(-HUGE_VAL), vs = _mm256_setzero_pd();
+		for (yp = 0; yp < n; yp++) {
+			__m256d v = _mm256_add_pd(_mm256_set1_pd(a[yp]),
+					_mm256_maskload_pd(M + yp * n + y, mask));
+			vm = _mm256_max_pd(vm, v);
+		}
+		for (yp = 0; yp < n; yp++) {
+			__m256d v = _mm256_add_pd(_mm256_set1_pd(a[yp]),
+					_mm256_maskload_pd(M + yp * n + y, mask));
+			vs = _mm256_add_pd(vs, exp_avx2_pd(_mm256_sub_pd(v, vm)));
+		}
+		_mm256_storeu_pd(m, vm);
+		_mm256_storeu_pd(s, vs);
+		for (l = 0; l < 4 && y + l < n; l++) {
+			out[y + l] = m[l] + log(s[l]);
+		}
+	}
+}
+
+/* one row of M at a time, reduced across the lanes */
+__attribute__((target("avx2,fma"))) static void
+log_mv_avx2(const double *M, const double *b, const int n, double *out) {
+	const __m256d ninf = _mm256_set1_pd(-HUGE_VAL);
+	double m[4], s[4];
+	int y, yp;
+	for (yp = 0; yp < n; yp++) {
+		const double *row = M + yp * n;
+		__m256d vm = ninf, vs = _mm256_setzero_pd();
+		for (y = 0; y < n; y += 4) {
+			__m256i mask = tail_mask_avx2(n - y);
+			__m256d v = _mm256_add_pd(_mm256_maskload_pd(row + y, mask),
+					_mm256_maskload_pd(b + y, mask));
+			vm = _mm256_max_pd(vm, _mm256_blendv_pd(ninf, v, _mm256_castsi256_pd(mask)));
+		}
+		_mm256_storeu_pd(m, vm);
+		if (m[1] > m[0]) { m[0] = m[1]; }
+		if (m[2] > m[0]) { m[0] = m[2]; }
+		if (m[3] > m[0]) { m[0] = m[3]; }
+		vm = _mm256_set1_pd(m[0]);
+		for (y = 0; y < n; y += 4) {
+			__m256i mask = tail_mask_avx2(n - y);
+			__m256d v = _mm256_add_pd(_mm256_maskload_pd(row + y, mask),
+					_mm256_maskload_pd(b + y, mask));
+			vs = _mm256_add_pd(vs, _mm256_and_pd(exp_avx2_pd(_mm256_sub_pd(v, vm)),
+						_mm256_castsi256_pd(mask)));
+		}
+		_mm256_storeu_pd(s, vs);
+		out[yp] = m[0] + log(s[0] + s[1] + s[2] + s[3]);
+	}
+}
+
+__attribute__((target("avx2,fma"))) static void
+exp_i_avx2(double *x, const int size) {
+	int i;
+	for (i = 0; i < size; i += 4) {
+		__m256i mask = tail_mask_avx2(size - i);
+		_mm256_maskstore_pd(x + i, mask, exp_avx2_pd(_mm256_maskload_pd(x + i, mask)));
+	}
+}
+
+#endif /* NUMERIC_X86 */
+
+/**
+ * the scalar kernels, and the active ones, scalar until
+ * numeric_kernels_init() has run. defined here (not static) for the
+ * same reason as gaussrand(): every .so is built from exactly one
+ * translation unit
+ */
+const struct NumericKernels numeric_scalar_kernels = {
+	"scalar",
+	dot_scalar,
+	add_and_scale_scalar,
+	scale_i_scalar,
+	norm_scalar,
+	l1_shrink_mask_d_scalar,
+	"scalar",
+	dot_dss_scalar,
+	add_and_scale_dss_scalar,
+	l1_shrink_mask_scalar,
+	"scalar",
+	log_vm_scalar,
+	log_mv_scalar,
+	exp_i_scalar,
+	dot_f_scalar,
+	add_and_scale_f_scalar,
+	scale_i_f_scalar,
+	l1_shrink_mask_d_f_scalar,
+	dot_dss_f_scalar,
+	add_and_scale_dss_f_scalar
+};
+
+struct NumericKernels numeric_kernels;
+
+/**
+ * pick the widest kernels supported by the host cpu (cpuid),
+ * run once by the dynamic loader when the .so is loaded
+ */
+__attribute__((constructor)) static void
+numeric_kernels_init(void) {
+	struct NumericKernels *k = &numeric_kernels;
+	*k = numeric_scalar_kernels;
+#ifdef NUMERIC_X86
+	__builtin_cpu_init();
+	// log domain kernels, the 4 lanes are used on avx512 hosts as well
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		k->log_name = "avx2";
+		k->log_vm = log_vm_avx2;
+		k->log_mv = log_mv_avx2;
+		k->exp_i = exp_i_avx2;
+	}
+	if (__builtin_cpu_supports("avx512f")) {
+		k->name = "avx512";
+		k->dot = dot_avx512;
+		k->add_and_scale = add_and_scale_avx512;
+		k->scale_i = scale_i_avx512;
+		k->norm = norm_avx512;
+		k->l1_shrink_mask_d = l1_shrink_mask_d_avx512;
+		k->dot_f = dot_f_avx512;
+		k->add_and_scale_f = add_and_scale_f_avx512;
+		k->scale_i_f = scale_i_f_avx512;
+		k->l1_shrink_mask_d_f = l1_shrink_mask_d_f_avx512;
+		k->sparse_name = "avx512";
+		k->dot_dss = dot_dss_avx512;
+		k->add_and_scale_dss = add_and_scale_dss_avx512;
+		k->l1_shrink_mask = l1_shrink_mask_avx512;
+		k->dot_dss_f = dot_dss_f_avx512;
+		k->add_and_scale_dss_f = add_and_scale_dss_f_avx512;
+		return;
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		k->name = "avx2";
+		k->dot = dot_avx2;
+		k->add_and_scale = add_and_scale_avx2;
+		k->scale_i = scale_i_avx2;
+		k->norm = norm_avx2;
+		k->l1_shrink_mask_d = l1_shrink_mask_d_avx2;
+		k->dot_f = dot_f_avx2;
+		k->add_and_scale_f = add_and_scale_f_avx2;
+		k->scale_i_f = scale_i_f_avx2;
+		k->l1_shrink_mask_d_f = l1_shrink_mask_d_f_avx2;
+		k->sparse_name = "avx2";
+		k->dot_dss = dot_dss_avx2;
+		k->add_and_scale_dss = add_and_scale_dss_avx2;
+		k->l1_shrink_mask = l1_shrink_mask_avx2;
+		k->dot_dss_f = dot_dss_f_avx2;
+		k->add_and_scale_dss_f = add_and_scale_dss_f_avx2;
+		return;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		k->name = "sse2";
+		k->dot = dot_sse2;
+		k->add_and_scale = add_and_scale_sse2;
+		k->scale_i = scale_i_sse2;
+		k->norm = norm_sse2;
+		k->l1_shrink_mask_d = l1_shrink_mask_d_sse2;
+	}
+#endif
+	// no usable gathers, the sparse kernels stay scalar: software
+	// prefetching of x[k[i]] was slower at every nnz (bench/)
+}
+
+#endif
@@ -0,0 +1,158 @@
+/*
+Copyright 2012 Xixuan (Aaron) Feng and Arun Kumar and Christopher Re
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+/**
+ * a lock word for models in shared memory, taken by many backends.
+ *
+ * test-and-test-and-set with exponential backoff of pause instructions,
+ * so waiters spin on their own cached copy instead of bouncing the line.
+ * built with -DLOCK_FUTEX, a waiter that spun SPIN_LOCK_PARK rounds parks
+ * in the kernel on a (process shared) futex until the holder wakes it.
+ *
+ * every lock counts its acquisitions, the pause instructions spent
+ * waiting and the wait time in ns. the counters sit next to the token and
+ * are only written by the holder, so they cost no extra cache traffic.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define spin_pause() _mm_pause()
+#else
+#define spin_pause() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+#ifdef LOCK_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// pause instructions of the longest backoff round
+#define SPIN_LOCK_MAX_BACKOFF (1024)
+// backoff rounds before a waiter parks (-DLOCK_FUTEX)
+#define SPIN_LOCK_PARK (16)
+
+struct SpinLock {
+	// 0 free, 1 held, 2 held with parked waiters
+	volatile int token;
+	int pad;
+	// contention counters
+	uint64_t nAcquires;
+	uint64_t nSpins;
+	uint64_t waitNs;
+};
+
+/** counters summed over one or more locks */
+struct LockStats {
+	double nAcquires;
+	double nSpins;
+	double waitNs;
+};
+
+inline void
+spin_lock_init(struct SpinLock *lock) {
+	lock->token = 0;
+	lock->nAcquires = 0;
+	lock->nSpins = 0;
+	lock->waitNs = 0;
+}
+
+inline int
+spin_lock_try(struct SpinLock *lock) {
+	int oldvar = 0;
+	return __atomic_compare_exchange_n(&(lock->token), &oldvar, 1, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+inline uint64_t
+spin_lock_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * declared extern too, so every .so (each is one translation unit) gets a
+ * copy of these where gcc does not inline them
+ */
+extern void spin_lock_slow(struct SpinLock *lock);
+extern void spin_lock(struct SpinLock *lock);
+extern void spin_unlock(struct SpinLock *lock);
+
+/** the contended path of spin_lock */
+inline void
+spin_lock_slow(struct SpinLock *lock) {
+	uint64_t start = spin_lock_now_ns();
+	uint64_t spins = 0;
+	int backoff = 1;
+	int rounds = 0;
+	int i;
+	for (;;) {
+		// wait until it looks free, then try
+		if (lock->token == 0 && spin_lock_try(lock)) { break; }
+		for (i = 0; i < backoff; i++) { spin_pause(); }
+		spins += backoff;
+		if (backoff < SPIN_LOCK_MAX_BACKOFF) { backoff <<= 1; }
+#ifdef LOCK_FUTEX
+		if (++rounds >= SPIN_LOCK_PARK) {
+			// mark the lock as having waiters and sleep until it is released,
+			// whoever takes it this way also wakes the next one on release
+			while (__atomic_exchange_n(&(lock->token), 2, __ATOMIC_ACQUIRE) != 0) {
+				syscall(SYS_futex, &(lock->token), FUTEX_WAIT, 2, NULL, NULL, 0);
+			}
+			break;
+		}
+#endif
+	}
+	(void) rounds;
+	// we hold the lock, the counters are ours
+	lock->nSpins += spins;
+	lock->waitNs += spin_lock_now_ns() - start;
+}
+
+inline void
+spin_lock(struct SpinLock *lock) {
+	if (!spin_lock_try(lock)) {
+		spin_lock_slow(lock);
+	}
+	lock->nAcquires ++;
+}
+
+inline void
+spin_unlock(struct SpinLock *lock) {
+#ifdef LOCK_FUTEX
+	if (__atomic_exchange_n(&(lock->token), 0, __ATOMIC_RELEASE) == 2) {
+		syscall(SYS_futex, &(lock->token), FUTEX_WAKE, 1, NULL, NULL, 0);
+	}
+#else
+	__atomic_store_n(&(lock->token), 0, __ATOMIC_RELEASE);
+#endif
+}
+
+inline void
+spin_lock_stats_add(struct LockStats *stats, const struct SpinLock *lock) {
+	stats->nAcquires += lock->nAcquires;
+	stats->nSpins += lock->nSpins;
+	stats->waitNs += lock->waitNs;
+}
+
+#endif